@@ -2,10 +2,17 @@
 #include "gpiolib_addr.h"
 
 #include <fcntl.h>
+#include <linux/gpio.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #define GPIO_MEM_FILE "/dev/gpiomem"
 
@@ -26,17 +33,402 @@ GPIO_Handle gpiolib_init_gpio(void)
   return ret;
 }
 
+/* Shadow copies of the function select registers, one per handle that
+ * has been configured until it is freed.  GPFSEL only changes when we
+ * write it, so reads after the first can come from here instead of the
+ * bus.  A handle past the first FSEL_SHADOWS just reads the bus. */
+#define FSEL_REGS    6
+#define FSEL_SHADOWS 4
+
+struct fsel_shadow {
+  GPIO_Handle handle;             /* NULL if the slot is free */
+  uint32_t    loaded;             /* bit n set once fsel[n] is valid */
+  uint32_t    fsel[FSEL_REGS];
+};
+
+static struct fsel_shadow shadows[FSEL_SHADOWS];
+
+static struct fsel_shadow* shadow_find(GPIO_Handle handle)
+{
+  for (int i = 0; i < FSEL_SHADOWS; i++)
+    if (shadows[i].handle == handle)
+      return &shadows[i];
+  return NULL;
+}
+
+/* the handle's shadow, taking a free slot for it if it has none */
+static struct fsel_shadow* shadow_claim(GPIO_Handle handle)
+{
+  struct fsel_shadow* s = shadow_find(handle);
+  if (s == NULL && (s = shadow_find(NULL)) != NULL) {
+    s->handle = handle;
+    s->loaded = 0;
+  }
+  return s;
+}
+
+static void shadow_forget(GPIO_Handle handle)
+{
+  struct fsel_shadow* s = shadow_find(handle);
+  if (s != NULL) {
+    s->handle = NULL;
+    s->loaded = 0;
+  }
+}
+
 void gpiolib_free_gpio(GPIO_Handle handle)
 {
+  shadow_forget(handle);
   munmap(handle, GPIO_LEN);
 }
 
 void gpiolib_write_reg(GPIO_Handle handle, uint32_t offst, uint32_t data)
 {
-  *(handle + offst) = data;
+  struct fsel_shadow* s;
+  if (offst < GPFSEL(FSEL_REGS) && (s = shadow_find(handle)) != NULL) {
+    s->fsel[offst] = data;
+    s->loaded |= 1u << offst;
+  }
+  *(volatile uint32_t*)(handle + offst) = data;
 }
 
 uint32_t gpiolib_read_reg(GPIO_Handle handle, uint32_t offst)
 {
-  return *(handle + offst);
+  return *(volatile uint32_t*)(handle + offst);
+}
+
+int gpiolib_set_function(GPIO_Handle handle, uint32_t mask, int function)
+{
+  uint32_t fsel[FSEL_REGS];
+  uint32_t dirty = 0;
+  int pin, reg;
+
+  if (function < 0 || function > 7)
+    return -1;
+
+  /* without a slot the registers are read for this call only */
+  struct fsel_shadow unshared = { handle, 0, {0} };
+  struct fsel_shadow* shadow = shadow_claim(handle);
+  if (shadow == NULL)
+    shadow = &unshared;
+
+  for (pin = 0; pin < 32; pin++) {
+    int shift = (pin % 10) * 3;
+
+    if (!(mask & (1u << pin)))
+      continue;
+    reg = pin / 10;
+    if (!(shadow->loaded & (1u << reg))) {
+      shadow->fsel[reg] = gpiolib_read_reg(handle, GPFSEL(reg));
+      shadow->loaded |= 1u << reg;
+    }
+    if (!(dirty & (1u << reg)))
+      fsel[reg] = shadow->fsel[reg];
+    fsel[reg] = (fsel[reg] & ~(7u << shift)) | ((uint32_t)function << shift);
+    dirty |= 1u << reg;
+  }
+
+  /* only registers whose value actually changes are written */
+  for (reg = 0; reg < FSEL_REGS; reg++)
+    if ((dirty & (1u << reg)) && fsel[reg] != shadow->fsel[reg])
+      gpiolib_write_reg(handle, GPFSEL(reg), fsel[reg]);
+
+  return 0;
+}
+
+/* Simulated backend */
+
+#define SIM_MAX_ULTRA 4
+#define SIM_MAX_SOUND 4
+#define SIM_TICK_US   100
+#define SIM_SOUND_US  5000
+
+struct gpiolib_sim {
+  uint32_t  regs[GPIO_LEN / 4];   /* must be first, the handle points here */
+  pthread_t thread;
+  volatile int running;
+  unsigned  seed;
+
+  int nUltra;
+  struct { int trig, echo, distCm, baseCm; } ultra[SIM_MAX_ULTRA];
+
+  int nSound;
+  struct { int pin, perMinute; long until; } sound[SIM_MAX_SOUND];
+};
+
+static long sim_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void sim_sleep_us(long us)
+{
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+  nanosleep(&ts, NULL);
+}
+
+static void sim_level(struct gpiolib_sim* sim, int pin, int high)
+{
+  if (high)
+    __atomic_fetch_or(&sim->regs[GPLEV(0)], 1u << pin, __ATOMIC_SEQ_CST);
+  else
+    __atomic_fetch_and(&sim->regs[GPLEV(0)], ~(1u << pin), __ATOMIC_SEQ_CST);
+}
+
+/* one echo: the distance drifts by a centimetre and now and then the
+ * sleeper rolls over and it jumps */
+static void sim_echo(struct gpiolib_sim* sim, int i)
+{
+  int r = rand_r(&sim->seed) % 1000;
+  if (r < 5)
+    sim->ultra[i].distCm = sim->ultra[i].baseCm + rand_r(&sim->seed) % 41 - 20;
+  else if (r < 500)
+    sim->ultra[i].distCm += (r & 1) ? 1 : -1;
+  if (sim->ultra[i].distCm < 2)
+    sim->ultra[i].distCm = 2;
+
+  sim_sleep_us(50);
+  sim_level(sim, sim->ultra[i].echo, 1);
+  sim_sleep_us(sim->ultra[i].distCm * 58L);
+  sim_level(sim, sim->ultra[i].echo, 0);
+}
+
+static void* sim_thread(void* arg)
+{
+  struct gpiolib_sim* sim = arg;
+  uint32_t trig = 0;
+
+  while (sim->running) {
+    uint32_t set = __atomic_exchange_n(&sim->regs[GPSET(0)], 0, __ATOMIC_SEQ_CST);
+    uint32_t clr = __atomic_exchange_n(&sim->regs[GPCLR(0)], 0, __ATOMIC_SEQ_CST);
+    long now = sim_now_us();
+    int i;
+
+    trig |= set;
+    for (i = 0; i < sim->nUltra; i++) {
+      uint32_t mask = 1u << sim->ultra[i].trig;
+      /* the falling edge of the trigger pulse starts the echo */
+      if ((trig & mask) && (clr & mask)) {
+        trig &= ~mask;
+        sim_echo(sim, i);
+      }
+    }
+
+    for (i = 0; i < sim->nSound; i++) {
+      if (sim->sound[i].until && now >= sim->sound[i].until) {
+        sim->sound[i].until = 0;
+        sim_level(sim, sim->sound[i].pin, 0);
+      }
+      else if (!sim->sound[i].until && (long)(rand_r(&sim->seed) % 60000000) < (long)sim->sound[i].perMinute * SIM_TICK_US) {
+        sim->sound[i].until = now + SIM_SOUND_US;
+        sim_level(sim, sim->sound[i].pin, 1);
+      }
+    }
+
+    sim_sleep_us(SIM_TICK_US);
+  }
+  return NULL;
+}
+
+GPIO_Handle gpiolib_init_sim(unsigned seed)
+{
+  struct gpiolib_sim* sim = calloc(1, sizeof(*sim));
+  if (sim == NULL)
+    return NULL;
+
+  sim->seed = seed;
+  sim->running = 1;
+  if (pthread_create(&sim->thread, NULL, sim_thread, sim) != 0) {
+    free(sim);
+    return NULL;
+  }
+  return sim->regs;
+}
+
+void gpiolib_free_sim(GPIO_Handle handle)
+{
+  struct gpiolib_sim* sim = (struct gpiolib_sim*)handle;
+  if (sim == NULL)
+    return;
+  sim->running = 0;
+  pthread_join(sim->thread, NULL);
+  shadow_forget(handle);
+  free(sim);
+}
+
+/* pins are set up before the thread sees them, so call these right after
+ * gpiolib_init_sim */
+int gpiolib_sim_ultra(GPIO_Handle handle, int trigPin, int echoPin, int distCm)
+{
+  struct gpiolib_sim* sim = (struct gpiolib_sim*)handle;
+  if (sim == NULL || sim->nUltra == SIM_MAX_ULTRA)
+    return -1;
+  sim->ultra[sim->nUltra].trig = trigPin;
+  sim->ultra[sim->nUltra].echo = echoPin;
+  sim->ultra[sim->nUltra].distCm = distCm;
+  sim->ultra[sim->nUltra].baseCm = distCm;
+  __atomic_store_n(&sim->nUltra, sim->nUltra + 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+int gpiolib_sim_sound(GPIO_Handle handle, int pin, int perMinute)
+{
+  struct gpiolib_sim* sim = (struct gpiolib_sim*)handle;
+  if (sim == NULL || sim->nSound == SIM_MAX_SOUND)
+    return -1;
+  sim->sound[sim->nSound].pin = pin;
+  sim->sound[sim->nSound].perMinute = perMinute;
+  sim->sound[sim->nSound].until = 0;
+  __atomic_store_n(&sim->nSound, sim->nSound + 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+/* Character device backend */
+
+struct gpiolib_events {
+  int outFd;              /* line request for the outputs, -1 if none */
+  int inFd;               /* line request for the inputs, edges are read here */
+  int epoll;
+  int nOut;
+  int nIn;
+  int outPins[GPIOLIB_EVENT_PINS];
+  int inPins[GPIOLIB_EVENT_PINS];
+};
+
+static int events_request(int chipFd, const int* pins, int n, uint64_t flags)
+{
+  struct gpio_v2_line_request req;
+  int i;
+
+  memset(&req, 0, sizeof(req));
+  for (i = 0; i < n; i++)
+    req.offsets[i] = pins[i];
+  req.num_lines = n;
+  req.config.flags = flags;
+  req.event_buffer_size = 64;
+  strcpy(req.consumer, "sleep_record");
+
+  if (ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+    return -1;
+  return req.fd;
+}
+
+GPIO_Events gpiolib_init_events(const char* chip, const int* outPins, int nOut, const int* inPins, int nIn)
+{
+  struct gpiolib_events* ev;
+  struct epoll_event ee;
+  int chipFd;
+  int i;
+
+  if (nOut > GPIOLIB_EVENT_PINS || nIn > GPIOLIB_EVENT_PINS || nIn < 1)
+    return NULL;
+  if ((chipFd = open(chip, O_RDWR | O_CLOEXEC)) == -1)
+    return NULL;
+  if ((ev = calloc(1, sizeof(*ev))) == NULL) {
+    close(chipFd);
+    return NULL;
+  }
+
+  ev->outFd = -1;
+  ev->nOut = nOut;
+  ev->nIn = nIn;
+  for (i = 0; i < nOut; i++)
+    ev->outPins[i] = outPins[i];
+  for (i = 0; i < nIn; i++)
+    ev->inPins[i] = inPins[i];
+
+  if (nOut > 0)
+    ev->outFd = events_request(chipFd, outPins, nOut, GPIO_V2_LINE_FLAG_OUTPUT);
+  ev->inFd = events_request(chipFd, inPins, nIn, GPIO_V2_LINE_FLAG_INPUT |
+                            GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING);
+  close(chipFd);
+
+  if ((nOut > 0 && ev->outFd == -1) || ev->inFd == -1 || (ev->epoll = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    if (ev->outFd != -1)
+      close(ev->outFd);
+    if (ev->inFd != -1)
+      close(ev->inFd);
+    free(ev);
+    return NULL;
+  }
+
+  memset(&ee, 0, sizeof(ee));
+  ee.events = EPOLLIN;
+  epoll_ctl(ev->epoll, EPOLL_CTL_ADD, ev->inFd, &ee);
+  return ev;
+}
+
+void gpiolib_free_events(GPIO_Events ev)
+{
+  if (ev == NULL)
+    return;
+  if (ev->outFd != -1)
+    close(ev->outFd);
+  close(ev->inFd);
+  close(ev->epoll);
+  free(ev);
+}
+
+int gpiolib_events_write(GPIO_Events ev, uint32_t setMask, uint32_t clearMask)
+{
+  struct gpio_v2_line_values values = {0, 0};
+  int i;
+
+  /* the request's bits are by position in outPins, not by pin number */
+  for (i = 0; i < ev->nOut; i++) {
+    uint32_t pin = 1u << ev->outPins[i];
+    if ((setMask | clearMask) & pin) {
+      values.mask |= 1ULL << i;
+      if (setMask & pin)
+        values.bits |= 1ULL << i;
+    }
+  }
+  if (values.mask == 0)
+    return 0;
+  return ioctl(ev->outFd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+}
+
+int gpiolib_events_levels(GPIO_Events ev, uint32_t* levels)
+{
+  struct gpio_v2_line_values values;
+  int i;
+
+  values.bits = 0;
+  values.mask = (1ULL << ev->nIn) - 1;
+  if (ioctl(ev->inFd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+    return -1;
+
+  *levels = 0;
+  for (i = 0; i < ev->nIn; i++)
+    if (values.bits & (1ULL << i))
+      *levels |= 1u << ev->inPins[i];
+  return 0;
+}
+
+int gpiolib_events_read(GPIO_Events ev, struct gpiolib_edge* edges, int max, int timeoutMs)
+{
+  struct gpio_v2_line_event raw[32];
+  struct epoll_event ee;
+  int n, i;
+
+  if (max > 32)
+    max = 32;
+  n = epoll_wait(ev->epoll, &ee, 1, timeoutMs);
+  if (n <= 0)
+    return (n < 0 && errno != EINTR) ? -1 : 0;
+
+  /* one read returns every queued edge that fits */
+  ssize_t len = read(ev->inFd, raw, max * sizeof(raw[0]));
+  if (len < 0)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+  n = len / sizeof(raw[0]);
+  for (i = 0; i < n; i++) {
+    edges[i].timestampNs = raw[i].timestamp_ns;
+    edges[i].pin = raw[i].offset;
+    edges[i].rising = raw[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+  }
+  return n;
 }
@@ -11,4 +11,52 @@ void        gpiolib_free_gpio(GPIO_Handle handle);
 void        gpiolib_write_reg(GPIO_Handle handle,uint32_t offst, uint32_t data);
 uint32_t    gpiolib_read_reg (GPIO_Handle handle, uint32_t offst);
 
+/* Sets every pin in mask to function, one write per GPFSEL register it
+ * touches.  The GPFSEL registers are read once and kept in a shadow copy
+ * for the handle after that, which gpiolib_write_reg keeps up to date.
+ * Returns -1 for an unknown function. */
+#define GPIO_FUNC_INPUT  0
+#define GPIO_FUNC_OUTPUT 1
+
+int         gpiolib_set_function(GPIO_Handle handle, uint32_t mask, int function);
+
+/* Simulated backend: registers live in ordinary memory and a thread acts
+ * like the sensors, so the recorder can run on any Linux box.
+ * gpiolib_sim_ultra makes a pulse on trigPin produce an echo on echoPin
+ * that wanders around distCm, gpiolib_sim_sound makes pin go high about
+ * perMinute times a minute. */
+GPIO_Handle gpiolib_init_sim(unsigned seed);
+void        gpiolib_free_sim(GPIO_Handle handle);
+int         gpiolib_sim_ultra(GPIO_Handle handle, int trigPin, int echoPin, int distCm);
+int         gpiolib_sim_sound(GPIO_Handle handle, int pin, int perMinute);
+
+/* Character device backend (/dev/gpiochipN).  Instead of polling the
+ * level register, the kernel timestamps every edge on the input lines and
+ * they are read in batches.  Pins are BCM numbers, which are the line
+ * offsets on the Pi's gpiochip0.  Works on any Linux box with gpio-sim or
+ * gpio-mockup loaded. */
+#define GPIOLIB_EVENT_PINS 16
+
+struct gpiolib_edge {
+  uint64_t timestampNs;   /* kernel timestamp, CLOCK_MONOTONIC */
+  int      pin;
+  int      rising;
+};
+
+typedef struct gpiolib_events* GPIO_Events;
+
+GPIO_Events gpiolib_init_events(const char* chip, const int* outPins, int nOut, const int* inPins, int nIn);
+void        gpiolib_free_events(GPIO_Events events);
+
+/* drives the output pins in setMask high and those in clearMask low, the
+ * masks have bit n set for pin n */
+int         gpiolib_events_write(GPIO_Events events, uint32_t setMask, uint32_t clearMask);
+
+/* current levels of the input pins, bit n for pin n */
+int         gpiolib_events_levels(GPIO_Events events, uint32_t* levels);
+
+/* waits up to timeoutMs (0 to not wait) and reads up to max edges,
+ * returns how many were read or -1 on error */
+int         gpiolib_events_read(GPIO_Events events, struct gpiolib_edge* edges, int max, int timeoutMs);
+
 #endif /* GPIO_REG_H */
@@ -0,0 +1,32 @@
+#ifndef SLEEP_ARCHIVE_H
+#define SLEEP_ARCHIVE_H
+
+#include <stdint.h>
+
+/* One sample or event, the unit that recorders send to the collector and
+ * that the archive stores.  Records are fixed size so files can be indexed
+ * and split without parsing. */
+struct SleepRecord {
+  int64_t  timeMs;    /* unix time in milliseconds */
+  int32_t  value;     /* meaning depends on kind */
+  uint16_t sensor;    /* sensor number, 0 if the record is not from a sensor */
+  uint16_t kind;      /* one of the REC_ values below */
+};
+
+#define REC_ULTRA     1   /* value is a distance in cm, -1 if the ping failed */
+#define REC_SOUND     2   /* value is 1, one record per second with sound */
+#define REC_PRESENCE  3   /* value is 1 when the user got into bed, 0 when they left */
+#define REC_RATE      4   /* value is the new ultrasonic interval in ms */
+#define REC_START     5   /* value is 0, a recording started at timeMs */
+#define REC_GAP       6   /* value is how long in ms the sound sensors weren't polled from timeMs */
+#define REC_END       7   /* value is 0, the recording that started last ended at timeMs */
+#define REC_FAST      8   /* value is the fast ultrasonic interval in ms, after a START and when it changes */
+#define REC_DROP      9   /* value is how long in ms from timeMs the recorder dropped records, its socket to the collector was full */
+
+/* a change in a sensor's distance of more than this many cm is movement */
+#define MIN_DIFF 8
+
+/* per device archive file: <archive dir>/<device id>.rec */
+#define ARCHIVE_SUFFIX ".rec"
+
+#endif /* SLEEP_ARCHIVE_H */
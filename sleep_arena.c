@@ -0,0 +1,47 @@
+#include "sleep_arena.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+int arena_init(struct Arena* a, size_t size)
+{
+  memset(a, 0, sizeof(*a));
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  /* populated up front so running out of memory shows up at startup and
+   * not in the middle of a night */
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (p == MAP_FAILED)
+    return -1;
+
+  a->base = p;
+  a->size = size;
+  return 0;
+}
+
+void arena_destroy(struct Arena* a)
+{
+  if (a->base != NULL)
+    munmap(a->base, a->size);
+  a->base = NULL;
+}
+
+void* arena_alloc(struct Arena* a, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (a->base == NULL || size > a->size - a->used) {
+    a->failed++;
+    return NULL;
+  }
+
+  void* p = a->base + a->used;
+  a->used += size;
+  if (a->used > a->peak)
+    a->peak = a->used;
+  return p;
+}
+
+size_t arena_left(const struct Arena* a)
+{
+  return a->size - a->used;
+}
@@ -0,0 +1,34 @@
+#ifndef SLEEP_ARENA_H
+#define SLEEP_ARENA_H
+
+#include <stddef.h>
+
+/* Fixed memory budget for the recorder.
+ *
+ * The whole budget is mapped and touched once at startup, then handed out
+ * by bumping a pointer.  Nothing is ever freed: the recorder takes all it
+ * needs before recording starts, including the buffers for the nights,
+ * which are reused night after night, so the arena stops growing once
+ * startup is done.  An allocation that doesn't fit returns NULL instead of
+ * growing the process. */
+
+#define ARENA_ALIGN 16
+
+struct Arena {
+  char*  base;      /* NULL if the arena is not in use */
+  size_t size;
+  size_t used;
+  size_t peak;      /* most that was ever in use */
+  size_t failed;    /* allocations that didn't fit */
+};
+
+/* return 0 on success, -1 if the memory couldn't be mapped */
+int    arena_init   (struct Arena* a, size_t size);
+void   arena_destroy(struct Arena* a);
+
+void*  arena_alloc  (struct Arena* a, size_t size);
+
+/* what is left, for sizing buffers to fit */
+size_t arena_left   (const struct Arena* a);
+
+#endif /* SLEEP_ARENA_H */
@@ -0,0 +1,119 @@
+//Percentile bands from the baseline file the recorder keeps in BASELINE_FILE
+//(see sleep_sketch.h).  Merges the nights of a range, prints the bands of each
+//metric and of the distances in each hour, then every night of the range with
+//the metrics that fell outside the middle 90%.
+//
+//	./sleep_baseline <baseline file> [first night] [last night]
+//	./sleep_baseline /home/pi/sleep_baseline.bin 2018-10-01 2018-11-30
+//
+//Nights are YYYY-MM-DD, a night is the one whose recording started between
+//noon that day and noon the next.  The range defaults to every night.
+
+#include "sleep_sketch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double nowSeconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//returns the unix time in ms of noon on a YYYY-MM-DD date, -1 if it isn't one
+static int64_t parseNoon(const char* date) {
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	if(sscanf(date, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3) {
+		return -1;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_hour = 12;
+	tm.tm_isdst = -1;
+	time_t t = mktime(&tm);
+	return t == (time_t)-1 ? -1 : (int64_t)t * 1000;
+}
+
+static const double bands[] = {0.05, 0.25, 0.5, 0.75, 0.95};
+#define NUM_BANDS (sizeof(bands) / sizeof(bands[0]))
+
+static void printBands(const char* name, const struct Sketch* sketch) {
+	printf("%-20s", name);
+	for(size_t b = 0; b < NUM_BANDS; b++) {
+		printf(" %8.1f", sketch_quantile(sketch, bands[b]));
+	}
+	printf("   (%u values)\n", sketch->count);
+}
+
+//prints a night with the metrics outside the 5th to 95th percentile
+static void printNight(const struct NightSketch* night, void* arg) {
+	const struct Baseline* base = arg;
+	char date[30];
+	time_t start = night->startMs / 1000;
+	struct tm tm;
+	localtime_r(&start, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+	printf("%s %4d min", date, night->minutes);
+	for(int m = 0; m < BASE_METRICS; m++) {
+		const struct Sketch* sketch = &base->metric[m];
+		const char* flag = night->metric[m] > sketch_quantile(sketch, 0.95) ? "+" : night->metric[m] < sketch_quantile(sketch, 0.05) ? "-" : " ";
+		printf(" %8.1f%s", night->metric[m], flag);
+	}
+	printf("\n");
+}
+
+int main(const int argc, const char* const argv[]) {
+	if(argc != 2 && argc != 4) {
+		fprintf(stderr, "usage: %s <baseline file> [first night] [last night]\n", argv[0]);
+		return 1;
+	}
+	int64_t fromMs = 0;
+	int64_t toMs = INT64_MAX;
+	if(argc == 4) {
+		fromMs = parseNoon(argv[2]);
+		toMs = parseNoon(argv[3]);
+		if(fromMs < 0 || toMs < fromMs) {
+			fprintf(stderr, "nights are YYYY-MM-DD, the first one first\n");
+			return 1;
+		}
+		toMs += 24 * 3600000LL;
+	}
+
+	struct Baseline base;
+	double start = nowSeconds();
+	long nights = baseline_merge(argv[1], fromMs, toMs, &base);
+	double took = nowSeconds() - start;
+	if(nights < 0) {
+		perror("Couldn't read the baseline file");
+		return 1;
+	}
+	printf("%ld nights merged in %.2f ms\n\n", nights, took * 1e3);
+	if(nights == 0) {
+		return 0;
+	}
+
+	printf("%-20s %8s %8s %8s %8s %8s\n", "percentile", "5th", "25th", "50th", "75th", "95th");
+	for(int m = 0; m < BASE_METRICS; m++) {
+		printBands(baseline_metric_names[m], &base.metric[m]);
+	}
+	for(int h = 0; h < 24; h++) {
+		if(base.hours[h].count > 0) {
+			char name[30];
+			snprintf(name, sizeof(name), "Distance %02d:00 (cm)", h);
+			printBands(name, &base.hours[h]);
+		}
+	}
+
+	//+ is above the 95th percentile, - below the 5th
+	static const char* const columns[BASE_METRICS] = {"moves/h", "sound min", "settle min"};
+	printf("\n%-16s %8s", "night", "length");
+	for(int m = 0; m < BASE_METRICS; m++) {
+		printf(" %9s", columns[m]);
+	}
+	printf("\n");
+	baseline_each(argv[1], fromMs, toMs, printNight, &base);
+	return 0;
+}
@@ -0,0 +1,264 @@
+#include "sleep_bitmap.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+_Static_assert(sizeof(struct BitmapSlot) <= BITMAP_SLOT_SIZE, "bitmap slot doesn't fit");
+
+time_t bitmap_night_start(time_t t)
+{
+  struct tm tm;
+  localtime_r(&t, &tm);
+  if (tm.tm_hour < 12)
+    tm.tm_mday -= 1;
+  tm.tm_hour = 12;
+  tm.tm_min = 0;
+  tm.tm_sec = 0;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+int64_t bitmap_day(time_t nightStart)
+{
+  struct tm tm;
+  localtime_r(&nightStart, &tm);
+  return ((int64_t)nightStart + tm.tm_gmtoff) / 86400;
+}
+
+int bitmap_open(struct BitmapWriter* w, const char* path)
+{
+  struct BitmapHeader header;
+
+  memset(w, 0, sizeof(*w));
+  w->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (w->fd < 0)
+    return -1;
+  /* an empty file gets its header with the first night recorded */
+  w->firstDay = -1;
+  if (pread(w->fd, &header, sizeof(header), 0) == sizeof(header)) {
+    if (header.magic != BITMAP_MAGIC || header.channels != BITS_CHANNELS) {
+      close(w->fd);
+      w->fd = -1;
+      return -1;
+    }
+    w->firstDay = header.firstDay;
+  }
+  return 0;
+}
+
+static void unmap_slot(struct BitmapWriter* w)
+{
+  if (w->slot) {
+    msync(w->slot, BITMAP_SLOT_SIZE, MS_ASYNC);
+    munmap(w->slot, BITMAP_SLOT_SIZE);
+    w->slot = NULL;
+  }
+}
+
+static int map_slot(struct BitmapWriter* w, time_t nightStart)
+{
+  int64_t day = bitmap_day(nightStart);
+  struct stat st;
+
+  unmap_slot(w);
+  if (w->firstDay < 0) {
+    struct BitmapHeader header = { BITMAP_MAGIC, BITS_CHANNELS, day };
+    if (pwrite(w->fd, &header, sizeof(header), 0) != sizeof(header))
+      return -1;
+    w->firstDay = day;
+  }
+  if (day < w->firstDay)
+    return -1;
+
+  off_t offset = BITMAP_HEADER + (off_t)(day - w->firstDay) * BITMAP_SLOT_SIZE;
+  if (fstat(w->fd, &st) < 0)
+    return -1;
+  if (st.st_size < offset + BITMAP_SLOT_SIZE && ftruncate(w->fd, offset + BITMAP_SLOT_SIZE) < 0)
+    return -1;
+  void* p = mmap(NULL, BITMAP_SLOT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, offset);
+  if (p == MAP_FAILED)
+    return -1;
+
+  w->slot = p;
+  w->nightStart = nightStart;
+  if (w->slot->magic != BITMAP_MAGIC) {
+    w->slot->day = day;
+    w->slot->nightStart = nightStart;
+    w->slot->magic = BITMAP_MAGIC;
+  }
+  return 0;
+}
+
+int bitmap_set(struct BitmapWriter* w, int channel, int64_t timeMs)
+{
+  time_t t = timeMs / 1000;
+
+  if (w->fd < 0 || channel < 0 || channel >= BITS_CHANNELS)
+    return -1;
+  if (!w->slot || t < w->nightStart || t >= w->nightStart + BITMAP_SECONDS) {
+    time_t nightStart = bitmap_night_start(t);
+    /* the extra hour of a night the clocks go back has no bits */
+    if (w->slot && nightStart == w->nightStart)
+      return 0;
+    if (map_slot(w, nightStart) < 0)
+      return -1;
+  }
+  long second = t - w->nightStart;
+  w->slot->words[channel][second / 64] |= 1ULL << (second % 64);
+  return 0;
+}
+
+void bitmap_sync(struct BitmapWriter* w)
+{
+  if (w->slot)
+    msync(w->slot, BITMAP_SLOT_SIZE, MS_SYNC);
+}
+
+void bitmap_close(struct BitmapWriter* w)
+{
+  bitmap_sync(w);
+  unmap_slot(w);
+  if (w->fd >= 0)
+    close(w->fd);
+  w->fd = -1;
+}
+
+int bitmap_map(struct BitmapFile* f, const char* path)
+{
+  struct stat st;
+  int fd;
+
+  memset(f, 0, sizeof(*f));
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || st.st_size < BITMAP_HEADER) {
+    close(fd);
+    return -1;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return -1;
+  f->data = p;
+  f->len = st.st_size;
+  f->header = p;
+  if (f->header->magic != BITMAP_MAGIC || f->header->channels != BITS_CHANNELS) {
+    bitmap_unmap(f);
+    return -1;
+  }
+  f->slots = (f->len - BITMAP_HEADER) / BITMAP_SLOT_SIZE;
+  return 0;
+}
+
+void bitmap_unmap(struct BitmapFile* f)
+{
+  if (f->data)
+    munmap((void*)f->data, f->len);
+  f->data = NULL;
+}
+
+const struct BitmapSlot* bitmap_slot(const struct BitmapFile* f, int64_t day)
+{
+  int64_t index = day - f->header->firstDay;
+  if (index < 0 || index >= f->slots)
+    return NULL;
+  const struct BitmapSlot* slot = (const void*)(f->data + BITMAP_HEADER + index * BITMAP_SLOT_SIZE);
+  return slot->magic == BITMAP_MAGIC ? slot : NULL;
+}
+
+/* channels not in a set read from here, so every set is an OR of
+ * BITS_CHANNELS arrays and the counting loops have no per-word branches */
+static const uint64_t no_bits[BITMAP_WORDS];
+
+/* the channels of a set, returns how many are really in it */
+static int channel_list(const struct BitmapSlot* slot, unsigned set, const uint64_t** out)
+{
+  int n = 0;
+  for (int ch = 0; ch < BITS_CHANNELS; ch++)
+    if (set & (1u << ch))
+      out[n++] = slot->words[ch];
+  for (int k = n; k < BITS_CHANNELS; k++)
+    out[k] = no_bits;
+  return n;
+}
+
+_Static_assert(BITS_CHANNELS == 4, "set_word ORs four channels");
+
+static inline uint64_t set_word(const uint64_t* const* set, long i)
+{
+  return set[0][i] | set[1][i] | set[2][i] | set[3][i];
+}
+
+static inline uint64_t word_of(const uint64_t* const* l, int op, const uint64_t* const* r, long i)
+{
+  uint64_t a = set_word(l, i);
+  if (op == '&')
+    return a & set_word(r, i);
+  if (op == '|')
+    return a | set_word(r, i);
+  return a;
+}
+
+long bitmap_count(const struct BitmapSlot* slot, unsigned left, int op, unsigned right,
+                  long from, long to)
+{
+  const uint64_t* l[BITS_CHANNELS];
+  const uint64_t* r[BITS_CHANNELS];
+  int nl = channel_list(slot, left, l);
+  channel_list(slot, op ? right : 0, r);
+  long count = 0;
+
+  if (from < 0)
+    from = 0;
+  if (to > BITMAP_SECONDS)
+    to = BITMAP_SECONDS;
+  if (from >= to || nl == 0)
+    return 0;
+
+  long first = from / 64;
+  long last = (to - 1) / 64;
+  uint64_t firstMask = ~0ULL << (from % 64);
+  uint64_t lastMask = ~0ULL >> (63 - (to - 1) % 64);
+  if (first == last)
+    return __builtin_popcountll(word_of(l, op, r, first) & firstMask & lastMask);
+  count += __builtin_popcountll(word_of(l, op, r, first) & firstMask);
+  count += __builtin_popcountll(word_of(l, op, r, last) & lastMask);
+
+  long i = first + 1;
+#ifdef __ARM_NEON
+  /* two words a step, byte counts summed into 16 bit lanes that can't
+   * overflow in one night (at most 16 a step over 675 steps) */
+  uint16x8_t acc = vdupq_n_u16(0);
+  for (; i + 2 <= last; i += 2) {
+    uint64x2_t a = vorrq_u64(vorrq_u64(vld1q_u64(l[0] + i), vld1q_u64(l[1] + i)),
+                             vorrq_u64(vld1q_u64(l[2] + i), vld1q_u64(l[3] + i)));
+    uint64x2_t b = vorrq_u64(vorrq_u64(vld1q_u64(r[0] + i), vld1q_u64(r[1] + i)),
+                             vorrq_u64(vld1q_u64(r[2] + i), vld1q_u64(r[3] + i)));
+    if (op == '&')
+      a = vandq_u64(a, b);
+    else if (op == '|')
+      a = vorrq_u64(a, b);
+    acc = vpadalq_u8(acc, vcntq_u8(vreinterpretq_u8_u64(a)));
+  }
+  uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(acc));
+  count += vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+#endif
+  /* one loop per op so the compiler can unroll and vectorize each */
+  if (op == '&')
+    for (; i < last; i++)
+      count += __builtin_popcountll(set_word(l, i) & set_word(r, i));
+  else if (op == '|')
+    for (; i < last; i++)
+      count += __builtin_popcountll(set_word(l, i) | set_word(r, i));
+  else
+    for (; i < last; i++)
+      count += __builtin_popcountll(set_word(l, i));
+  return count;
+}
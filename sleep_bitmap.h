@@ -0,0 +1,90 @@
+#ifndef SLEEP_BITMAP_H
+#define SLEEP_BITMAP_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Activity bitmaps, one bit per second of a night for each sensor.
+ *
+ * A night runs from noon to noon (the same nights as sleep_queryd) and
+ * gets a slot in one bitmap file: a header page, then slots of
+ * BITMAP_SLOT_SIZE bytes indexed by the night's day number counting from
+ * the file's first night.  A slot is a BitmapSlot header followed by
+ * BITMAP_WORDS 64-bit words for each channel, bit s of a channel being
+ * second s after the night's noon.  Nights that were never recorded are
+ * holes in the file and read as zeros.
+ *
+ * The recorder maps the slot it is writing and sets bits in place, so a
+ * second with sound costs a store.  Queries map the whole file once and
+ * count with popcounts over whole words, so a range over a year of nights
+ * touches a few hundred words per night and no text is parsed. */
+
+#define BITMAP_MAGIC     0x534c424du   /* "SLBM" */
+#define BITMAP_SECONDS   86400
+#define BITMAP_WORDS     (BITMAP_SECONDS / 64)
+#define BITMAP_HEADER    4096
+#define BITMAP_SLOT_SIZE (11 * 4096)   /* slot header and channels, in whole pages */
+
+enum { BITS_SOUND1, BITS_SOUND2, BITS_MOTION1, BITS_MOTION2, BITS_CHANNELS };
+
+struct BitmapHeader {
+  uint32_t magic;
+  uint32_t channels;
+  int64_t  firstDay;      /* day number of the night in slot 0 */
+};
+
+struct BitmapSlot {
+  uint32_t magic;         /* 0 if the night was never recorded */
+  uint32_t reserved;
+  int64_t  day;           /* day number of the night */
+  int64_t  nightStart;    /* unix time of its noon */
+  uint8_t  pad[40];       /* the channels start 64 byte aligned */
+  uint64_t words[BITS_CHANNELS][BITMAP_WORDS];
+};
+
+/* the recorder's view: one night's slot, mapped read/write */
+struct BitmapWriter {
+  int      fd;            /* -1 if there is no bitmap file */
+  int64_t  firstDay;
+  struct BitmapSlot* slot;  /* NULL until something is recorded */
+  int64_t  nightStart;
+};
+
+/* the noon a time belongs to, and its night's day number (days since
+ * 1970-01-01 of the local date) */
+time_t  bitmap_night_start(time_t t);
+int64_t bitmap_day(time_t nightStart);
+
+/* opens (creating if needed) the bitmap file, return 0 or -1 on error */
+int  bitmap_open (struct BitmapWriter* w, const char* path);
+
+/* sets a channel's bit for the second timeMs is in, mapping the slot of
+ * its night if it isn't the one mapped.  return -1 if the slot couldn't
+ * be mapped */
+int  bitmap_set  (struct BitmapWriter* w, int channel, int64_t timeMs);
+
+/* writes the mapped slot back, for the end of a night */
+void bitmap_sync (struct BitmapWriter* w);
+void bitmap_close(struct BitmapWriter* w);
+
+/* the whole file mapped read only, for queries */
+struct BitmapFile {
+  const struct BitmapHeader* header;
+  const char* data;
+  long     len;
+  long     slots;
+};
+
+int  bitmap_map  (struct BitmapFile* f, const char* path);
+void bitmap_unmap(struct BitmapFile* f);
+
+/* the slot for a night, NULL if the night isn't in the file */
+const struct BitmapSlot* bitmap_slot(const struct BitmapFile* f, int64_t day);
+
+/* counts the seconds in [from, to) of a night where (any channel in left)
+ * op (any channel in right) is set, where the channel sets are bit masks
+ * of BITS_ values.  op is '&' or '|', or 0 to count left on its own */
+long bitmap_count(const struct BitmapSlot* slot, unsigned left, int op, unsigned right,
+                  long from, long to);
+
+#endif /* SLEEP_BITMAP_H */
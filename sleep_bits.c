@@ -0,0 +1,155 @@
+
+//Range queries on the activity bitmaps the recorder keeps in BITMAP_FILE (see
+//sleep_bitmap.h).  Counts the seconds with activity in a clock time window on
+//each night of a range, one line per night, then the total and how long the
+//counting took.
+//
+//	./sleep_bits <bitmap file> <channels> <first night> <last night> [from HH:MM] [to HH:MM]
+//
+//channels is one set, or two joined by & (both) or | (either).  A set is sound,
+//motion or any, or one sensor: sound1, sound2, motion1, motion2.  Nights are
+//YYYY-MM-DD and run from noon to noon, the window defaults to the whole night.
+//
+//	./sleep_bits /home/pi/sleep_bits.bin sound 2018-10-01 2018-11-30 01:00 03:00
+//	./sleep_bits /home/pi/sleep_bits.bin 'sound&motion' 2018-10-01 2018-11-30
+
+#include "sleep_bitmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static double nowSeconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//returns the channel mask for a set name, 0 if it isn't one
+static unsigned parseSet(const char* name, size_t len) {
+	static const struct { const char* name; unsigned mask; } sets[] = {
+		{"sound", 1u << BITS_SOUND1 | 1u << BITS_SOUND2},
+		{"motion", 1u << BITS_MOTION1 | 1u << BITS_MOTION2},
+		{"any", (1u << BITS_CHANNELS) - 1},
+		{"sound1", 1u << BITS_SOUND1},
+		{"sound2", 1u << BITS_SOUND2},
+		{"motion1", 1u << BITS_MOTION1},
+		{"motion2", 1u << BITS_MOTION2},
+	};
+	for(size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+		if(strlen(sets[i].name) == len && !strncmp(sets[i].name, name, len)) {
+			return sets[i].mask;
+		}
+	}
+	return 0;
+}
+
+//returns the night's day number, -1 if the date isn't YYYY-MM-DD
+static int64_t parseNight(const char* date) {
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	if(sscanf(date, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3) {
+		return -1;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_hour = 12;
+	tm.tm_isdst = -1;
+	time_t t = mktime(&tm);
+	if(t == (time_t)-1) {
+		return -1;
+	}
+	return bitmap_day(t);
+}
+
+//returns the seconds after noon of a clock time, -1 if it isn't HH:MM
+static long parseClock(const char* clock) {
+	int h;
+	int m;
+	if(sscanf(clock, "%d:%d", &h, &m) != 2 || h < 0 || h > 24 || m < 0 || m > 59) {
+		return -1;
+	}
+	return (h * 3600L + m * 60 + 12 * 3600L) % BITMAP_SECONDS;
+}
+
+int main(const int argc, const char* const argv[]) {
+	if(argc != 5 && argc != 7) {
+		fprintf(stderr, "usage: %s <bitmap file> <channels> <first night> <last night> [from HH:MM] [to HH:MM]\n", argv[0]);
+		return 1;
+	}
+
+	const char* expr = argv[2];
+	size_t split = strcspn(expr, "&|");
+	int op = expr[split];
+	unsigned left = parseSet(expr, split);
+	unsigned right = op ? parseSet(expr + split + 1, strlen(expr + split + 1)) : 0;
+	if(!left || (op && !right)) {
+		fprintf(stderr, "channels are sound, motion, any, sound1, sound2, motion1 or motion2, joined by & or |\n");
+		return 1;
+	}
+
+	int64_t firstDay = parseNight(argv[3]);
+	int64_t lastDay = parseNight(argv[4]);
+	long from = 0;
+	long to = BITMAP_SECONDS;
+	if(argc == 7) {
+		from = parseClock(argv[5]);
+		to = parseClock(argv[6]);
+		if(to == 0) {
+			to = BITMAP_SECONDS;
+		}
+	}
+	if(firstDay < 0 || lastDay < firstDay || from < 0 || to < 0) {
+		fprintf(stderr, "nights are YYYY-MM-DD, the first one first, and times are HH:MM\n");
+		return 1;
+	}
+
+	struct BitmapFile bits;
+	if(bitmap_map(&bits, argv[1]) < 0) {
+		perror("Couldn't read the bitmap file");
+		return 1;
+	}
+
+	//counted first and printed after, so the time is only the counting
+	long numDays = lastDay - firstDay + 1;
+	long* counts = malloc(numDays * sizeof(long));
+	if(counts == NULL) {
+		return 1;
+	}
+	long total = 0;
+	long nights = 0;
+	double start = nowSeconds();
+	for(long d = 0; d < numDays; d++) {
+		const struct BitmapSlot* slot = bitmap_slot(&bits, firstDay + d);
+		if(slot == NULL) {
+			counts[d] = -1;
+			continue;
+		}
+		//a window that goes past noon wraps to the start of the night
+		if(from < to) {
+			counts[d] = bitmap_count(slot, left, op, right, from, to);
+		}
+		else {
+			counts[d] = bitmap_count(slot, left, op, right, from, BITMAP_SECONDS) + bitmap_count(slot, left, op, right, 0, to);
+		}
+		total += counts[d];
+		nights++;
+	}
+	double took = nowSeconds() - start;
+
+	for(long d = 0; d < numDays; d++) {
+		if(counts[d] < 0) {
+			continue;
+		}
+		char date[16];
+		time_t t = (time_t)(firstDay + d) * 86400;
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+		printf("%s %ld\n", date, counts[d]);
+	}
+	printf("total %ld seconds over %ld nights, counted in %.1f us\n", total, nights, took * 1e6);
+	free(counts);
+	bitmap_unmap(&bits);
+	return 0;
+}
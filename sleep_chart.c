@@ -0,0 +1,129 @@
+#include "sleep_chart.h"
+
+/* first index in [from, to) with a reading, to if there is none */
+static long next_valid(const long* y, long from, long to)
+{
+  while (from < to && y[from] < 0)
+    from++;
+  return from;
+}
+
+long lttb(const long* x, const long* y, long n, long budget, long* out)
+{
+  long first = next_valid(y, 0, n);
+  long last = n - 1;
+  long count = 0;
+
+  while (last > first && y[last] < 0)
+    last--;
+  if (first >= n)
+    return 0;
+  if (budget < 3)
+    budget = 3;
+
+  /* few enough points, they are all kept */
+  if (last - first + 1 <= budget) {
+    for (long i = first; i <= last; i++)
+      if (y[i] >= 0)
+        out[count++] = i;
+    return count;
+  }
+
+  /* the first and last readings are always kept, the points between them
+   * are split into budget - 2 buckets */
+  double size = (double)(last - first - 1) / (budget - 2);
+  long a = first;
+  out[count++] = first;
+  for (long b = 0; b < budget - 2; b++) {
+    long start = first + 1 + (long)(b * size);
+    long end = first + 1 + (long)((b + 1) * size);
+    if (b == budget - 3)
+      end = last;
+
+    /* average of the next bucket, or the last point after the final bucket */
+    double avgX = x[last];
+    double avgY = y[last];
+    if (b < budget - 3) {
+      long nextEnd = b == budget - 4 ? last : first + 1 + (long)((b + 2) * size);
+      double sumX = 0;
+      double sumY = 0;
+      long valid = 0;
+      for (long i = end; i < nextEnd; i++) {
+        if (y[i] >= 0) {
+          sumX += x[i];
+          sumY += y[i];
+          valid++;
+        }
+      }
+      if (valid > 0) {
+        avgX = sumX / valid;
+        avgY = sumY / valid;
+      }
+    }
+
+    /* the point making the largest triangle with the last kept one and the average */
+    double best = -1;
+    long pick = -1;
+    for (long i = next_valid(y, start, end); i < end; i = next_valid(y, i + 1, end)) {
+      double area = (x[a] - avgX) * (double)(y[i] - y[a]) - (x[a] - (double)x[i]) * (avgY - y[a]);
+      if (area < 0)
+        area = -area;
+      if (area > best) {
+        best = area;
+        pick = i;
+      }
+    }
+    if (pick >= 0) {
+      out[count++] = pick;
+      a = pick;
+    }
+  }
+  out[count++] = last;
+  return count;
+}
+
+void chart_begin(FILE* f, const char* title)
+{
+  fprintf(f, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>%s</title>\n"
+             "<style>body{font-family:sans-serif}svg{background:#fafafa;border:1px solid #ddd}"
+             "polyline{fill:none;stroke:#2060c0;stroke-width:1}text{font-size:11px;fill:#555}</style>\n"
+             "</head><body>\n<h2>%s</h2>\n", title, title);
+}
+
+void chart_series(FILE* f, const char* title, const char* unit, const long* x, const long* y,
+                  const long* idx, long count, long xSpanMs, long yMax)
+{
+  const int left = 40;
+  const int bottom = 20;
+  const int w = CHART_WIDTH - left;
+  const int h = CHART_HEIGHT - bottom;
+
+  if (xSpanMs <= 0)
+    xSpanMs = 1;
+  if (yMax <= 0)
+    yMax = 1;
+  fprintf(f, "<h3>%s</h3>\n<svg width=\"%d\" height=\"%d\">\n", title, CHART_WIDTH, CHART_HEIGHT);
+  fprintf(f, "<text x=\"2\" y=\"12\">%ld %s</text><text x=\"2\" y=\"%d\">0</text>\n", yMax, unit, h);
+
+  /* a tick every hour, or every ten minutes for short nights */
+  long tickMs = xSpanMs > 3 * 3600000L ? 3600000L : 600000L;
+  for (long t = 0; t <= xSpanMs; t += tickMs) {
+    int px = left + (int)((double)t * w / xSpanMs);
+    fprintf(f, "<line x1=\"%d\" y1=\"0\" x2=\"%d\" y2=\"%d\" stroke=\"#eee\"/>"
+               "<text x=\"%d\" y=\"%d\">%ld:%02ld</text>\n",
+            px, px, h, px, CHART_HEIGHT - 6, t / 3600000, t / 60000 % 60);
+  }
+
+  fprintf(f, "<polyline points=\"");
+  for (long k = 0; k < count; k++) {
+    long i = idx[k];
+    long v = y[i] > yMax ? yMax : y[i];
+    fprintf(f, "%d,%d ", left + (int)((double)x[i] * w / xSpanMs), h - (int)((double)v * h / yMax));
+  }
+  fprintf(f, "\"/>\n</svg>\n");
+}
+
+void chart_end(FILE* f)
+{
+  fprintf(f, "</body></html>\n");
+}
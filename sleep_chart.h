@@ -0,0 +1,34 @@
+#ifndef SLEEP_CHART_H
+#define SLEEP_CHART_H
+
+#include <stdio.h>
+
+/* Charts for the nightly report, written as one HTML file of inline SVGs.
+ *
+ * A night has tens of thousands of ultrasonic samples, far more than a
+ * chart has pixels, so series are cut down to a fixed number of points
+ * with Largest-Triangle-Three-Buckets first.  LTTB splits the samples into
+ * equal buckets and keeps the point of each bucket that makes the largest
+ * triangle with the point kept before it and the average of the next
+ * bucket, which keeps peaks and dips that plain averaging would flatten.
+ * It is one pass over the samples and only the kept indices are stored,
+ * so a chart costs O(samples) time and O(points) memory. */
+
+#define CHART_WIDTH  960
+#define CHART_HEIGHT 200
+
+/* picks at most budget (>= 3) of the n points (x[i], y[i]), x ascending.
+ * points with y < 0 are missing readings and are never picked.  the
+ * picked indices are stored in order in out, returns how many */
+long lttb(const long* x, const long* y, long n, long budget, long* out);
+
+void chart_begin (FILE* f, const char* title);
+
+/* one chart of the points idx[0..count-1] of (x, y).  x is in ms from the
+ * start of a night that lasted xSpanMs, the y axis runs from 0 to yMax */
+void chart_series(FILE* f, const char* title, const char* unit, const long* x, const long* y,
+                  const long* idx, long count, long xSpanMs, long yMax);
+
+void chart_end   (FILE* f);
+
+#endif /* SLEEP_CHART_H */
@@ -0,0 +1,236 @@
+#include "sleep_collect.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* sends without blocking, so a collector that stops reading can't hold the
+ * recorder up.  returns 0 once it is all sent, 1 if the socket was full and
+ * nothing was sent, -1 on error or if it filled part way through, which
+ * leaves the stream in the middle of a frame */
+static int send_all(int fd, struct iovec* iov, int iovcnt)
+{
+  int sentAny = 0;
+
+  while (iovcnt > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && !sentAny)
+        return 1;
+      return -1;
+    }
+    sentAny = 1;
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+static int collect_hello(struct CollectClient* c, int fd, const char* device)
+{
+  struct CollectHello hello;
+  memset(&hello, 0, sizeof(hello));
+  hello.magic = COLLECT_MAGIC;
+  hello.version = COLLECT_VERSION;
+  strncpy(hello.device, device, COLLECT_DEVICE_LEN - 1);
+  collect_clean_device(hello.device);
+
+  struct iovec iov = { &hello, sizeof(hello) };
+  if (send_all(fd, &iov, 1) != 0) {
+    close(fd);
+    c->fd = -1;
+    return -1;
+  }
+
+  c->fd = fd;
+  c->n = 0;
+  c->sent = 0;
+  c->acked = 0;
+  c->dropped = 0;
+  c->dropFromMs = -1;
+  c->ackLen = 0;
+  return 0;
+}
+
+int collect_open_unix(struct CollectClient* c, const char* path, const char* device)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  c->fd = -1;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return collect_hello(c, fd, device);
+}
+
+int collect_open_tcp(struct CollectClient* c, int port, const char* device)
+{
+  struct sockaddr_in addr;
+  int fd;
+  int one = 1;
+
+  c->fd = -1;
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return collect_hello(c, fd, device);
+}
+
+int collect_push(struct CollectClient* c, const struct SleepRecord* rec)
+{
+  if (c->fd < 0)
+    return -1;
+  c->buf[c->n++] = *rec;
+  if (c->n == COLLECT_BATCH)
+    return collect_flush(c);
+  return 0;
+}
+
+int collect_flush(struct CollectClient* c)
+{
+  if (c->fd < 0)
+    return -1;
+  if (c->n == 0)
+    return 0;
+
+  uint32_t count = c->n;
+  struct SleepRecord drop;
+  struct iovec iov[3];
+  int iovcnt = 0;
+  iov[iovcnt].iov_base = &count;
+  iov[iovcnt++].iov_len = sizeof(count);
+  if (c->dropFromMs >= 0) {
+    int64_t lenMs = c->buf[0].timeMs - c->dropFromMs;
+    drop.timeMs = c->dropFromMs;
+    drop.value = lenMs < 0 ? 0 : lenMs > INT32_MAX ? INT32_MAX : (int32_t)lenMs;
+    drop.sensor = 0;
+    drop.kind = REC_DROP;
+    iov[iovcnt].iov_base = &drop;
+    iov[iovcnt++].iov_len = sizeof(drop);
+    count++;
+  }
+  iov[iovcnt].iov_base = c->buf;
+  iov[iovcnt++].iov_len = c->n * sizeof(struct SleepRecord);
+
+  int r = send_all(c->fd, iov, iovcnt);
+  if (r < 0) {
+    collect_close(c);
+    return -1;
+  }
+  /* the collector is behind, the batch is dropped rather than waited on */
+  if (r > 0) {
+    c->dropped += c->n;
+    if (c->dropFromMs < 0)
+      c->dropFromMs = c->buf[0].timeMs;
+  }
+  else {
+    c->sent += count;
+    c->dropFromMs = -1;
+  }
+  c->n = 0;
+  return 0;
+}
+
+/* reads whatever acks have arrived without blocking */
+int collect_poll_acks(struct CollectClient* c)
+{
+  if (c->fd < 0)
+    return -1;
+
+  for (;;) {
+    ssize_t n = recv(c->fd, c->ackBuf + c->ackLen, sizeof(c->ackBuf) - c->ackLen, MSG_DONTWAIT);
+    if (n == 0) {
+      collect_close(c);
+      return -1;
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      collect_close(c);
+      return -1;
+    }
+    c->ackLen += n;
+    if (c->ackLen == sizeof(c->ackBuf)) {
+      memcpy(&c->acked, c->ackBuf, sizeof(c->acked));
+      c->ackLen = 0;
+    }
+  }
+}
+
+/* waits until everything sent has been acked, or the timeout runs out
+ * returns 0 if it was all acked */
+int collect_wait_acks(struct CollectClient* c, int timeoutMs)
+{
+  struct pollfd pfd;
+
+  while (c->fd >= 0 && c->acked < c->sent) {
+    pfd.fd = c->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeoutMs) <= 0)
+      return -1;
+    if (collect_poll_acks(c) < 0)
+      return -1;
+  }
+  return c->fd >= 0 ? 0 : -1;
+}
+
+void collect_close(struct CollectClient* c)
+{
+  if (c->fd >= 0)
+    close(c->fd);
+  c->fd = -1;
+}
+
+void collect_clean_device(char* device)
+{
+  int i;
+  for (i = 0; device[i] != 0; i++) {
+    char ch = device[i];
+    if (!((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || ch == '-'))
+      device[i] = '_';
+  }
+  if (i == 0)
+    strcpy(device, "unknown");
+}
@@ -0,0 +1,57 @@
+#ifndef SLEEP_COLLECT_H
+#define SLEEP_COLLECT_H
+
+#include "sleep_archive.h"
+
+#include <stdint.h>
+
+/* Wire protocol between recorders and sleep_collectd.
+ *
+ * A recorder connects (Unix socket or localhost TCP) and sends a
+ * CollectHello naming its device.  After that it sends frames: a uint32_t
+ * record count followed by that many SleepRecords.  The collector answers
+ * with uint64_t acks holding the total number of records it has written to
+ * the archive for the connection.  One ack can cover several frames. */
+
+#define COLLECT_MAGIC      0x534c4350u   /* "SLCP" */
+#define COLLECT_VERSION    1
+#define COLLECT_DEVICE_LEN 32
+#define COLLECT_BATCH      128           /* records buffered by a client */
+#define COLLECT_MAX_FRAME  4096          /* largest frame a collector accepts */
+
+struct CollectHello {
+  uint32_t magic;
+  uint32_t version;
+  char     device[COLLECT_DEVICE_LEN];
+};
+
+struct CollectClient {
+  int      fd;          /* -1 once the connection is lost */
+  int      n;           /* records waiting in buf */
+  uint64_t sent;
+  uint64_t acked;
+  uint64_t dropped;     /* records not sent because the collector wasn't reading */
+  int64_t  dropFromMs;  /* first record dropped since a frame last got through, -1 if none */
+  int      ackLen;      /* bytes of a partly read ack */
+  unsigned char ackBuf[8];
+  struct SleepRecord buf[COLLECT_BATCH];
+};
+
+/* return 0 on success, -1 on error (and the client is left closed) */
+int  collect_open_unix(struct CollectClient* c, const char* path, const char* device);
+int  collect_open_tcp (struct CollectClient* c, int port, const char* device);
+
+/* sends never block: a batch the socket has no room for is dropped and
+ * counted, one that only partly fits closes the connection.  The next
+ * frame that gets through starts with a REC_DROP covering the dropped
+ * time, so the archive shows the hole */
+int  collect_push      (struct CollectClient* c, const struct SleepRecord* rec);
+int  collect_flush     (struct CollectClient* c);
+int  collect_poll_acks (struct CollectClient* c);
+int  collect_wait_acks (struct CollectClient* c, int timeoutMs);
+void collect_close     (struct CollectClient* c);
+
+/* device ids end up in file names, so only [A-Za-z0-9_-] are kept */
+void collect_clean_device(char* device);
+
+#endif /* SLEEP_COLLECT_H */
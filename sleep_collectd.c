@@ -0,0 +1,675 @@
+/**********************************************************************************
+
+File: sleep_collectd.c
+
+Purpose: Collector daemon for running one recorder per bed.  Recorders connect
+	over a Unix socket or localhost TCP and stream their samples (see
+	sleep_collect.h).  Each device is handled by one worker thread, picked
+	by hashing the device id, so a device's archive file only ever has one
+	writer.  New connections are spread over the workers to read their
+	hello, then move to the worker that owns the device.  Workers write
+	everything that is readable in one go and then send one ack for it.
+
+	Usage: sleep_collectd [-u socket] [-p port] [-d archive dir] [-w workers]
+	                      [-s simulated recorders] [-r samples per second] [-n seconds]
+
+	With -s the daemon also starts that many simulated recorders that talk to
+	it through the normal client code, and prints throughput when it stops.
+
+**********************************************************************************/
+
+#include "sleep_archive.h"
+#include "sleep_collect.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 64
+#define MAX_DEVICES 1024	//archive files a single worker keeps open
+#define CONN_BUF (128 * 1024)	//bytes read from a connection at a time, more than a full frame
+#define CONN_OUT (CONN_BUF / sizeof(struct SleepRecord))
+#define MAX_EVENTS 64
+#define HELLO_MS 1000	//a connection that hasn't sent its hello by then is closed
+
+//a device's archive file, owned by exactly one worker
+struct Device {
+	char name[COLLECT_DEVICE_LEN];
+	int fd;
+};
+
+struct Conn {
+	int fd;
+	struct Device* device;	//NULL until the hello has been read
+	long helloDeadlineUs;
+	struct Conn* nextHello;	//the worker's connections still waiting for a hello
+	uint64_t stored;	//records written for this connection, sent back as acks
+	//the part of a frame (or the hello) that has arrived, the rest of a read
+	//goes through the worker's buffers so an idle connection holds no more
+	//than this.  Allocated only while a frame is part way in
+	unsigned char* partial;
+	size_t len;
+	unsigned char hello[sizeof(struct CollectHello)];
+};
+
+//what is handed to a worker, device is empty if the hello hasn't been read
+struct Handoff {
+	int fd;
+	char device[COLLECT_DEVICE_LEN];
+};
+
+struct Worker {
+	pthread_t thread;
+	int epoll;
+	int pipe[2];
+	int nDevices;
+	struct Device devices[MAX_DEVICES];
+	struct Conn* hellos;
+	//shared by the worker's connections, only used while one is serviced
+	unsigned char buf[CONN_BUF];
+	struct SleepRecord out[CONN_OUT];
+	//counters, only written by the worker
+	uint64_t records;
+	uint64_t writes;
+	uint64_t acks;
+	int conns;
+};
+
+//stop ends accepting and the simulators, workers keep going until stopWorkers
+//so the simulators can collect their last acks
+static volatile sig_atomic_t stop = 0;
+static volatile sig_atomic_t stopWorkers = 0;
+static const char* archiveDir = ".";
+static int numWorkers = 4;
+static struct Worker workers[MAX_WORKERS];
+
+static void onSignal(int sig) {
+	(void)sig;
+	stop = 1;
+}
+
+long getMicroTime() {
+	struct timeval currentTime;
+	gettimeofday(&currentTime, NULL);
+	return currentTime.tv_sec * (long)1e6 + currentTime.tv_usec;
+}
+
+//FNV-1a, only used to spread devices over the workers
+static unsigned hashDevice(const char* device) {
+	unsigned h = 2166136261u;
+	while(*device) {
+		h = (h ^ (unsigned char)*device++) * 16777619u;
+	}
+	return h;
+}
+
+static struct Device* openDevice(struct Worker* w, const char* name) {
+	for(int i = 0; i < w->nDevices; i++) {
+		if(!strcmp(w->devices[i].name, name)) {
+			return &w->devices[i];
+		}
+	}
+	if(w->nDevices == MAX_DEVICES) {
+		return NULL;
+	}
+
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s%s", archiveDir, name, ARCHIVE_SUFFIX);
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	struct Device* d = &w->devices[w->nDevices++];
+	strcpy(d->name, name);
+	d->fd = fd;
+	return d;
+}
+
+//takes a connection off the list waiting for a hello, if it is on it
+static void dropHello(struct Worker* w, struct Conn* c) {
+	for(struct Conn** p = &w->hellos; *p != NULL; p = &(*p)->nextHello) {
+		if(*p == c) {
+			*p = c->nextHello;
+			return;
+		}
+	}
+}
+
+static void closeConn(struct Worker* w, struct Conn* c) {
+	if(c->device == NULL) {
+		dropHello(w, c);
+	}
+	epoll_ctl(w->epoll, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->partial);
+	free(c);
+	--w->conns;
+}
+
+static void passConn(struct Worker* w, const struct Handoff* h) {
+	if(write(w->pipe[1], h, sizeof(*h)) != sizeof(*h)) {
+		close(h->fd);
+	}
+}
+
+//reads as much of the hello as has arrived, never more, so the first frame
+//stays in the socket.  Once it is all there the connection stays with this
+//worker if it owns the device, otherwise it is passed on to the one that does
+//returns -1 if the connection should be closed
+static int readHello(struct Worker* w, struct Conn* c) {
+	struct CollectHello hello;
+	ssize_t n = read(c->fd, c->hello + c->len, sizeof(hello) - c->len);
+	if(n < 0) {
+		return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	}
+	if(n == 0) {
+		return -1;
+	}
+	c->len += n;
+	if(c->len < sizeof(hello)) {
+		return 0;
+	}
+	memcpy(&hello, c->hello, sizeof(hello));
+	if(hello.magic != COLLECT_MAGIC || hello.version != COLLECT_VERSION) {
+		return -1;
+	}
+
+	struct Handoff h;
+	h.fd = c->fd;
+	memcpy(h.device, hello.device, COLLECT_DEVICE_LEN);
+	h.device[COLLECT_DEVICE_LEN - 1] = 0;
+	collect_clean_device(h.device);
+
+	struct Worker* owner = &workers[hashDevice(h.device) % numWorkers];
+	if(owner == w) {
+		struct Device* d = openDevice(w, h.device);
+		if(d == NULL) {
+			return -1;
+		}
+		dropHello(w, c);
+		c->device = d;
+		c->len = 0;
+		return 0;
+	}
+	dropHello(w, c);
+	epoll_ctl(w->epoll, EPOLL_CTL_DEL, c->fd, NULL);
+	free(c);
+	--w->conns;
+	passConn(owner, &h);
+	return 0;
+}
+
+static int writeAll(int fd, const void* data, size_t len) {
+	const char* p = data;
+	while(len > 0) {
+		ssize_t n = write(fd, p, len);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//writes the frames taken out of a connection to the archive and acks them
+//returns -1 if the connection should be closed
+static int storeOut(struct Worker* w, struct Conn* c, int nOut) {
+	if(writeAll(c->device->fd, w->out, nOut * sizeof(struct SleepRecord)) < 0) {
+		perror("archive write");
+		return -1;
+	}
+	c->stored += nOut;
+	w->records += nOut;
+	++w->writes;
+
+	if(send(c->fd, &c->stored, sizeof(c->stored), MSG_NOSIGNAL) != sizeof(c->stored)) {
+		return -1;
+	}
+	++w->acks;
+	return 0;
+}
+
+//reads everything available, writes all complete frames to the archive with a
+//single write and acks them with a single reply, more than one if out fills up
+//returns -1 if the connection should be closed
+static int serviceConn(struct Worker* w, struct Conn* c) {
+	int nOut = 0;
+	int closed = 0;
+	size_t len = c->len;
+
+	if(len > 0) {
+		memcpy(w->buf, c->partial, len);
+	}
+	for(;;) {
+		//the buffer never fills with complete frames, but a read of 0 bytes
+		//would look like the connection closing
+		size_t room = CONN_BUF - len;
+		ssize_t n = room > 0 ? read(c->fd, w->buf + len, room) : 0;
+		if(n == 0 && room > 0) {
+			closed = 1;
+		}
+		else if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				closed = 1;
+			}
+		}
+		else {
+			len += n;
+		}
+
+		//takes every complete frame out of the buffer
+		size_t pos = 0;
+		while(len - pos >= sizeof(uint32_t)) {
+			uint32_t count;
+			memcpy(&count, w->buf + pos, sizeof(count));
+			if(count > COLLECT_MAX_FRAME || count > CONN_OUT) {
+				return -1;
+			}
+			size_t frame = sizeof(count) + count * sizeof(struct SleepRecord);
+			if(len - pos < frame) {
+				break;
+			}
+			//out is full, write what there is before taking more
+			if(nOut + count > CONN_OUT) {
+				if(storeOut(w, c, nOut) < 0) {
+					return -1;
+				}
+				nOut = 0;
+			}
+			memcpy(&w->out[nOut], w->buf + pos + sizeof(count), count * sizeof(struct SleepRecord));
+			nOut += count;
+			pos += frame;
+		}
+		memmove(w->buf, w->buf + pos, len - pos);
+		len -= pos;
+
+		//keeps reading while the socket has more
+		if(closed || n <= 0) {
+			break;
+		}
+	}
+
+	if(nOut > 0 && storeOut(w, c, nOut) < 0) {
+		return -1;
+	}
+	if(closed) {
+		return -1;
+	}
+
+	//keeps the part of a frame that is still to come
+	if(len != c->len) {
+		unsigned char* partial = len > 0 ? realloc(c->partial, len) : NULL;
+		if(len > 0 && partial == NULL) {
+			return -1;
+		}
+		if(len == 0) {
+			free(c->partial);
+		}
+		c->partial = partial;
+	}
+	if(len > 0) {
+		memcpy(c->partial, w->buf, len);
+	}
+	c->len = len;
+	return 0;
+}
+
+static void* workerThread(void* arg) {
+	struct Worker* w = arg;
+	struct epoll_event events[MAX_EVENTS];
+
+	while(!stopWorkers) {
+		int n = epoll_wait(w->epoll, events, MAX_EVENTS, 200);
+		for(int i = 0; i < n; i++) {
+			//new connection from the acceptor or another worker
+			if(events[i].data.ptr == NULL) {
+				struct Handoff h;
+				while(read(w->pipe[0], &h, sizeof(h)) == sizeof(h)) {
+					struct Device* d = NULL;
+					struct Conn* c = NULL;
+					if(h.device[0] == 0 || (d = openDevice(w, h.device)) != NULL) {
+						c = calloc(1, sizeof(*c));
+					}
+					if(!c) {
+						close(h.fd);
+						continue;
+					}
+					c->fd = h.fd;
+					c->device = d;
+					if(d == NULL) {
+						c->helloDeadlineUs = getMicroTime() + HELLO_MS * 1000L;
+						c->nextHello = w->hellos;
+						w->hellos = c;
+					}
+
+					struct epoll_event ev;
+					ev.events = EPOLLIN;
+					ev.data.ptr = c;
+					epoll_ctl(w->epoll, EPOLL_CTL_ADD, c->fd, &ev);
+					++w->conns;
+				}
+				continue;
+			}
+
+			struct Conn* c = events[i].data.ptr;
+			if((c->device ? serviceConn(w, c) : readHello(w, c)) < 0) {
+				closeConn(w, c);
+			}
+		}
+
+		//a client that connects and never says hello only holds its own socket
+		long nowUs = getMicroTime();
+		for(struct Conn** p = &w->hellos; *p != NULL; ) {
+			if(nowUs >= (*p)->helloDeadlineUs) {
+				closeConn(w, *p);
+			}
+			else {
+				p = &(*p)->nextHello;
+			}
+		}
+	}
+
+	for(int i = 0; i < w->nDevices; i++) {
+		close(w->devices[i].fd);
+	}
+	return NULL;
+}
+
+static int startWorkers(void) {
+	for(int i = 0; i < numWorkers; i++) {
+		struct Worker* w = &workers[i];
+		if(pipe(w->pipe) < 0 || (w->epoll = epoll_create1(0)) < 0) {
+			return -1;
+		}
+		fcntl(w->pipe[0], F_SETFL, O_NONBLOCK);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(w->epoll, EPOLL_CTL_ADD, w->pipe[0], &ev);
+
+		if(pthread_create(&w->thread, NULL, workerThread, w) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//passes a new connection to the next worker in turn, which reads the hello
+//without blocking, so a slow client never holds up the accepts
+static void handOff(int fd) {
+	static unsigned next = 0;
+	struct Handoff h;
+	h.fd = fd;
+	h.device[0] = 0;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	passConn(&workers[next++ % numWorkers], &h);
+}
+
+static int listenUnix(const char* path) {
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 512) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int listenTcp(int port) {
+	struct sockaddr_in addr;
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) {
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 512) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**********************************
+
+Simulated recorders
+
+**********************************/
+
+#define SIM_THREADS 8
+
+struct Simulator {
+	pthread_t thread;
+	int first;		//first recorder number this thread drives
+	int count;
+	struct CollectClient* clients;
+	uint64_t sent;
+	uint64_t acked;
+	uint64_t dropped;
+	uint64_t failed;
+};
+
+static const char* simSocket = NULL;
+static int simPort = 0;
+static int simRate = 10;
+
+//each recorder sends two distances per tick and a sound second now and then,
+//flushing every tick like a recorder would
+static void* simulatorThread(void* arg) {
+	struct Simulator* s = arg;
+	unsigned seed = s->first + 1;
+	long tickUs = 1000000L / simRate;
+	long next = getMicroTime();
+
+	for(int i = 0; i < s->count; i++) {
+		char device[COLLECT_DEVICE_LEN];
+		snprintf(device, sizeof(device), "sim%04d", s->first + i);
+		int ok = simSocket ? collect_open_unix(&s->clients[i], simSocket, device) : collect_open_tcp(&s->clients[i], simPort, device);
+		if(ok < 0) {
+			++s->failed;
+		}
+	}
+
+	while(!stop) {
+		struct SleepRecord rec;
+		rec.timeMs = getMicroTime() / 1000;
+
+		for(int i = 0; i < s->count; i++) {
+			struct CollectClient* c = &s->clients[i];
+			if(c->fd < 0) {
+				continue;
+			}
+			for(int sensor = 1; sensor <= 2; sensor++) {
+				rec.kind = REC_ULTRA;
+				rec.sensor = sensor;
+				rec.value = 40 + rand_r(&seed) % 8;
+				collect_push(c, &rec);
+			}
+			if(rand_r(&seed) % 20 == 0) {
+				rec.kind = REC_SOUND;
+				rec.sensor = 1 + rand_r(&seed) % 2;
+				rec.value = 1;
+				collect_push(c, &rec);
+			}
+			collect_flush(c);
+			collect_poll_acks(c);
+		}
+
+		next += tickUs;
+		long wait = next - getMicroTime();
+		if(wait > 0) {
+			usleep(wait);
+		}
+	}
+
+	for(int i = 0; i < s->count; i++) {
+		collect_wait_acks(&s->clients[i], 1000);
+		s->sent += s->clients[i].sent;
+		s->acked += s->clients[i].acked;
+		s->dropped += s->clients[i].dropped;
+		if(s->clients[i].fd < 0 && s->clients[i].sent == 0) {
+			continue;
+		}
+		collect_close(&s->clients[i]);
+	}
+	return NULL;
+}
+
+int main(int argc, char* argv[]) {
+	const char* socketPath = "/tmp/sleep_collectd.sock";
+	int port = 0;
+	int numSim = 0;
+	int runSeconds = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "u:p:d:w:s:r:n:")) != -1) {
+		switch(opt) {
+			case 'u': socketPath = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'd': archiveDir = optarg; break;
+			case 'w': numWorkers = atoi(optarg); break;
+			case 's': numSim = atoi(optarg); break;
+			case 'r': simRate = atoi(optarg); break;
+			case 'n': runSeconds = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-u socket] [-p port] [-d archive dir] [-w workers] [-s recorders] [-r rate] [-n seconds]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(numWorkers < 1 || numWorkers > MAX_WORKERS || simRate < 1) {
+		fprintf(stderr, "workers must be 1-%d and rate at least 1\n", MAX_WORKERS);
+		return 1;
+	}
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	signal(SIGPIPE, SIG_IGN);
+	mkdir(archiveDir, 0755);
+
+	struct pollfd listeners[2];
+	int numListeners = 0;
+	if(socketPath[0]) {
+		if((listeners[numListeners].fd = listenUnix(socketPath)) < 0) {
+			perror(socketPath);
+			return 1;
+		}
+		listeners[numListeners++].events = POLLIN;
+	}
+	if(port) {
+		if((listeners[numListeners].fd = listenTcp(port)) < 0) {
+			perror("tcp listen");
+			return 1;
+		}
+		listeners[numListeners++].events = POLLIN;
+	}
+
+	if(startWorkers() < 0) {
+		perror("workers");
+		return 1;
+	}
+
+	//simulated recorders are spread over a few threads
+	struct Simulator sims[SIM_THREADS];
+	int numSimThreads = numSim < SIM_THREADS ? numSim : SIM_THREADS;
+	simSocket = socketPath[0] ? socketPath : NULL;
+	simPort = port;
+	for(int i = 0; i < numSimThreads; i++) {
+		memset(&sims[i], 0, sizeof(sims[i]));
+		sims[i].first = i * numSim / numSimThreads;
+		sims[i].count = (i + 1) * numSim / numSimThreads - sims[i].first;
+		sims[i].clients = calloc(sims[i].count, sizeof(struct CollectClient));
+		pthread_create(&sims[i].thread, NULL, simulatorThread, &sims[i]);
+	}
+
+	long startTime = getMicroTime();
+	while(!stop) {
+		if(runSeconds && getMicroTime() - startTime >= runSeconds * 1000000L) {
+			stop = 1;
+			break;
+		}
+		if(poll(listeners, numListeners, 200) <= 0) {
+			continue;
+		}
+		for(int i = 0; i < numListeners; i++) {
+			if(listeners[i].revents & POLLIN) {
+				int fd = accept(listeners[i].fd, NULL, NULL);
+				if(fd >= 0) {
+					handOff(fd);
+				}
+			}
+		}
+	}
+
+	//simulators drain their acks before the workers go away
+	uint64_t simSent = 0;
+	uint64_t simAcked = 0;
+	uint64_t simDropped = 0;
+	uint64_t simFailed = 0;
+	for(int i = 0; i < numSimThreads; i++) {
+		pthread_join(sims[i].thread, NULL);
+	}
+	stopWorkers = 1;
+	for(int i = 0; i < numSimThreads; i++) {
+		simSent += sims[i].sent;
+		simAcked += sims[i].acked;
+		simDropped += sims[i].dropped;
+		simFailed += sims[i].failed;
+		free(sims[i].clients);
+	}
+	for(int i = 0; i < numWorkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	double seconds = (getMicroTime() - startTime) / 1e6;
+
+	uint64_t records = 0;
+	uint64_t writes = 0;
+	for(int i = 0; i < numWorkers; i++) {
+		printf("worker %d: %llu records, %llu writes, %d devices\n", i, (unsigned long long)workers[i].records, (unsigned long long)workers[i].writes, workers[i].nDevices);
+		records += workers[i].records;
+		writes += workers[i].writes;
+	}
+	printf("total: %llu records in %.1f s (%.0f records/s), %.1f records per write\n", (unsigned long long)records, seconds, records / seconds, writes ? (double)records / writes : 0.0);
+	if(numSim) {
+		printf("simulated recorders: %d, %llu failed to connect, %llu sent, %llu acked, %llu dropped\n", numSim, (unsigned long long)simFailed, (unsigned long long)simSent, (unsigned long long)simAcked, (unsigned long long)simDropped);
+	}
+
+	if(socketPath[0]) {
+		unlink(socketPath);
+	}
+	return 0;
+}
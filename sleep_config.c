@@ -0,0 +1,338 @@
+#include "sleep_config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+enum { CFG_INT, CFG_STR };
+
+struct ConfigKey {
+  const char* name;
+  int         type;
+  size_t      offset;     /* of the value in struct Config */
+  long        min;        /* integers only */
+  long        max;
+  long        def;
+  const char* defStr;     /* strings only */
+  int         live;       /* 1 if it can change while recording */
+};
+
+#define INT_KEY(name, field, min, max, def, live) \
+  { name, CFG_INT, offsetof(struct Config, field), min, max, def, NULL, live }
+#define STR_KEY(name, field, def) \
+  { name, CFG_STR, offsetof(struct Config, field), 0, 0, 0, def, 0 }
+
+static const struct ConfigKey keys[] = {
+  INT_KEY("WATCHDOG_TIMEOUT",     timeout,            1, 15, 10, 0),
+  STR_KEY("LOG_FILE",             logFileName,        "/home/pi/defaultLog.log"),
+  STR_KEY("ULTRA_STAT_FILE",      ultraDataName,      "/home/pi/defaultUltra.txt"),
+  STR_KEY("SOUND_STAT_FILE",      soundDataName,      "/home/pi/defaultSound.txt"),
+  STR_KEY("REPORT_FILE",          reportFileName,     "/home/pi/defaultRep.txt"),
+  INT_KEY("RUN_LENGTH",           timeLimit,          1, 7 * 24 * 60, 1, 0),
+  STR_KEY("EVENT_FILE",           eventFileName,      "/home/pi/defaultEvent.txt"),
+  INT_KEY("ULTRA_FAST_MS",        ultraFastMs,        10, 60000, 100, 1),
+  INT_KEY("ULTRA_SLOW_MS",        ultraSlowMs,        10, 3600000, 5000, 1),
+  INT_KEY("ULTRA_BURST",          ultraBurst,         1, 16, 1, 1),
+  INT_KEY("ULTRA_BURST_GAP_MS",   ultraBurstGapMs,    60, 200, 60, 1),
+  INT_KEY("PRESENCE_CM",          presenceCm,         1, 1000, 60, 1),
+  INT_KEY("PRESENCE_HYST_CM",     presenceHystCm,     0, 1000, 15, 1),
+  INT_KEY("PRESENCE_TICKS",       presenceTicks,      1, 100, 2, 1),
+  INT_KEY("PRESENCE_TICK_MS",     presenceTickMs,     10, 60000, 250, 1),
+  STR_KEY("GPIO_BACKEND",         gpioBackend,        "gpiomem"),
+  STR_KEY("GPIO_CHIP",            gpioChip,           "/dev/gpiochip0"),
+  STR_KEY("COLLECTOR_SOCKET",     collectorSocket,    ""),
+  INT_KEY("COLLECTOR_PORT",       collectorPort,      0, 65535, 0, 0),
+  STR_KEY("DEVICE_ID",            deviceId,           "bed"),
+  INT_KEY("PIN_ULTRA1_TRIG",      pinLayout.trig[0],  2, 27, ULTRA1_TRIG, 0),
+  INT_KEY("PIN_ULTRA1_ECHO",      pinLayout.echo[0],  2, 27, ULTRA1_ECHO, 0),
+  INT_KEY("PIN_ULTRA2_TRIG",      pinLayout.trig[1],  2, 27, ULTRA2_TRIG, 0),
+  INT_KEY("PIN_ULTRA2_ECHO",      pinLayout.echo[1],  2, 27, ULTRA2_ECHO, 0),
+  INT_KEY("PIN_SOUND1",           pinLayout.sound[0], 2, 27, SOUND1_PIN, 0),
+  INT_KEY("PIN_SOUND2",           pinLayout.sound[1], 2, 27, SOUND2_PIN, 0),
+  STR_KEY("JOURNAL_FILE",         journalFile,        ""),
+  INT_KEY("JOURNAL_SYNC_MS",      journalSyncMs,      0, 3600000, 1000, 1),
+  INT_KEY("JOURNAL_SYNC_RECORDS", journalSyncRecords, 1, 256, 128, 1),
+  STR_KEY("CHECKPOINT_FILE",      checkpointFile,     ""),
+  INT_KEY("CHECKPOINT_MS",        checkpointMs,       1000, 3600000, 10000, 1),
+  INT_KEY("ARENA_KB",             arenaKb,            0, 4 * 1024 * 1024, 0, 0),
+  INT_KEY("DAEMON",               daemonMode,         0, 1, 0, 0),
+  INT_KEY("SESSION_GAP_MIN",      sessionGapMin,      1, 24 * 60, 30, 1),
+  INT_KEY("POLL_GAP_MS",          pollGapMs,          1, 60000, 10, 1),
+  INT_KEY("DISTURB_LAG_S",        disturbLagS,        1, 3600, 10, 1),
+  STR_KEY("BITMAP_FILE",          bitmapFile,         ""),
+  INT_KEY("CHART_POINTS",         chartPoints,        0, 100000, 400, 0),
+  STR_KEY("LIVE_SHM",             liveShm,            ""),
+  STR_KEY("BASELINE_FILE",        baselineFile,       ""),
+  STR_KEY("RING_FILE",            ringFile,           ""),
+  INT_KEY("RING_RECORDS",         ringRecords,        1024, 1 << 30, 1 << 20, 0),
+};
+
+#define NUM_KEYS (sizeof(keys) / sizeof(keys[0]))
+
+_Static_assert(NUM_ULTRA == 2 && NUM_SOUND == 2, "the PIN_ keys are for two sensors of each kind");
+
+static int* int_field(struct Config* cfg, const struct ConfigKey* key)
+{
+  return (int*)((char*)cfg + key->offset);
+}
+
+static char** str_field(struct Config* cfg, const struct ConfigKey* key)
+{
+  return (char**)((char*)cfg + key->offset);
+}
+
+/* appends a line to the errors buffer, counting it */
+static void problem(char* errors, size_t errorsLen, int* count, const char* fmt, ...)
+{
+  size_t used = errors ? strlen(errors) : 0;
+  va_list ap;
+
+  ++*count;
+  if (!errors || used + 1 >= errorsLen)
+    return;
+  va_start(ap, fmt);
+  vsnprintf(errors + used, errorsLen - used, fmt, ap);
+  va_end(ap);
+}
+
+/* where the strings go: allocated when pool is NULL, otherwise copied into
+ * the pool's fixed storage */
+struct StrPool {
+  char*  next;
+  size_t left;
+};
+
+static char* copy_str(struct StrPool* pool, const char* value)
+{
+  if (!pool)
+    return strdup(value);
+  size_t len = strlen(value) + 1;
+  if (len > pool->left)
+    return NULL;
+  char* copy = memcpy(pool->next, value, len);
+  pool->next += len;
+  pool->left -= len;
+  return copy;
+}
+
+static void set_defaults(struct Config* cfg, struct StrPool* pool)
+{
+  memset(cfg, 0, sizeof(*cfg));
+  pinDefaultLayout(&cfg->pinLayout);
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    if (keys[i].type == CFG_INT)
+      *int_field(cfg, &keys[i]) = keys[i].def;
+    else
+      *str_field(cfg, &keys[i]) = copy_str(pool, keys[i].defStr);
+  }
+}
+
+/* cuts the comments out of a line and trims it, in place */
+static char* clean_line(char* line)
+{
+  char* out = line;
+  int comment = 0;
+
+  for (char* p = line; *p; p++) {
+    if (*p == '#')
+      comment = !comment;
+    else if (!comment && *p != '\r' && *p != '\n')
+      *out++ = *p;
+  }
+  *out = 0;
+  while (out > line && isspace((unsigned char)out[-1]))
+    *--out = 0;
+  while (isspace((unsigned char)*line))
+    line++;
+  return line;
+}
+
+static void set_value(struct Config* cfg, struct StrPool* pool, const struct ConfigKey* key, const char* value,
+                      int lineNo, char* errors, size_t errorsLen, int* count)
+{
+  if (key->type == CFG_STR) {
+    char* copy = copy_str(pool, value);
+    if (!copy) {
+      problem(errors, errorsLen, count, "line %d: out of memory for %s\n", lineNo, key->name);
+      return;
+    }
+    if (!pool)
+      free(*str_field(cfg, key));
+    *str_field(cfg, key) = copy;
+    return;
+  }
+
+  char* end;
+  errno = 0;
+  long v = strtol(value, &end, 10);
+  if (*value == 0 || *end != 0 || errno) {
+    problem(errors, errorsLen, count, "line %d: %s needs a number, not \"%s\"\n", lineNo, key->name, value);
+    return;
+  }
+  if (v < key->min || v > key->max) {
+    long clamped = v < key->min ? key->min : key->max;
+    problem(errors, errorsLen, count, "line %d: %s = %ld is outside %ld-%ld, using %ld\n",
+            lineNo, key->name, v, key->min, key->max, clamped);
+    v = clamped;
+  }
+  *int_field(cfg, key) = (int)v;
+}
+
+/* one line of the file */
+static void parse_line(struct Config* cfg, struct StrPool* pool, char* line, int lineNo,
+                       char* errors, size_t errorsLen, int* count)
+{
+  char* text = clean_line(line);
+  if (*text == 0)
+    return;
+
+  char* eq = strchr(text, '=');
+  if (!eq) {
+    problem(errors, errorsLen, count, "line %d: expected KEY = VALUE\n", lineNo);
+    return;
+  }
+  char* value = eq + 1;
+  while (eq > text && isspace((unsigned char)eq[-1]))
+    eq--;
+  *eq = 0;
+  while (isspace((unsigned char)*value))
+    value++;
+
+  const struct ConfigKey* key = NULL;
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    if (!strcmp(keys[i].name, text)) {
+      key = &keys[i];
+      break;
+    }
+  }
+  if (!key) {
+    problem(errors, errorsLen, count, "line %d: unknown key %s\n", lineNo, text);
+    return;
+  }
+  set_value(cfg, pool, key, value, lineNo, errors, errorsLen, count);
+}
+
+/* checks between keys */
+static void check_keys(struct Config* cfg, char* errors, size_t errorsLen, int* count)
+{
+  if (cfg->ultraSlowMs < cfg->ultraFastMs) {
+    problem(errors, errorsLen, count, "ULTRA_SLOW_MS is less than ULTRA_FAST_MS, using %d for both\n", cfg->ultraFastMs);
+    cfg->ultraSlowMs = cfg->ultraFastMs;
+  }
+  if (cfg->chartPoints > 0 && cfg->chartPoints < 3) {
+    problem(errors, errorsLen, count, "CHART_POINTS must be 0 or at least 3, using 3\n");
+    cfg->chartPoints = 3;
+  }
+}
+
+int config_load(struct Config* cfg, const char* path, char* errors, size_t errorsLen)
+{
+  int count = 0;
+  int lineNo = 0;
+  char* line = NULL;
+  size_t cap = 0;
+
+  if (errors && errorsLen)
+    errors[0] = 0;
+  set_defaults(cfg, NULL);
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return -1;
+
+  while (getline(&line, &cap, f) >= 0)
+    parse_line(cfg, NULL, line, ++lineNo, errors, errorsLen, &count);
+  free(line);
+  fclose(f);
+
+  check_keys(cfg, errors, errorsLen, &count);
+  return count;
+}
+
+int config_reload(struct ConfigScratch* scratch, const char* path, char* errors, size_t errorsLen)
+{
+  struct StrPool pool = { scratch->strings, sizeof(scratch->strings) };
+  struct Config* cfg = &scratch->cfg;
+  int count = 0;
+  int lineNo = 0;
+  size_t used = 0;
+  int tooLong = 0;
+  char buf[512];
+  ssize_t len;
+
+  if (errors && errorsLen)
+    errors[0] = 0;
+  set_defaults(cfg, &pool);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  /* read() rather than stdio, whose buffer would be allocated */
+  while ((len = read(fd, buf, sizeof(buf))) > 0 || (len < 0 && errno == EINTR)) {
+    for (ssize_t i = 0; i < len; i++) {
+      if (buf[i] != '\n') {
+        if (used + 1 < sizeof(scratch->line))
+          scratch->line[used++] = buf[i];
+        else
+          tooLong = 1;
+        continue;
+      }
+      scratch->line[used] = 0;
+      if (tooLong)
+        problem(errors, errorsLen, &count, "line %d: longer than %zu characters\n", ++lineNo, sizeof(scratch->line) - 1);
+      else
+        parse_line(cfg, &pool, scratch->line, ++lineNo, errors, errorsLen, &count);
+      used = 0;
+      tooLong = 0;
+    }
+  }
+  close(fd);
+  if (len < 0)
+    return -1;
+  if (used > 0 || tooLong) {
+    scratch->line[used] = 0;
+    if (tooLong)
+      problem(errors, errorsLen, &count, "line %d: longer than %zu characters\n", ++lineNo, sizeof(scratch->line) - 1);
+    else
+      parse_line(cfg, &pool, scratch->line, ++lineNo, errors, errorsLen, &count);
+  }
+
+  check_keys(cfg, errors, errorsLen, &count);
+  return count;
+}
+
+void config_free(struct Config* cfg)
+{
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    if (keys[i].type == CFG_STR) {
+      free(*str_field(cfg, &keys[i]));
+      *str_field(cfg, &keys[i]) = NULL;
+    }
+  }
+}
+
+int config_apply_live(struct Config* cur, const struct Config* next, config_change_fn fn, void* arg)
+{
+  int changed = 0;
+
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    const struct ConfigKey* key = &keys[i];
+    int differs;
+    if (key->type == CFG_INT)
+      differs = *int_field(cur, key) != *int_field((struct Config*)next, key);
+    else
+      differs = strcmp(*str_field(cur, key), *str_field((struct Config*)next, key)) != 0;
+    if (!differs)
+      continue;
+    ++changed;
+    if (key->live)
+      *int_field(cur, key) = *int_field((struct Config*)next, key);
+    if (fn)
+      fn(key->name, key->live, arg);
+  }
+  return changed;
+}
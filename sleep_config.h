@@ -0,0 +1,87 @@
+#ifndef SLEEP_CONFIG_H
+#define SLEEP_CONFIG_H
+
+#include "sleep_pins.h"
+
+#include <stddef.h>
+
+/* Loader for the recorder's config file (sleep_config.cfg).
+ *
+ * Every key is one row of a table in sleep_config.c: its type, where it
+ * goes in struct Config, its default, the range an integer must be in and
+ * whether it can change while recording.  A line is KEY = VALUE, anything
+ * between # and the next # (or the end of the line) is a comment.
+ * config_load allocates the paths, so they can be any length.
+ *
+ * Problems (unknown keys, values that aren't numbers, values out of range)
+ * are described in the errors buffer and the default or nearest allowed
+ * value is used, so one bad line doesn't stop a recording. */
+
+struct Config {
+  int   timeout;            /* WATCHDOG_TIMEOUT */
+  char* logFileName;
+  char* ultraDataName;
+  char* soundDataName;
+  char* reportFileName;
+  int   timeLimit;          /* RUN_LENGTH */
+  char* eventFileName;
+  int   ultraFastMs;
+  int   ultraSlowMs;
+  int   ultraBurst;
+  int   ultraBurstGapMs;
+  int   presenceCm;
+  int   presenceHystCm;
+  int   presenceTicks;
+  int   presenceTickMs;
+  char* gpioBackend;
+  char* gpioChip;
+  char* collectorSocket;
+  int   collectorPort;
+  char* deviceId;
+  struct PinLayout pinLayout;
+  char* journalFile;
+  int   journalSyncMs;
+  int   journalSyncRecords;
+  char* checkpointFile;
+  int   checkpointMs;
+  int   arenaKb;
+  int   daemonMode;
+  int   sessionGapMin;
+  int   pollGapMs;
+  int   disturbLagS;
+  char* bitmapFile;
+  int   chartPoints;
+  char* liveShm;
+  char* baselineFile;
+  char* ringFile;
+  int   ringRecords;
+};
+
+/* fills cfg with the defaults and then the values in the file.  return
+ * -1 if the file can't be read (cfg then has the defaults), otherwise the
+ * number of problems described in errors */
+int  config_load(struct Config* cfg, const char* path, char* errors, size_t errorsLen);
+
+void config_free(struct Config* cfg);
+
+/* fixed storage for config_reload, so the file can be read again while
+ * recording without allocating.  Strings go in strings, and a line longer
+ * than line is a problem rather than being read */
+struct ConfigScratch {
+  struct Config cfg;
+  char          strings[4096];
+  char          line[1024];
+};
+
+/* config_load into scratch->cfg, which must not be passed to config_free */
+int  config_reload(struct ConfigScratch* scratch, const char* path, char* errors, size_t errorsLen);
+
+/* called for every key whose value differs between two configs */
+typedef void (*config_change_fn)(const char* key, int live, void* arg);
+
+/* copies the keys that can change while recording from next to cur and
+ * calls fn for every key that differs, live or not.  returns how many
+ * differ */
+int  config_apply_live(struct Config* cur, const struct Config* next, config_change_fn fn, void* arg);
+
+#endif /* SLEEP_CONFIG_H */
@@ -0,0 +1,58 @@
+#include "sleep_correlate.h"
+
+#include <string.h>
+
+void correlate_init(struct Correlator* c, int64_t lagMs, correlate_fn fn, void* arg)
+{
+  memset(c, 0, sizeof(*c));
+  c->lagMs = lagMs > 0 ? lagMs : 1;
+  c->fn = fn;
+  c->arg = arg;
+}
+
+void correlate_reset(struct Correlator* c)
+{
+  correlate_init(c, c->lagMs, c->fn, c->arg);
+}
+
+void correlate_sound(struct Correlator* c, int64_t timeMs)
+{
+  c->sounds++;
+  if (c->open.sounds == 0 || timeMs - c->open.lastSoundMs > c->lagMs) {
+    c->runs++;
+    c->open.firstSoundMs = timeMs;
+    c->open.sounds = 0;
+  }
+  c->open.lastSoundMs = timeMs;
+  c->open.sounds++;
+}
+
+void correlate_move(struct Correlator* c, int64_t timeMs)
+{
+  c->moves++;
+  if (c->open.sounds == 0)
+    return;
+  int64_t lag = timeMs - c->open.lastSoundMs;
+  if (lag > c->lagMs) {
+    /* too late for the open episode, nothing moved after it in time */
+    c->open.sounds = 0;
+    return;
+  }
+  if (lag < 0)
+    return;
+
+  c->open.moveMs = timeMs;
+  c->episodes++;
+  c->lagSumMs += lag;
+  int bucket = (int)(lag * CORRELATE_BUCKETS / (c->lagMs + 1));
+  c->lagHist[bucket]++;
+  if (c->fn)
+    c->fn(&c->open, c->arg);
+  c->open.sounds = 0;
+}
+
+int64_t correlate_bucket_ms(const struct Correlator* c, int bucket)
+{
+  /* the smallest lag that lands in the bucket */
+  return (bucket * (c->lagMs + 1) + CORRELATE_BUCKETS - 1) / CORRELATE_BUCKETS;
+}
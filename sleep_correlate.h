@@ -0,0 +1,55 @@
+#ifndef SLEEP_CORRELATE_H
+#define SLEEP_CORRELATE_H
+
+#include <stdint.h>
+
+/* Sound/movement correlation.
+ *
+ * A disturbance episode is a sound followed by movement within lagMs.
+ * Sounds close together are one episode: a sound more than lagMs after
+ * the last one starts a new episode and the old one is dropped if nothing
+ * moved.  The first movement ends the episode, with its lag measured from
+ * the last sound before it, and later movement needs a new sound.
+ *
+ * Sounds and movements are fed in time order, so joining two sorted
+ * streams (or walking one archive that has both) is a single pass with
+ * constant state, however many nights it covers. */
+
+#define CORRELATE_BUCKETS 10    /* the lag histogram splits lagMs into this many */
+
+struct Episode {
+  int64_t firstSoundMs;   /* the sound that started it */
+  int64_t lastSoundMs;    /* the last sound before the movement */
+  int64_t moveMs;
+  int     sounds;         /* sounds in the episode */
+};
+
+typedef void (*correlate_fn)(const struct Episode* ep, void* arg);
+
+struct Correlator {
+  int64_t lagMs;
+  long    sounds;
+  long    runs;           /* runs of sounds within lagMs, each could be an episode */
+  long    moves;
+  long    episodes;
+  int64_t lagSumMs;
+  long    lagHist[CORRELATE_BUCKETS];
+  struct Episode open;    /* open.sounds is 0 if no episode is open */
+  correlate_fn fn;        /* called for each episode, may be NULL */
+  void*   arg;
+};
+
+void correlate_init (struct Correlator* c, int64_t lagMs, correlate_fn fn, void* arg);
+
+/* clears the counts but not the lag or callback, for the next night */
+void correlate_reset(struct Correlator* c);
+
+/* the two streams are merged by the caller: everything is fed in time
+ * order, and a movement at the same time as a sound goes after it */
+void correlate_sound(struct Correlator* c, int64_t timeMs);
+void correlate_move (struct Correlator* c, int64_t timeMs);
+
+/* lower edge of a lag histogram bucket in ms */
+int64_t correlate_bucket_ms(const struct Correlator* c, int bucket);
+
+#endif /* SLEEP_CORRELATE_H */
@@ -0,0 +1,606 @@
+/**********************************************************************************
+
+File: sleep_export.c
+
+Purpose: Exports recorded samples as CSV or JSON Lines with absolute
+	timestamps, from a collector archive (<device>.rec, see
+	sleep_collectd.c) or a recorder's journal (JOURNAL_FILE).  Unlike the
+	stat files every value comes with its time, kind and sensor.
+
+	The file is mapped and cut into chunks of CHUNK_RECORDS records.
+	Worker threads each format a chunk into their own buffer, and the main
+	thread writes the buffers out in chunk order, one write() per chunk.
+	There are only 2 buffers per worker however long the range is, so a
+	year exports in the same memory as a night.  Numbers are converted
+	with a two-digit table instead of printf, and the date and time text
+	is only remade when the second changes.
+
+	Usage: sleep_export [-f csv|jsonl] [-k kinds] [-s sensors] [-w workers]
+	                    [-o output] <archive or journal> [from] [to]
+
+	kinds is a comma separated list of ultra, sound, presence, rate,
+	start, gap, end, fast and drop, sensors a list of sensor numbers (0 for records not
+	from a sensor).  Both default to everything.  from and to are unix
+	seconds or YYYY-MM-DD[THH:MM[:SS]] in local time, to is not included.
+
+**********************************************************************************/
+
+#include "sleep_archive.h"
+#include "sleep_journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK_RECORDS 8192
+//longest line either format makes, a JSON Lines one with a 31 character
+//date, 20 digit time_ms, "presence", 5 digit sensor and 11 digit value: 137
+#define LINE_MAX_LEN 160
+#define MAX_WORKERS 64
+
+static const char* const kindNames[] = {"", "ultra", "sound", "presence", "rate", "start", "gap", "end", "fast", "drop"};
+#define NUM_KINDS (int)(sizeof(kindNames) / sizeof(kindNames[0]))
+
+enum { FORMAT_CSV, FORMAT_JSONL };
+
+/**********************************
+
+Input
+
+**********************************/
+
+struct Input {
+	const char* data;
+	size_t len;
+	int journal;		//1 for a journal's blocks, 0 for an archive's plain records
+	int64_t fromMs;
+	int64_t toMs;
+	uint32_t kinds;		//bit per REC_ kind to export
+	uint64_t sensors;	//bit per sensor number to export, bit 63 for 63 and up
+	size_t next;		//where the next chunk starts, in bytes
+	size_t end;		//where the records stop
+};
+
+//archives are in time order, so the range starts with a binary search
+static size_t findTime(const struct SleepRecord* recs, size_t count, int64_t timeMs) {
+	size_t lo = 0;
+	size_t hi = count;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(recs[mid].timeMs < timeMs) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+//a journal block that is whole and not torn, or NULL
+static const struct JournalBlockHeader* blockAt(const struct Input* in, size_t pos) {
+	if(pos + sizeof(struct JournalBlockHeader) > in->len) {
+		return NULL;
+	}
+	const struct JournalBlockHeader* hdr = (const void*)(in->data + pos);
+	if(hdr->magic != JOURNAL_MAGIC || hdr->count == 0 || hdr->count > JOURNAL_BLOCK) {
+		return NULL;
+	}
+	if(pos + sizeof(*hdr) + hdr->count * sizeof(struct SleepRecord) > in->len) {
+		return NULL;
+	}
+	return hdr;
+}
+
+//the next chunk's byte range, returns 0 once there are none left.  Chunks of a
+//journal end on a block boundary, so they can be up to a block over CHUNK_RECORDS
+static int nextChunk(struct Input* in, size_t* begin, size_t* end) {
+	if(in->next >= in->end) {
+		return 0;
+	}
+	*begin = in->next;
+	if(!in->journal) {
+		size_t left = in->end - in->next;
+		size_t size = CHUNK_RECORDS * sizeof(struct SleepRecord);
+		in->next += left < size ? left : size;
+	}
+	else {
+		size_t records = 0;
+		const struct JournalBlockHeader* hdr;
+		while(records < CHUNK_RECORDS && (hdr = blockAt(in, in->next)) != NULL) {
+			records += hdr->count;
+			in->next += sizeof(*hdr) + hdr->count * sizeof(struct SleepRecord);
+		}
+		//a torn block is where the journal ends
+		if(blockAt(in, in->next) == NULL) {
+			in->end = in->next;
+		}
+	}
+	*end = in->next;
+	return *end > *begin;
+}
+
+/**********************************
+
+Formatting
+
+**********************************/
+
+static const char digitPairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+//writes v in decimal at p, returns the end
+static char* putUint(char* p, uint64_t v) {
+	char tmp[20];
+	char* t = tmp + sizeof(tmp);
+	while(v >= 100) {
+		unsigned pair = (unsigned)(v % 100) * 2;
+		v /= 100;
+		*--t = digitPairs[pair + 1];
+		*--t = digitPairs[pair];
+	}
+	if(v >= 10) {
+		*--t = digitPairs[v * 2 + 1];
+		*--t = digitPairs[v * 2];
+	}
+	else {
+		*--t = '0' + (char)v;
+	}
+	size_t n = tmp + sizeof(tmp) - t;
+	memcpy(p, t, n);
+	return p + n;
+}
+
+static char* putInt(char* p, int64_t v) {
+	if(v < 0) {
+		*p++ = '-';
+		return putUint(p, -(uint64_t)v);
+	}
+	return putUint(p, v);
+}
+
+static char* putStr(char* p, const char* s, size_t n) {
+	memcpy(p, s, n);
+	return p + n;
+}
+
+//the local date and time of a second, remade only when the second changes
+struct Stamp {
+	int64_t second;
+	char text[32];		//YYYY-MM-DDTHH:MM:SS
+	char zone[24];		//+HH:MM
+	size_t len;
+};
+
+static void stampSecond(struct Stamp* s, int64_t second) {
+	time_t t = second;
+	struct tm tm;
+	localtime_r(&t, &tm);
+	s->second = second;
+	s->len = strftime(s->text, sizeof(s->text), "%Y-%m-%dT%H:%M:%S", &tm);
+	long off = tm.tm_gmtoff / 60;
+	char sign = off < 0 ? '-' : '+';
+	off = off < 0 ? -off : off;
+	snprintf(s->zone, sizeof(s->zone), "%c%02ld:%02ld", sign, off / 60, off % 60);
+}
+
+//YYYY-MM-DDTHH:MM:SS.mmm+HH:MM
+static char* putTime(char* p, struct Stamp* s, int64_t timeMs) {
+	int64_t second = timeMs / 1000;
+	int ms = (int)(timeMs % 1000);
+	if(ms < 0) {
+		second--;
+		ms += 1000;
+	}
+	if(second != s->second) {
+		stampSecond(s, second);
+	}
+	p = putStr(p, s->text, s->len);
+	*p++ = '.';
+	*p++ = '0' + ms / 100;
+	*p++ = digitPairs[ms % 100 * 2];
+	*p++ = digitPairs[ms % 100 * 2 + 1];
+	return putStr(p, s->zone, 6);
+}
+
+#define PUT_LIT(p, lit) putStr(p, lit, sizeof(lit) - 1)
+
+static char* formatRecord(char* p, const struct SleepRecord* r, int format, struct Stamp* stamp) {
+	const char* kind = r->kind < NUM_KINDS ? kindNames[r->kind] : "";
+	if(format == FORMAT_CSV) {
+		p = putTime(p, stamp, r->timeMs);
+		*p++ = ',';
+		p = putInt(p, r->timeMs);
+		*p++ = ',';
+		if(kind[0] != 0) {
+			p = putStr(p, kind, strlen(kind));
+		}
+		else {
+			p = putUint(p, r->kind);
+		}
+		*p++ = ',';
+		p = putUint(p, r->sensor);
+		*p++ = ',';
+		p = putInt(p, r->value);
+		*p++ = '\n';
+		return p;
+	}
+	p = PUT_LIT(p, "{\"time\":\"");
+	p = putTime(p, stamp, r->timeMs);
+	p = PUT_LIT(p, "\",\"time_ms\":");
+	p = putInt(p, r->timeMs);
+	p = PUT_LIT(p, ",\"kind\":");
+	if(kind[0] != 0) {
+		*p++ = '"';
+		p = putStr(p, kind, strlen(kind));
+		*p++ = '"';
+	}
+	else {
+		p = putUint(p, r->kind);
+	}
+	p = PUT_LIT(p, ",\"sensor\":");
+	p = putUint(p, r->sensor);
+	p = PUT_LIT(p, ",\"value\":");
+	p = putInt(p, r->value);
+	p = PUT_LIT(p, "}\n");
+	return p;
+}
+
+static int wanted(const struct Input* in, const struct SleepRecord* r) {
+	return r->timeMs >= in->fromMs && r->timeMs < in->toMs
+		&& (r->kind >= 32 || (in->kinds >> r->kind) & 1)
+		&& (in->sensors >> (r->sensor < 63 ? r->sensor : 63)) & 1;
+}
+
+//formats the records in a chunk, returns the length of the text
+static size_t formatChunk(const struct Input* in, size_t begin, size_t end, int format, char* out, struct Stamp* stamp) {
+	char* p = out;
+	size_t pos = begin;
+	while(pos < end) {
+		const struct SleepRecord* recs;
+		size_t count;
+		if(in->journal) {
+			const struct JournalBlockHeader* hdr = (const void*)(in->data + pos);
+			recs = (const void*)(hdr + 1);
+			count = hdr->count;
+			pos += sizeof(*hdr) + count * sizeof(struct SleepRecord);
+		}
+		else {
+			recs = (const void*)(in->data + pos);
+			count = (end - pos) / sizeof(struct SleepRecord);
+			pos = end;
+		}
+		for(size_t i = 0; i < count; i++) {
+			if(wanted(in, &recs[i])) {
+				p = formatRecord(p, &recs[i], format, stamp);
+			}
+		}
+	}
+	return p - out;
+}
+
+/**********************************
+
+Ordered output
+
+Chunk n is formatted into slot n % numSlots once the writer is done with chunk
+n - numSlots, and the writer takes the slots in chunk order.
+
+**********************************/
+
+struct Slot {
+	char* buf;
+	size_t len;
+	size_t inputEnd;	//where the chunk's records end in the input
+	long chunk;		//chunk in the slot, -1 if it is free
+	int ready;
+};
+
+struct Export {
+	struct Input in;
+	int format;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct Slot* slots;
+	int numSlots;
+	long chunks;		//handed out so far
+	int done;		//no chunks left
+	int finished;		//workers that have stopped
+};
+
+static void* worker(void* arg) {
+	struct Export* ex = arg;
+	struct Stamp stamp = { .second = INT64_MIN };
+
+	pthread_mutex_lock(&ex->lock);
+	for(;;) {
+		//a chunk is only taken once its slot is free, so slots fill in chunk order
+		while(!ex->done && ex->slots[ex->chunks % ex->numSlots].chunk != -1) {
+			pthread_cond_wait(&ex->changed, &ex->lock);
+		}
+		size_t begin;
+		size_t end;
+		if(ex->done || !nextChunk(&ex->in, &begin, &end)) {
+			ex->done = 1;
+			break;
+		}
+		long chunk = ex->chunks++;
+		struct Slot* slot = &ex->slots[chunk % ex->numSlots];
+		slot->chunk = chunk;
+		slot->inputEnd = end;
+		pthread_mutex_unlock(&ex->lock);
+
+		size_t len = formatChunk(&ex->in, begin, end, ex->format, slot->buf, &stamp);
+
+		pthread_mutex_lock(&ex->lock);
+		slot->len = len;
+		slot->ready = 1;
+		pthread_cond_broadcast(&ex->changed);
+	}
+	ex->finished++;
+	pthread_cond_broadcast(&ex->changed);
+	pthread_mutex_unlock(&ex->lock);
+	return NULL;
+}
+
+static int writeAll(int fd, const char* data, size_t len) {
+	while(len > 0) {
+		ssize_t n = write(fd, data, len);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//writes the chunks in order as they are formatted, returns the bytes written or -1
+static long long writeChunks(struct Export* ex, int numWorkers, int fd) {
+	long long total = 0;
+	int failed = 0;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t released = 0;
+
+	pthread_mutex_lock(&ex->lock);
+	for(long chunk = 0; ; chunk++) {
+		struct Slot* slot = &ex->slots[chunk % ex->numSlots];
+		while(!(slot->chunk == chunk && slot->ready) && !(ex->finished == numWorkers && chunk >= ex->chunks)) {
+			pthread_cond_wait(&ex->changed, &ex->lock);
+		}
+		if(slot->chunk != chunk) {
+			break;
+		}
+		pthread_mutex_unlock(&ex->lock);
+		if(!failed && writeAll(fd, slot->buf, slot->len) < 0) {
+			failed = 1;
+		}
+		total += slot->len;
+
+		//the input behind the written chunks isn't needed again, dropping it keeps
+		//the memory in use the same however much is exported
+		size_t behind = slot->inputEnd / page * page;
+		if(behind > released) {
+			madvise((char*)ex->in.data + released, behind - released, MADV_DONTNEED);
+			released = behind;
+		}
+		pthread_mutex_lock(&ex->lock);
+		slot->chunk = -1;
+		slot->ready = 0;
+		pthread_cond_broadcast(&ex->changed);
+	}
+	pthread_mutex_unlock(&ex->lock);
+	return failed ? -1 : total;
+}
+
+/**********************************
+
+Arguments
+
+**********************************/
+
+//unix seconds, or a local YYYY-MM-DD[THH:MM[:SS]], in ms.  -1 if it is neither
+static int64_t parseTime(const char* text) {
+	char* end;
+	long long seconds = strtoll(text, &end, 10);
+	if(*end == 0 && end != text) {
+		return seconds * 1000;
+	}
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	int n = sscanf(text, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+	if(n != 3 && n != 5 && n != 6) {
+		return -1;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	time_t t = mktime(&tm);
+	return t == (time_t)-1 ? -1 : (int64_t)t * 1000;
+}
+
+//comma separated kind names into a mask, 0 if one isn't a kind
+static uint32_t parseKinds(char* list) {
+	uint32_t mask = 0;
+	for(char* name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+		int k = 1;
+		while(k < NUM_KINDS && strcmp(kindNames[k], name) != 0) {
+			k++;
+		}
+		if(k == NUM_KINDS) {
+			return 0;
+		}
+		mask |= 1u << k;
+	}
+	return mask;
+}
+
+static uint64_t parseSensors(char* list) {
+	uint64_t mask = 0;
+	for(char* num = strtok(list, ","); num != NULL; num = strtok(NULL, ",")) {
+		int s = atoi(num);
+		mask |= 1ULL << (s >= 0 && s < 63 ? s : 63);
+	}
+	return mask;
+}
+
+static double nowSeconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+	struct Export ex;
+	const char* output = NULL;
+	int numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	memset(&ex, 0, sizeof(ex));
+	ex.format = FORMAT_CSV;
+	ex.in.kinds = ~0u;
+	ex.in.sensors = ~0ULL;
+	ex.in.fromMs = INT64_MIN;
+	ex.in.toMs = INT64_MAX;
+	while((opt = getopt(argc, argv, "f:k:s:w:o:")) != -1) {
+		switch(opt) {
+			case 'f':
+				if(!strcmp(optarg, "jsonl")) {
+					ex.format = FORMAT_JSONL;
+				}
+				else if(strcmp(optarg, "csv") != 0) {
+					fprintf(stderr, "formats are csv and jsonl\n");
+					return 1;
+				}
+				break;
+			case 'k':
+				if((ex.in.kinds = parseKinds(optarg)) == 0) {
+					fprintf(stderr, "kinds are ultra, sound, presence, rate, start, gap, end, fast and drop\n");
+					return 1;
+				}
+				break;
+			case 's': ex.in.sensors = parseSensors(optarg); break;
+			case 'w': numWorkers = atoi(optarg); break;
+			case 'o': output = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-f csv|jsonl] [-k kinds] [-s sensors] [-w workers] [-o output] <archive or journal> [from] [to]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(optind >= argc || argc - optind > 3) {
+		fprintf(stderr, "usage: %s [-f csv|jsonl] [-k kinds] [-s sensors] [-w workers] [-o output] <archive or journal> [from] [to]\n", argv[0]);
+		return 1;
+	}
+	if(argc - optind >= 2 && (ex.in.fromMs = parseTime(argv[optind + 1])) < 0) {
+		fprintf(stderr, "times are unix seconds or YYYY-MM-DD[THH:MM[:SS]]\n");
+		return 1;
+	}
+	if(argc - optind == 3 && (ex.in.toMs = parseTime(argv[optind + 2])) < 0) {
+		fprintf(stderr, "times are unix seconds or YYYY-MM-DD[THH:MM[:SS]]\n");
+		return 1;
+	}
+	if(numWorkers < 1) {
+		numWorkers = 1;
+	}
+	if(numWorkers > MAX_WORKERS) {
+		numWorkers = MAX_WORKERS;
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if(st.st_size > 0) {
+		void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if(p == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+		madvise(p, st.st_size, MADV_SEQUENTIAL);
+		ex.in.data = p;
+		ex.in.len = st.st_size;
+	}
+	close(fd);
+
+	//a journal starts with a block header, an archive with a record
+	ex.in.journal = ex.in.len >= sizeof(uint32_t) && *(const uint32_t*)ex.in.data == JOURNAL_MAGIC;
+	if(ex.in.journal) {
+		ex.in.end = ex.in.len;
+	}
+	else {
+		const struct SleepRecord* recs = (const void*)ex.in.data;
+		size_t count = ex.in.len / sizeof(struct SleepRecord);
+		ex.in.next = findTime(recs, count, ex.in.fromMs) * sizeof(struct SleepRecord);
+		ex.in.end = findTime(recs, count, ex.in.toMs) * sizeof(struct SleepRecord);
+	}
+
+	int out = STDOUT_FILENO;
+	if(output != NULL && (out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(output);
+		return 1;
+	}
+	const char* header = ex.format == FORMAT_CSV ? "time,time_ms,kind,sensor,value\n" : "";
+	if(writeAll(out, header, strlen(header)) < 0) {
+		perror("write");
+		return 1;
+	}
+
+	ex.numSlots = 2 * numWorkers;
+	ex.slots = calloc(ex.numSlots, sizeof(struct Slot));
+	if(ex.slots == NULL) {
+		return 1;
+	}
+	for(int i = 0; i < ex.numSlots; i++) {
+		ex.slots[i].chunk = -1;
+		if((ex.slots[i].buf = malloc((CHUNK_RECORDS + JOURNAL_BLOCK) * LINE_MAX_LEN)) == NULL) {
+			return 1;
+		}
+	}
+	pthread_mutex_init(&ex.lock, NULL);
+	pthread_cond_init(&ex.changed, NULL);
+
+	double start = nowSeconds();
+	pthread_t threads[MAX_WORKERS];
+	int started = 0;
+	for(; started < numWorkers; started++) {
+		if(pthread_create(&threads[started], NULL, worker, &ex) != 0) {
+			break;
+		}
+	}
+	if(started == 0) {
+		fprintf(stderr, "Couldn't start the workers\n");
+		return 1;
+	}
+	long long bytes = writeChunks(&ex, started, out);
+	for(int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	double took = nowSeconds() - start;
+
+	if(bytes < 0) {
+		perror("write");
+		return 1;
+	}
+	if(out != STDOUT_FILENO && close(out) < 0) {
+		perror(output);
+		return 1;
+	}
+	fprintf(stderr, "%ld chunks, %.1f MB in %.2f s (%.0f MB/s) with %d workers\n",
+		ex.chunks, bytes / 1e6, took, bytes / 1e6 / (took > 0 ? took : 1e-9), started);
+	return 0;
+}
@@ -0,0 +1,215 @@
+#include "sleep_journal.h"
+#include "sleep_probes.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* crc32 (IEEE, as in zlib), table built on first use */
+static uint32_t crcTable[256];
+
+static void crc_init(void)
+{
+  uint32_t i, k;
+  for (i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    crcTable[i] = c;
+  }
+}
+
+uint32_t journal_crc32(uint32_t crc, const void* data, long len)
+{
+  const unsigned char* p = data;
+  if (crcTable[1] == 0)
+    crc_init();
+  crc = ~crc;
+  while (len-- > 0)
+    crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint32_t block_crc(struct JournalBlockHeader hdr, const struct SleepRecord* recs)
+{
+  hdr.crc = 0;
+  uint32_t crc = journal_crc32(0, &hdr, sizeof(hdr));
+  return journal_crc32(crc, recs, (long)hdr.count * sizeof(struct SleepRecord));
+}
+
+static int read_full(int fd, void* buf, size_t len)
+{
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = read(fd, (char*)buf + got, len - got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    got += n;
+  }
+  return 1;
+}
+
+int journal_open(struct Journal* j, const char* path, int syncMs, int syncRecords,
+                 journal_record_fn fn, void* arg, struct JournalRecovery* rec)
+{
+  struct JournalBlockHeader hdr;
+  struct SleepRecord* recs = j->buf;    /* empty until the journal is open */
+  struct stat st;
+  off_t good = 0;
+  uint64_t i;
+
+  memset(rec, 0, sizeof(*rec));
+  j->fd = -1;
+  j->n = 0;
+  j->seq = 0;
+  j->commits = 0;
+  j->records = 0;
+  j->lastCommitMs = 0;
+  j->syncMs = syncMs;
+  j->syncRecords = syncRecords < 1 ? 1 : syncRecords > JOURNAL_BLOCK ? JOURNAL_BLOCK : syncRecords;
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  /* blocks are checked in order, the first bad one ends the journal */
+  while (read_full(fd, &hdr, sizeof(hdr))) {
+    if (hdr.magic != JOURNAL_MAGIC || hdr.count < 1 || hdr.count > JOURNAL_BLOCK || hdr.seq != j->seq)
+      break;
+    if (!read_full(fd, recs, hdr.count * sizeof(struct SleepRecord)))
+      break;
+    if (block_crc(hdr, recs) != hdr.crc)
+      break;
+
+    if (fn != NULL)
+      for (i = 0; i < hdr.count; i++)
+        fn(&recs[i], arg);
+    rec->blocks++;
+    rec->records += hdr.count;
+    rec->lastTimeMs = recs[hdr.count - 1].timeMs;
+    good += sizeof(hdr) + hdr.count * sizeof(struct SleepRecord);
+    j->seq++;
+  }
+
+  rec->droppedBytes = st.st_size - good;
+  if ((rec->droppedBytes > 0 && (ftruncate(fd, good) < 0 || fdatasync(fd) < 0)) || lseek(fd, good, SEEK_SET) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  j->fd = fd;
+  return 0;
+}
+
+int journal_commit(struct Journal* j, long nowMs)
+{
+  struct JournalBlockHeader hdr;
+
+  j->lastCommitMs = nowMs;
+  if (j->fd < 0 || j->n == 0)
+    return 0;
+
+  hdr.magic = JOURNAL_MAGIC;
+  hdr.count = j->n;
+  hdr.seq = j->seq;
+  hdr.reserved = 0;
+  hdr.crc = block_crc(hdr, j->buf);
+
+  /* header and records go down in one write, then one sync for the group */
+  struct iovec iov[2] = { { &hdr, sizeof(hdr) }, { j->buf, j->n * sizeof(struct SleepRecord) } };
+  size_t len = iov[0].iov_len + iov[1].iov_len;
+  ssize_t n;
+  do {
+    n = writev(j->fd, iov, 2);
+  } while (n < 0 && errno == EINTR);
+
+  if (n != (ssize_t)len || fdatasync(j->fd) < 0) {
+    /* a partial block would be cut off on the next open anyway */
+    close(j->fd);
+    j->fd = -1;
+    return -1;
+  }
+
+  SLEEP_PROBE2(journal_commit, j->n, j->seq);
+  j->seq++;
+  j->commits++;
+  j->records += j->n;
+  j->n = 0;
+  return 0;
+}
+
+int journal_append(struct Journal* j, const struct SleepRecord* rec, long nowMs)
+{
+  if (j->fd < 0)
+    return -1;
+  j->buf[j->n++] = *rec;
+  if (j->n >= j->syncRecords)
+    return journal_commit(j, nowMs);
+  return 0;
+}
+
+int journal_tick(struct Journal* j, long nowMs)
+{
+  if (j->fd < 0 || j->n == 0 || nowMs - j->lastCommitMs < j->syncMs)
+    return 0;
+  return journal_commit(j, nowMs);
+}
+
+int journal_rotate(struct Journal* j, const char* path)
+{
+  size_t len = strlen(path);
+  char prev[len + 3];
+  char dir[len + 2];
+
+  if (j->fd < 0)
+    return -1;
+  memcpy(prev, path, len);
+  memcpy(prev + len, ".1", 3);
+  if (rename(path, prev) < 0)
+    return -1;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  close(j->fd);
+  j->fd = fd;
+  j->seq = 0;
+  if (fd < 0)
+    return -1;
+
+  /* the rename and the new file only survive a reset once the directory
+   * they are in is synced */
+  const char* slash = strrchr(path, '/');
+  if (slash == NULL)
+    strcpy(dir, ".");
+  else if (slash == path)
+    strcpy(dir, "/");
+  else {
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = 0;
+  }
+  int dirFd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (dirFd >= 0) {
+    fsync(dirFd);
+    close(dirFd);
+  }
+  return 0;
+}
+
+void journal_close(struct Journal* j)
+{
+  if (j->fd < 0)
+    return;
+  journal_commit(j, j->lastCommitMs);
+  if (j->fd >= 0)
+    close(j->fd);
+  j->fd = -1;
+}
@@ -0,0 +1,83 @@
+#ifndef SLEEP_JOURNAL_H
+#define SLEEP_JOURNAL_H
+
+#include "sleep_archive.h"
+
+#include <stdint.h>
+
+/* Write-ahead journal for the recorder.
+ *
+ * Samples are collected in memory and committed as blocks: a
+ * JournalBlockHeader followed by count SleepRecords, written with a single
+ * write() and made durable with one fdatasync().  A block is committed once
+ * syncRecords samples are waiting or syncMs has passed since the last
+ * commit, so a reset loses at most that much.  The crc covers the header
+ * (with crc set to 0) and the records, so a block torn by a reset is
+ * detected and cut off when the journal is opened again.
+ *
+ * The recorder rotates the journal at the end of every night, so it only
+ * ever holds the night being recorded and opening it to resume a night
+ * checks no more than that night's blocks. */
+
+#define JOURNAL_MAGIC 0x534c4a42u   /* "SLJB" */
+#define JOURNAL_BLOCK 256           /* most records in one block */
+
+struct JournalBlockHeader {
+  uint32_t magic;
+  uint32_t count;     /* records in the block, 1 to JOURNAL_BLOCK */
+  uint64_t seq;       /* block number, counting from 0 for the file */
+  uint32_t crc;       /* crc32 of the header and records */
+  uint32_t reserved;
+};
+
+/* what was found when the journal was opened */
+struct JournalRecovery {
+  uint64_t blocks;        /* valid blocks */
+  uint64_t records;       /* records in them */
+  int64_t  lastTimeMs;    /* time of the last valid record, 0 if none */
+  long     droppedBytes;  /* torn or corrupt data cut off the end */
+};
+
+struct Journal {
+  int      fd;            /* -1 if there is no journal */
+  int      n;             /* records waiting in buf */
+  int      syncMs;
+  int      syncRecords;
+  long     lastCommitMs;
+  uint64_t seq;           /* number of the next block */
+  uint64_t commits;       /* blocks written by this run */
+  uint64_t records;       /* records written by this run */
+  struct SleepRecord buf[JOURNAL_BLOCK];
+};
+
+typedef void (*journal_record_fn)(const struct SleepRecord* rec, void* arg);
+
+/* opens (creating if needed) the journal at path, checks every block and
+ * truncates the file after the last valid one.  fn, if not NULL, is called
+ * for each recovered record.  return 0 on success, -1 on error (and the
+ * journal is left closed) */
+int  journal_open  (struct Journal* j, const char* path, int syncMs, int syncRecords,
+                    journal_record_fn fn, void* arg, struct JournalRecovery* rec);
+
+/* adds a record, committing if syncRecords are now waiting */
+int  journal_append(struct Journal* j, const struct SleepRecord* rec, long nowMs);
+
+/* commits if syncMs has passed since the last commit, for the sampling loop */
+int  journal_tick  (struct Journal* j, long nowMs);
+
+/* writes the waiting records as one block and syncs it */
+int  journal_commit(struct Journal* j, long nowMs);
+
+/* moves the journal to path.1, replacing the one there, and starts a new
+ * one at path.  For when everything in it is safe elsewhere, records still
+ * waiting go in the new file.  return 0 on success, -1 on error: the old
+ * file is still used if it couldn't be moved, and the journal is closed if
+ * a new one couldn't be made */
+int  journal_rotate(struct Journal* j, const char* path);
+
+/* commits what is left and closes the file */
+void journal_close (struct Journal* j);
+
+uint32_t journal_crc32(uint32_t crc, const void* data, long len);
+
+#endif /* SLEEP_JOURNAL_H */
@@ -0,0 +1,104 @@
+#include "sleep_live.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* the snapshot is copied a word at a time with atomic loads and stores, so
+ * a reader racing the writer reads torn values it then throws away rather
+ * than racing in the C sense.  32 bit words are plain loads on the Pi */
+#define LIVE_WORDS (sizeof(struct LiveSnapshot) / sizeof(uint32_t))
+_Static_assert(sizeof(struct LiveSnapshot) % sizeof(uint32_t) == 0, "snapshot isn't whole words");
+
+#define LIVE_TRIES 100
+
+int live_create(struct LiveWriter* w, const char* name)
+{
+  memset(w, 0, sizeof(*w));
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, sizeof(struct LiveSegment)) < 0) {
+    close(fd);
+    return -1;
+  }
+  void* p = mmap(NULL, sizeof(struct LiveSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return -1;
+
+  w->seg = p;
+  /* a writer that died part way through a publish left seq odd */
+  uint32_t seq = __atomic_load_n(&w->seg->seq, __ATOMIC_RELAXED);
+  if (seq & 1)
+    __atomic_store_n(&w->seg->seq, seq + 1, __ATOMIC_RELEASE);
+  w->seg->version = LIVE_VERSION;
+  __atomic_store_n(&w->seg->magic, LIVE_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void live_publish(struct LiveWriter* w)
+{
+  uint32_t* dst = (uint32_t*)&w->seg->snap;
+  const uint32_t* src = (const uint32_t*)&w->cur;
+  uint32_t seq = __atomic_load_n(&w->seg->seq, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&w->seg->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (size_t i = 0; i < LIVE_WORDS; i++)
+    __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&w->seg->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void live_close(struct LiveWriter* w)
+{
+  if (w->seg)
+    munmap(w->seg, sizeof(struct LiveSegment));
+  w->seg = NULL;
+}
+
+const struct LiveSegment* live_attach(const char* name)
+{
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+  void* p = mmap(NULL, sizeof(struct LiveSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+  const struct LiveSegment* seg = p;
+  if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != LIVE_MAGIC || seg->version != LIVE_VERSION) {
+    munmap(p, sizeof(struct LiveSegment));
+    return NULL;
+  }
+  return seg;
+}
+
+void live_detach(const struct LiveSegment* seg)
+{
+  munmap((void*)seg, sizeof(struct LiveSegment));
+}
+
+int live_read(const struct LiveSegment* seg, struct LiveSnapshot* out)
+{
+  const uint32_t* src = (const uint32_t*)&seg->snap;
+  uint32_t* dst = (uint32_t*)out;
+
+  for (int tries = 1; tries <= LIVE_TRIES; tries++) {
+    uint32_t before = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      /* the writer may have been preempted part way, let it run */
+      if (tries % 10 == 0)
+        sched_yield();
+      continue;
+    }
+    for (size_t i = 0; i < LIVE_WORDS; i++)
+      dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == before)
+      return tries;
+  }
+  return -1;
+}
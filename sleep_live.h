@@ -0,0 +1,65 @@
+#ifndef SLEEP_LIVE_H
+#define SLEEP_LIVE_H
+
+#include <stdint.h>
+
+/* Live readings of the recorder, published in POSIX shared memory.
+ *
+ * The recorder is the only writer.  It keeps the latest ranging results,
+ * sound times, presence and counters in a LiveSnapshot and copies it into
+ * the segment under a seqlock: seq is made odd, the snapshot is written,
+ * then seq is made even again.  A reader copies the snapshot and keeps the
+ * copy only if seq was even and unchanged around it, so readers take no
+ * lock, make no system calls and never hold the writer up, and any number
+ * of them can read at once.  Writes are a few dozen stores, a reader
+ * retrying for one is rare. */
+
+#define LIVE_MAGIC   0x534c4c56u   /* "SLLV" */
+#define LIVE_VERSION 1
+
+struct LiveSnapshot {
+  int64_t  timeMs;          /* when it was published, unix ms */
+  int64_t  startMs;         /* when the recording started, 0 while waiting for bed */
+  int64_t  soundMs[2];      /* last second with sound on each sensor, 0 if none yet */
+  int32_t  dist[2];         /* latest ranging of each sensor in cm, -1 if it failed */
+  int32_t  presence;        /* 1 in bed, 0 not */
+  int32_t  intervalMs;      /* current ultrasonic sampling interval */
+  uint64_t ultraSamples;    /* since the recorder started */
+  uint64_t soundSeconds;
+  uint64_t polls;           /* of the sound sensors, this night */
+  uint64_t holes;           /* polls that came late, this night */
+  uint64_t gaps;            /* GAP events since the recorder started */
+  uint64_t records;         /* records sent to the journal or collector */
+};
+
+struct LiveSegment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq __attribute__((aligned(64)));   /* odd while the snapshot is being written */
+  struct LiveSnapshot snap __attribute__((aligned(64)));
+};
+
+struct LiveWriter {
+  struct LiveSegment* seg;  /* NULL if there is no segment */
+  struct LiveSnapshot cur;  /* the writer's copy, changed freely then published */
+};
+
+/* creates (or takes over) the segment called name, e.g. "/sleep_live" */
+int  live_create (struct LiveWriter* w, const char* name);
+
+/* copies w->cur into the segment */
+void live_publish(struct LiveWriter* w);
+
+/* unmaps the segment, it is left for the next run so readers keep working */
+void live_close  (struct LiveWriter* w);
+
+/* maps the segment read only, returns NULL if there isn't one */
+const struct LiveSegment* live_attach(const char* name);
+
+void live_detach (const struct LiveSegment* seg);
+
+/* copies a consistent snapshot into out.  returns how many tries it took,
+ * or -1 if the writer was in the middle of every one of them */
+int  live_read   (const struct LiveSegment* seg, struct LiveSnapshot* out);
+
+#endif /* SLEEP_LIVE_H */
@@ -0,0 +1,86 @@
+
+//Compares the specialized sampling functions generated from the pin map in
+//sleep_pins.h against the generic ones that take their pins from a PinLayout.
+//It runs on a block of memory standing in for the GPIO registers, so it doesn't
+//need a Pi and only measures the cost of the code around each register access.
+//
+//	./sleep_pinbench [iterations]
+
+#include "sleep_pins.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double nowSeconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//a layout read at run time, so the compiler can't turn the generic pins into constants
+static struct PinLayout layout;
+
+int main(const int argc, const char* const argv[]) {
+
+	long iterations = argc > 1 ? atol(argv[1]) : 50000000;
+	if(iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	//enough for GPLEV and the other registers the functions touch
+	GPIO_Handle gpio = calloc(1, 4096);
+	if(gpio == NULL) {
+		return 1;
+	}
+	pinDefaultLayout(&layout);
+
+	//triggers, the part of ranging that isn't waiting on the sensor
+	double start = nowSeconds();
+	for(long i = 0; i < iterations; i++) {
+		triggerOnULTRA1(gpio);
+		triggerOffULTRA1(gpio);
+		triggerOnULTRA2(gpio);
+		triggerOffULTRA2(gpio);
+	}
+	double specializedTrig = nowSeconds() - start;
+
+	start = nowSeconds();
+	for(long i = 0; i < iterations; i++) {
+		for(int s = 0; s < layout.numUltra; s++) {
+			pinWrite(gpio, GPSET(0), 1u << layout.trig[s]);
+			pinWrite(gpio, GPCLR(0), 1u << layout.trig[s]);
+		}
+	}
+	double genericTrig = nowSeconds() - start;
+
+	//sound sampling, both sensors from one read of the level register
+	long heard = 0;
+	start = nowSeconds();
+	for(long i = 0; i < iterations; i++) {
+		uint32_t levels = pinLevels(gpio);
+		heard += sampleSOUND1(levels) + sampleSOUND2(levels);
+		pinWrite(gpio, GPLEV(0), (uint32_t)i << 20);
+	}
+	double specializedSound = nowSeconds() - start;
+
+	start = nowSeconds();
+	for(long i = 0; i < iterations; i++) {
+		uint32_t levels = pinLevels(gpio);
+		for(int s = 0; s < layout.numSound; s++) {
+			heard += sampleGeneric(levels, &layout, s);
+		}
+		pinWrite(gpio, GPLEV(0), (uint32_t)i << 20);
+	}
+	double genericSound = nowSeconds() - start;
+
+	printf("%ld iterations (%ld sound samples counted)\n", iterations, heard);
+	printf("trigger pulses:  specialized %.2f ns  generic %.2f ns  per pair of sensors\n",
+		specializedTrig * 1e9 / iterations, genericTrig * 1e9 / iterations);
+	printf("sound sampling:  specialized %.2f ns  generic %.2f ns  per pair of sensors\n",
+		specializedSound * 1e9 / iterations, genericSound * 1e9 / iterations);
+
+	free(gpio);
+	return 0;
+}
@@ -0,0 +1,256 @@
+#ifndef SLEEP_PINS_H
+#define SLEEP_PINS_H
+
+#include "gpiolib_addr.h"
+#include "gpiolib_reg.h"
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+//PIN MAP
+//Every sensor is listed once here.  The pin numbers, masks and a sampling
+//function for each sensor are generated from these tables, so the functions
+//use constant masks and don't branch on which sensor they are for.
+
+//ultrasonic sensors: X(name, TRIG output pin, ECHO input pin)
+#define ULTRA_PIN_MAP(X) \
+	X(ULTRA1, 17, 14) \
+	X(ULTRA2, 18, 15)
+
+//sound sensors: X(name, input pin)
+#define SOUND_PIN_MAP(X) \
+	X(SOUND1, 23) \
+	X(SOUND2, 24)
+
+//pin numbers: ULTRA1_TRIG, ULTRA1_ECHO, SOUND1_PIN, ...
+#define PIN_ULTRA_ENUM(name, trig, echo) name##_TRIG = trig, name##_ECHO = echo,
+#define PIN_SOUND_ENUM(name, pin) name##_PIN = pin,
+enum { ULTRA_PIN_MAP(PIN_ULTRA_ENUM) SOUND_PIN_MAP(PIN_SOUND_ENUM) };
+
+//only pins 2-27 can be used, checked once here instead of on every pulse
+#define PIN_ULTRA_CHECK(name, trig, echo) _Static_assert(trig >= 2 && trig <= 27 && echo >= 2 && echo <= 27, #name " pins must be 2-27");
+#define PIN_SOUND_CHECK(name, pin) _Static_assert(pin >= 2 && pin <= 27, #name " pin must be 2-27");
+ULTRA_PIN_MAP(PIN_ULTRA_CHECK)
+SOUND_PIN_MAP(PIN_SOUND_CHECK)
+
+//masks with every pin of one kind, and sensor counts
+#define PIN_TRIG_BIT(name, trig, echo) | (1u << trig)
+#define PIN_ECHO_BIT(name, trig, echo) | (1u << echo)
+#define PIN_SOUND_BIT(name, pin) | (1u << pin)
+#define PIN_COUNT(...) + 1
+#define ULTRA_TRIG_MASK (0u ULTRA_PIN_MAP(PIN_TRIG_BIT))
+#define ULTRA_ECHO_MASK (0u ULTRA_PIN_MAP(PIN_ECHO_BIT))
+#define SOUND_PIN_MASK (0u SOUND_PIN_MAP(PIN_SOUND_BIT))
+#define NUM_ULTRA (0 ULTRA_PIN_MAP(PIN_COUNT))
+#define NUM_SOUND (0 SOUND_PIN_MAP(PIN_COUNT))
+
+//an echo that hasn't started or ended after this is given up on (1000cm is 58ms)
+#define ECHO_TIMEOUT_US 60000
+
+//register access is done here rather than through gpiolib_read_reg so the
+//generated functions inline down to plain loads and stores
+static inline uint32_t pinLevels(GPIO_Handle gpio) {
+	return ((volatile uint32_t*)gpio)[GPLEV(0)];
+}
+
+static inline void pinWrite(GPIO_Handle gpio, uint32_t offst, uint32_t mask) {
+	((volatile uint32_t*)gpio)[offst] = mask;
+}
+
+static inline long pinMicroTime(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+//the sensors need a trigger pulse of at least 10us.  It is timed by spinning,
+//usleep can't sleep that little and usually sleeps far longer
+#define TRIG_PULSE_US 12
+static inline void pinPulseWait(void) {
+	long start = pinMicroTime();
+	while(pinMicroTime() - start < TRIG_PULSE_US) {
+	}
+}
+
+//measures the echo on the pin(s) in echoMask once the trigger has been sent
+//returns the pulse width in microseconds, -1 on a timeout
+static inline long pinEchoWidth(GPIO_Handle gpio, uint32_t echoMask) {
+	long start = pinMicroTime();
+	while(!(pinLevels(gpio) & echoMask)) {
+		if(pinMicroTime() - start > ECHO_TIMEOUT_US) {
+			return -1;
+		}
+	}
+	long rise = pinMicroTime();
+	while(pinLevels(gpio) & echoMask) {
+		if(pinMicroTime() - rise > ECHO_TIMEOUT_US) {
+			return -1;
+		}
+	}
+	return pinMicroTime() - rise;
+}
+
+//measures the echoes of several sensors triggered together, echoMasks[i] is
+//sensor i's echo pin, widths[i] is set to its width or -1 on a timeout
+static inline void pinEchoWidths(GPIO_Handle gpio, const uint32_t* echoMasks, int n, long* widths) {
+	long rise[n];
+	int pending = n;
+	long start = pinMicroTime();
+	for(int i = 0; i < n; i++) {
+		rise[i] = 0;
+		widths[i] = -2;
+	}
+	while(pending > 0) {
+		uint32_t levels = pinLevels(gpio);
+		long now = pinMicroTime();
+		for(int i = 0; i < n; i++) {
+			if(widths[i] != -2) {
+				continue;
+			}
+			if(!rise[i]) {
+				if(levels & echoMasks[i]) {
+					rise[i] = now;
+				}
+				else if(now - start > ECHO_TIMEOUT_US) {
+					widths[i] = -1;
+					pending--;
+				}
+			}
+			else if(!(levels & echoMasks[i])) {
+				widths[i] = now - rise[i];
+				pending--;
+			}
+			else if(now - rise[i] > ECHO_TIMEOUT_US) {
+				widths[i] = -1;
+				pending--;
+			}
+		}
+	}
+}
+
+//SPECIALIZED FUNCTIONS
+//for each ultrasonic sensor: triggerOnULTRA1, triggerOffULTRA1 and rangeULTRA1,
+//which returns the echo width in microseconds (-1 on a timeout)
+#define PIN_ULTRA_KERNEL(name, trig, echo) \
+	static inline void triggerOn##name(GPIO_Handle gpio) { \
+		pinWrite(gpio, GPSET(0), 1u << trig); \
+	} \
+	static inline void triggerOff##name(GPIO_Handle gpio) { \
+		pinWrite(gpio, GPCLR(0), 1u << trig); \
+	} \
+	static inline long range##name(GPIO_Handle gpio) { \
+		triggerOn##name(gpio); \
+		pinPulseWait(); \
+		triggerOff##name(gpio); \
+		return pinEchoWidth(gpio, 1u << echo); \
+	}
+ULTRA_PIN_MAP(PIN_ULTRA_KERNEL)
+
+//for each sound sensor: sampleSOUND1(levels), 1 if there is sound, from one GPLEV read
+#define PIN_SOUND_KERNEL(name, pin) \
+	static inline int sample##name(uint32_t levels) { \
+		return (levels >> pin) & 1; \
+	}
+SOUND_PIN_MAP(PIN_SOUND_KERNEL)
+
+//the range functions in sensor order, so sensor n is rangeFunctions[n-1]
+#define PIN_RANGE_ENTRY(name, trig, echo) range##name,
+static long (*const rangeFunctions[NUM_ULTRA])(GPIO_Handle) = { ULTRA_PIN_MAP(PIN_RANGE_ENTRY) };
+
+//every ultrasonic sensor at once: one store raises all the triggers and one
+//lowers them, then the echoes are timed together.  widths has NUM_ULTRA entries.
+#define PIN_ECHO_ENTRY(name, trig, echo) 1u << echo,
+static const uint32_t ultraEchoMasks[NUM_ULTRA] = { ULTRA_PIN_MAP(PIN_ECHO_ENTRY) };
+
+static inline void rangeAll(GPIO_Handle gpio, long* widths) {
+	pinWrite(gpio, GPSET(0), ULTRA_TRIG_MASK);
+	pinPulseWait();
+	pinWrite(gpio, GPCLR(0), ULTRA_TRIG_MASK);
+	pinEchoWidths(gpio, ultraEchoMasks, NUM_ULTRA, widths);
+}
+
+//GENERIC FUNCTIONS
+//for layouts that come from the config file instead of the map above
+#define MAX_PIN_SENSORS 4
+
+struct PinLayout {
+	int numUltra;
+	int trig[MAX_PIN_SENSORS];
+	int echo[MAX_PIN_SENSORS];
+	int numSound;
+	int sound[MAX_PIN_SENSORS];
+};
+
+//the layout of the pin map, what the config file starts from
+#define PIN_ULTRA_LAYOUT(name, trigPin, echoPin) layout->trig[layout->numUltra] = trigPin; layout->echo[layout->numUltra++] = echoPin;
+#define PIN_SOUND_LAYOUT(name, pin) layout->sound[layout->numSound++] = pin;
+static inline void pinDefaultLayout(struct PinLayout* layout) {
+	layout->numUltra = 0;
+	layout->numSound = 0;
+	ULTRA_PIN_MAP(PIN_ULTRA_LAYOUT)
+	SOUND_PIN_MAP(PIN_SOUND_LAYOUT)
+}
+
+//returns 1 if every pin is usable (2-27)
+static inline int pinLayoutValid(const struct PinLayout* layout) {
+	for(int i = 0; i < layout->numUltra; i++) {
+		if(layout->trig[i] < 2 || layout->trig[i] > 27 || layout->echo[i] < 2 || layout->echo[i] > 27) {
+			return 0;
+		}
+	}
+	for(int i = 0; i < layout->numSound; i++) {
+		if(layout->sound[i] < 2 || layout->sound[i] > 27) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//returns 1 if the layout is the one compiled in, so the specialized functions can be used
+static inline int pinLayoutIsDefault(const struct PinLayout* layout) {
+	struct PinLayout def;
+	pinDefaultLayout(&def);
+	if(layout->numUltra != def.numUltra || layout->numSound != def.numSound) {
+		return 0;
+	}
+	for(int i = 0; i < def.numUltra; i++) {
+		if(layout->trig[i] != def.trig[i] || layout->echo[i] != def.echo[i]) {
+			return 0;
+		}
+	}
+	for(int i = 0; i < def.numSound; i++) {
+		if(layout->sound[i] != def.sound[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//sensor is 0 based, the layout must have been checked with pinLayoutValid
+static inline long rangeGeneric(GPIO_Handle gpio, const struct PinLayout* layout, int sensor) {
+	pinWrite(gpio, GPSET(0), 1u << layout->trig[sensor]);
+	pinPulseWait();
+	pinWrite(gpio, GPCLR(0), 1u << layout->trig[sensor]);
+	return pinEchoWidth(gpio, 1u << layout->echo[sensor]);
+}
+
+//the generic rangeAll, widths has layout->numUltra entries
+static inline void rangeGenericAll(GPIO_Handle gpio, const struct PinLayout* layout, long* widths) {
+	uint32_t trigMask = 0;
+	uint32_t echoMasks[MAX_PIN_SENSORS];
+	for(int i = 0; i < layout->numUltra; i++) {
+		trigMask |= 1u << layout->trig[i];
+		echoMasks[i] = 1u << layout->echo[i];
+	}
+	pinWrite(gpio, GPSET(0), trigMask);
+	pinPulseWait();
+	pinWrite(gpio, GPCLR(0), trigMask);
+	pinEchoWidths(gpio, echoMasks, layout->numUltra, widths);
+}
+
+static inline int sampleGeneric(uint32_t levels, const struct PinLayout* layout, int sensor) {
+	return (levels >> layout->sound[sensor]) & 1;
+}
+
+#endif /* SLEEP_PINS_H */
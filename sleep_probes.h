@@ -0,0 +1,53 @@
+#ifndef SLEEP_PROBES_H
+#define SLEEP_PROBES_H
+
+/* Static tracepoints (USDT) for the recorder, provider "sleep".
+ *
+ * With <sys/sdt.h> installed (systemtap-sdt-dev) each probe compiles to a
+ * single nop plus a note in the ELF file, so they cost nothing until a
+ * tracer attaches:
+ *
+ *     bpftrace -l 'usdt:./sleep_record:sleep:*'
+ *
+ * Without the header, or built with -DSLEEP_NO_PROBES, they compile to
+ * nothing at all.
+ *
+ *   range_start(sensorMask)            triggers sent
+ *   range_end(width1Us, width2Us)      echoes timed, -1 for a timeout
+ *   echo_timeout(sensor)
+ *   sound_edge(sensor, unixSec)        a second with sound was recorded
+ *   sample_enqueue(kind, sensor, value)
+ *   collector_flush(records)
+ *   journal_commit(records, seq)
+ *   watchdog_kick(msSinceStart)
+ *   analysis_start(phase) / analysis_end(phase, result)
+ *                                      phase 1 is sound, 2 is ultrasonic,
+ *                                      3 disturbances, 4 the baseline,
+ *                                      5 the charts */
+
+#if !defined(SLEEP_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SLEEP_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef SLEEP_HAVE_PROBES
+#define SLEEP_PROBE1(name, a)       DTRACE_PROBE1(sleep, name, a)
+#define SLEEP_PROBE2(name, a, b)    DTRACE_PROBE2(sleep, name, a, b)
+#define SLEEP_PROBE3(name, a, b, c) DTRACE_PROBE3(sleep, name, a, b, c)
+#else
+#define SLEEP_PROBE1(name, a)       do {} while (0)
+#define SLEEP_PROBE2(name, a, b)    do {} while (0)
+#define SLEEP_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+/* The profiling build (-DSLEEP_PROFILE, see README) keeps the stages of the
+ * sampling loop as their own functions so perf can tell them apart. */
+#ifdef SLEEP_PROFILE
+#define SLEEP_STAGE __attribute__((noinline))
+#else
+#define SLEEP_STAGE
+#endif
+
+#endif /* SLEEP_PROBES_H */
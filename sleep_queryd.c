@@ -0,0 +1,698 @@
+/**********************************************************************************
+
+File: sleep_queryd.c
+
+Purpose: Query server for the archive written by sleep_collectd.  Clients
+	connect to a Unix socket and send one query per line.  Answers are
+	streamed back a line at a time and end with "END", so a large range
+	is never held in memory.
+
+	Queries:
+	  SOUND_PER_HOUR <device> <first night> <last night>
+	      minutes with sound in each hour, nights as YYYY-MM-DD (a night
+	      runs from noon to noon the next day)
+	  MOVEMENT <device> <from> <to>
+	      ultrasonic changes over MIN_DIFF cm, times in unix seconds
+	  DISTURBANCES <device> <first night> <last night> [lag seconds]
+	      sounds followed by movement within the lag (default 10s): one
+	      line per episode, a summary per night and a lag histogram
+	  STATS
+	      cache hits and misses
+
+	Answers up to CACHE_ENTRY_MAX bytes are kept in an LRU cache keyed by
+	the query.  When a device's archive grows, entries for it are only
+	dropped if the new records fall inside their time range, so dashboards
+	polling past nights keep hitting the cache.
+
+	Usage: sleep_queryd [-u socket] [-d archive dir]
+	       sleep_queryd [-u socket] -q "query"    (sends one query and prints the answer)
+
+**********************************************************************************/
+
+#include "sleep_archive.h"
+#include "sleep_collect.h"
+#include "sleep_correlate.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_ENTRIES 128
+#define CACHE_ENTRY_MAX (256 * 1024)	//larger answers are streamed but not cached
+#define QUERY_LEN 256
+#define OUT_BUF 8192
+
+struct CacheEntry {
+	char query[QUERY_LEN];		//empty if the slot is free
+	char device[COLLECT_DEVICE_LEN];
+	int64_t fromMs;			//time range the answer covers
+	int64_t toMs;
+	off_t archiveSize;		//archive size when the answer was made
+	unsigned long lastUsed;
+	char* data;
+	size_t len;
+};
+
+static struct CacheEntry cache[CACHE_ENTRIES];
+static unsigned long cacheClock = 0;
+static unsigned long cacheHits = 0;
+static unsigned long cacheMisses = 0;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* archiveDir = ".";
+
+//output to a client, also collecting the answer for the cache while it is small enough
+struct Out {
+	int fd;
+	int failed;
+	size_t len;
+	char buf[OUT_BUF];
+	char* capture;		//NULL once the answer is too big to cache
+	size_t captureLen;
+	size_t captureCap;
+};
+
+static void outSend(struct Out* out, const char* data, size_t len) {
+	size_t pos = 0;
+	while(!out->failed && pos < len) {
+		ssize_t n = send(out->fd, data + pos, len - pos, MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			out->failed = 1;
+			break;
+		}
+		pos += n;
+	}
+}
+
+static void outFlush(struct Out* out) {
+	outSend(out, out->buf, out->len);
+	out->len = 0;
+}
+
+static void outWrite(struct Out* out, const char* data, size_t len) {
+	if(out->capture) {
+		if(out->captureLen + len > CACHE_ENTRY_MAX) {
+			free(out->capture);
+			out->capture = NULL;
+		}
+		else {
+			if(out->captureLen + len > out->captureCap) {
+				size_t cap = out->captureCap * 2;
+				while(cap < out->captureLen + len) {
+					cap *= 2;
+				}
+				char* grown = realloc(out->capture, cap);
+				if(!grown) {
+					free(out->capture);
+					out->capture = NULL;
+				}
+				else {
+					out->capture = grown;
+					out->captureCap = cap;
+				}
+			}
+			if(out->capture) {
+				memcpy(out->capture + out->captureLen, data, len);
+				out->captureLen += len;
+			}
+		}
+	}
+
+	if(out->len + len > OUT_BUF) {
+		outFlush(out);
+	}
+	if(len > OUT_BUF) {
+		outSend(out, data, len);
+		return;
+	}
+	memcpy(out->buf + out->len, data, len);
+	out->len += len;
+}
+
+static void outLine(struct Out* out, const char* line) {
+	outWrite(out, line, strlen(line));
+}
+
+/**********************************
+
+Archive access
+
+**********************************/
+
+struct Archive {
+	const struct SleepRecord* recs;
+	size_t count;
+	size_t mapLen;
+	off_t size;
+};
+
+static void archivePath(char* path, size_t len, const char* device) {
+	snprintf(path, len, "%s/%s%s", archiveDir, device, ARCHIVE_SUFFIX);
+}
+
+static off_t archiveSize(const char* device) {
+	char path[512];
+	struct stat st;
+	archivePath(path, sizeof(path), device);
+	if(stat(path, &st) < 0) {
+		return -1;
+	}
+	return st.st_size;
+}
+
+static int openArchive(struct Archive* a, const char* device) {
+	char path[512];
+	struct stat st;
+	archivePath(path, sizeof(path), device);
+
+	memset(a, 0, sizeof(*a));
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return -1;
+	}
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	a->size = st.st_size;
+	a->count = st.st_size / sizeof(struct SleepRecord);
+	a->mapLen = a->count * sizeof(struct SleepRecord);
+	if(a->mapLen > 0) {
+		void* p = mmap(NULL, a->mapLen, PROT_READ, MAP_SHARED, fd, 0);
+		if(p == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		a->recs = p;
+	}
+	close(fd);
+	return 0;
+}
+
+static void closeArchive(struct Archive* a) {
+	if(a->recs) {
+		munmap((void*)a->recs, a->mapLen);
+	}
+}
+
+//recorders send records in time order, so the start of a range can be found
+//with a binary search instead of a scan
+static size_t findTime(const struct Archive* a, int64_t timeMs) {
+	size_t lo = 0;
+	size_t hi = a->count;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(a->recs[mid].timeMs < timeMs) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/**********************************
+
+Queries
+
+**********************************/
+
+//a night starts at noon local time on its date
+static int parseNight(const char* date, int64_t* startMs) {
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	if(sscanf(date, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3) {
+		return -1;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_hour = 12;
+	tm.tm_isdst = -1;
+	time_t t = mktime(&tm);
+	if(t == (time_t)-1) {
+		return -1;
+	}
+	*startMs = (int64_t)t * 1000;
+	return 0;
+}
+
+//noon on the next day, which isn't 24 hours on when the clocks change
+static int64_t nextNight(int64_t nightStartMs) {
+	time_t t = nightStartMs / 1000;
+	struct tm tm;
+	localtime_r(&t, &tm);
+	tm.tm_mday++;
+	tm.tm_hour = 12;
+	tm.tm_min = 0;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	return (int64_t)mktime(&tm) * 1000;
+}
+
+static void printHour(struct Out* out, int64_t hourStartMs, int minutes) {
+	char line[64];
+	char stamp[32];
+	time_t t = hourStartMs / 1000;
+	struct tm tm;
+	localtime_r(&t, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:00", &tm);
+	snprintf(line, sizeof(line), "%s %d\n", stamp, minutes);
+	outLine(out, line);
+}
+
+static int64_t hourStart(int64_t timeMs) {
+	time_t t = timeMs / 1000;
+	struct tm tm;
+	localtime_r(&t, &tm);
+	tm.tm_min = 0;
+	tm.tm_sec = 0;
+	return (int64_t)mktime(&tm) * 1000;
+}
+
+//one line per hour that had sound: the hour and how many of its minutes had sound
+static void soundPerHour(const struct Archive* a, int64_t fromMs, int64_t toMs, struct Out* out) {
+	int64_t curHour = -1;
+	uint64_t minutes = 0;	//bit per minute of the current hour
+
+	for(size_t i = findTime(a, fromMs); i < a->count && a->recs[i].timeMs < toMs && !out->failed; i++) {
+		const struct SleepRecord* r = &a->recs[i];
+		if(r->kind != REC_SOUND) {
+			continue;
+		}
+		if(curHour < 0 || r->timeMs < curHour || r->timeMs >= curHour + 3600000) {
+			if(curHour >= 0) {
+				printHour(out, curHour, __builtin_popcountll(minutes));
+			}
+			curHour = hourStart(r->timeMs);
+			minutes = 0;
+		}
+		minutes |= 1ULL << ((r->timeMs - curHour) / 60000 & 63);
+	}
+	if(curHour >= 0) {
+		printHour(out, curHour, __builtin_popcountll(minutes));
+	}
+}
+
+//one line per movement: time in unix seconds, sensor and change in cm
+static void movement(const struct Archive* a, int64_t fromMs, int64_t toMs, struct Out* out) {
+	long prev[3] = {-1, -1, -1};
+	char line[64];
+
+	for(size_t i = findTime(a, fromMs); i < a->count && a->recs[i].timeMs < toMs && !out->failed; i++) {
+		const struct SleepRecord* r = &a->recs[i];
+		if(r->kind != REC_ULTRA || r->sensor < 1 || r->sensor > 2) {
+			continue;
+		}
+		if(r->value >= 0 && prev[r->sensor] >= 0 && labs(r->value - prev[r->sensor]) > MIN_DIFF) {
+			snprintf(line, sizeof(line), "%lld.%03d %d %ld\n", (long long)(r->timeMs / 1000), (int)(r->timeMs % 1000), r->sensor, labs(r->value - prev[r->sensor]));
+			outLine(out, line);
+		}
+		prev[r->sensor] = r->value;
+	}
+}
+
+static void printDisturbance(const struct Episode* ep, void* arg) {
+	char line[96];
+	snprintf(line, sizeof(line), "%lld.%03d %lld.%03d %lld\n", (long long)(ep->lastSoundMs / 1000), (int)(ep->lastSoundMs % 1000),
+		(long long)(ep->moveMs / 1000), (int)(ep->moveMs % 1000), (long long)(ep->moveMs - ep->lastSoundMs));
+	outLine(arg, line);
+}
+
+static void printNight(struct Out* out, int64_t nightStartMs, const struct Correlator* c) {
+	char line[128];
+	char stamp[16];
+	time_t t = nightStartMs / 1000;
+	struct tm tm;
+	localtime_r(&t, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d", &tm);
+	snprintf(line, sizeof(line), "NIGHT %s episodes %ld sounds %ld moves %ld\n", stamp, c->episodes, c->sounds, c->moves);
+	outLine(out, line);
+}
+
+//sound followed by movement, the sound and movement streams are already merged
+//in the archive so this is one pass however many nights are asked for
+static void disturbances(const struct Archive* a, int64_t fromMs, int64_t toMs, int64_t lagMs, struct Out* out) {
+	struct Correlator night;
+	long lagHist[CORRELATE_BUCKETS] = {0};
+	long prev[3] = {-1, -1, -1};
+	int64_t nightStart = fromMs;
+	int64_t nightEnd = nextNight(nightStart);
+	char line[64];
+
+	correlate_init(&night, lagMs, printDisturbance, out);
+	for(size_t i = findTime(a, fromMs); i < a->count && a->recs[i].timeMs < toMs && !out->failed; i++) {
+		const struct SleepRecord* r = &a->recs[i];
+		while(r->timeMs >= nightEnd) {
+			printNight(out, nightStart, &night);
+			for(int b = 0; b < CORRELATE_BUCKETS; b++) {
+				lagHist[b] += night.lagHist[b];
+			}
+			correlate_reset(&night);
+			nightStart = nightEnd;
+			nightEnd = nextNight(nightStart);
+		}
+		if(r->kind == REC_SOUND) {
+			correlate_sound(&night, r->timeMs);
+		}
+		else if(r->kind == REC_ULTRA && r->sensor >= 1 && r->sensor <= 2) {
+			if(r->value >= 0 && prev[r->sensor] >= 0 && labs(r->value - prev[r->sensor]) > MIN_DIFF) {
+				correlate_move(&night, r->timeMs);
+			}
+			prev[r->sensor] = r->value;
+		}
+	}
+	printNight(out, nightStart, &night);
+	for(int b = 0; b < CORRELATE_BUCKETS; b++) {
+		lagHist[b] += night.lagHist[b];
+		snprintf(line, sizeof(line), "LAG %lld-%lld %ld\n", (long long)correlate_bucket_ms(&night, b), (long long)correlate_bucket_ms(&night, b + 1) - 1, lagHist[b]);
+		outLine(out, line);
+	}
+}
+
+//looks a query up in the cache, sending the answer if it is there
+//an entry stays valid while everything appended since it was made is newer than its range
+static int cacheLookup(const char* query, const char* device, struct Out* out) {
+	int i;
+	pthread_mutex_lock(&cacheLock);
+	for(i = 0; i < CACHE_ENTRIES; i++) {
+		if(cache[i].query[0] != 0 && !strcmp(cache[i].query, query)) {
+			break;
+		}
+	}
+	if(i == CACHE_ENTRIES) {
+		++cacheMisses;
+		pthread_mutex_unlock(&cacheLock);
+		return 0;
+	}
+	off_t madeSize = cache[i].archiveSize;
+	int64_t toMs = cache[i].toMs;
+	pthread_mutex_unlock(&cacheLock);
+
+	//the archive is checked without the lock, so other queries don't wait on the disk
+	off_t size = archiveSize(device);
+	int valid = size == madeSize;
+	if(size > madeSize) {
+		struct SleepRecord first;
+		char path[512];
+		archivePath(path, sizeof(path), device);
+		int fd = open(path, O_RDONLY);
+		if(fd >= 0) {
+			off_t at = madeSize - madeSize % sizeof(first);
+			valid = pread(fd, &first, sizeof(first), at) == sizeof(first) && first.timeMs >= toMs;
+			close(fd);
+		}
+	}
+
+	pthread_mutex_lock(&cacheLock);
+	struct CacheEntry* e = &cache[i];
+	//the entry may have been replaced while the lock was let go
+	if(e->query[0] == 0 || strcmp(e->query, query) || e->archiveSize != madeSize) {
+		++cacheMisses;
+		pthread_mutex_unlock(&cacheLock);
+		return 0;
+	}
+	if(!valid) {
+		free(e->data);
+		e->data = NULL;
+		e->query[0] = 0;
+		++cacheMisses;
+		pthread_mutex_unlock(&cacheLock);
+		return 0;
+	}
+	e->archiveSize = size;
+	e->lastUsed = ++cacheClock;
+	++cacheHits;
+	//copied so a slow client doesn't hold the lock while it is sent
+	size_t len = e->len;
+	char* copy = malloc(len ? len : 1);
+	if(copy) {
+		memcpy(copy, e->data, len);
+	}
+	pthread_mutex_unlock(&cacheLock);
+	if(!copy) {
+		return 0;
+	}
+	outWrite(out, copy, len);
+	free(copy);
+	return 1;
+}
+
+static void cacheStore(const char* query, const char* device, int64_t fromMs, int64_t toMs, off_t size, char* data, size_t len) {
+	pthread_mutex_lock(&cacheLock);
+	struct CacheEntry* victim = &cache[0];
+	for(int i = 0; i < CACHE_ENTRIES; i++) {
+		if(cache[i].query[0] == 0) {
+			victim = &cache[i];
+			break;
+		}
+		if(cache[i].lastUsed < victim->lastUsed) {
+			victim = &cache[i];
+		}
+	}
+	free(victim->data);
+	strcpy(victim->query, query);
+	strcpy(victim->device, device);
+	victim->fromMs = fromMs;
+	victim->toMs = toMs;
+	victim->archiveSize = size;
+	victim->lastUsed = ++cacheClock;
+	victim->data = data;
+	victim->len = len;
+	pthread_mutex_unlock(&cacheLock);
+}
+
+static void runQuery(char* query, struct Out* out) {
+	char kind[32];
+	char device[COLLECT_DEVICE_LEN];
+	char from[32];
+	char to[32];
+	int64_t fromMs;
+	int64_t toMs;
+	int64_t lagMs = 10000;
+	char line[128];
+
+	if(sscanf(query, "%31s", kind) != 1) {
+		return;
+	}
+	if(!strcmp(kind, "STATS")) {
+		pthread_mutex_lock(&cacheLock);
+		snprintf(line, sizeof(line), "hits %lu misses %lu\nEND\n", cacheHits, cacheMisses);
+		pthread_mutex_unlock(&cacheLock);
+		outLine(out, line);
+		return;
+	}
+	if(sscanf(query, "%31s %31s %31s %31s", kind, device, from, to) != 4) {
+		outLine(out, "ERROR expected: <query> <device> <from> <to>\nEND\n");
+		return;
+	}
+	collect_clean_device(device);
+
+	if(!strcmp(kind, "SOUND_PER_HOUR") || !strcmp(kind, "DISTURBANCES")) {
+		if(parseNight(from, &fromMs) < 0 || parseNight(to, &toMs) < 0) {
+			outLine(out, "ERROR nights are YYYY-MM-DD\nEND\n");
+			return;
+		}
+		toMs = nextNight(toMs);
+		int lagS;
+		if(sscanf(query, "%*s %*s %*s %*s %d", &lagS) == 1 && lagS > 0) {
+			lagMs = lagS * 1000LL;
+		}
+	}
+	else if(!strcmp(kind, "MOVEMENT")) {
+		fromMs = atoll(from) * 1000;
+		toMs = atoll(to) * 1000;
+	}
+	else {
+		outLine(out, "ERROR unknown query\nEND\n");
+		return;
+	}
+
+	//the cache key is the query in a normal form, not what the client typed
+	char key[QUERY_LEN];
+	snprintf(key, sizeof(key), "%s %s %lld %lld %lld", kind, device, (long long)fromMs, (long long)toMs, (long long)lagMs);
+	if(cacheLookup(key, device, out)) {
+		outLine(out, "END\n");
+		return;
+	}
+
+	struct Archive a;
+	if(openArchive(&a, device) < 0) {
+		outLine(out, "ERROR no archive for device\nEND\n");
+		return;
+	}
+	out->captureCap = 4096;
+	out->captureLen = 0;
+	out->capture = malloc(out->captureCap);
+
+	if(!strcmp(kind, "SOUND_PER_HOUR")) {
+		soundPerHour(&a, fromMs, toMs, out);
+	}
+	else if(!strcmp(kind, "DISTURBANCES")) {
+		disturbances(&a, fromMs, toMs, lagMs, out);
+	}
+	else {
+		movement(&a, fromMs, toMs, out);
+	}
+
+	if(out->capture && !out->failed) {
+		cacheStore(key, device, fromMs, toMs, a.size, out->capture, out->captureLen);
+	}
+	else {
+		free(out->capture);
+	}
+	out->capture = NULL;
+	closeArchive(&a);
+	outLine(out, "END\n");
+}
+
+static void* clientThread(void* arg) {
+	struct Out* out = arg;
+	char query[QUERY_LEN];
+	size_t len = 0;
+
+	for(;;) {
+		ssize_t n = recv(out->fd, query + len, sizeof(query) - 1 - len, 0);
+		if(n <= 0) {
+			break;
+		}
+		len += n;
+		query[len] = 0;
+
+		char* nl;
+		while((nl = strchr(query, '\n')) != NULL) {
+			*nl = 0;
+			runQuery(query, out);
+			outFlush(out);
+			len -= nl + 1 - query;
+			memmove(query, nl + 1, len + 1);
+		}
+		if(len == sizeof(query) - 1) {
+			break;
+		}
+	}
+
+	close(out->fd);
+	free(out);
+	return NULL;
+}
+
+static int connectUnix(const char* path) {
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//client mode, sends one query and prints the answer up to END
+static int sendQuery(const char* socketPath, const char* query) {
+	int fd = connectUnix(socketPath);
+	if(fd < 0) {
+		perror(socketPath);
+		return 1;
+	}
+	dprintf(fd, "%s\n", query);
+
+	char buf[OUT_BUF];
+	size_t have = 0;
+	ssize_t n;
+	while((n = recv(fd, buf + have, sizeof(buf) - have, 0)) > 0) {
+		fwrite(buf + have, 1, n, stdout);
+		have += n;
+		//only the last few bytes are needed to see the end marker
+		if(have >= 4 && !memcmp(buf + have - 4, "END\n", 4)) {
+			break;
+		}
+		if(have > 4) {
+			memmove(buf, buf + have - 4, 4);
+			have = 4;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	const char* socketPath = "/tmp/sleep_queryd.sock";
+	const char* query = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "u:d:q:")) != -1) {
+		switch(opt) {
+			case 'u': socketPath = optarg; break;
+			case 'd': archiveDir = optarg; break;
+			case 'q': query = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-u socket] [-d archive dir] [-q query]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(query) {
+		return sendQuery(socketPath, query);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sockaddr_un addr;
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listener < 0 || strlen(socketPath) >= sizeof(addr.sun_path)) {
+		perror("socket");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketPath);
+	unlink(socketPath);
+	if(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0) {
+		perror(socketPath);
+		return 1;
+	}
+
+	for(;;) {
+		int fd = accept(listener, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("accept");
+			break;
+		}
+		struct Out* out = calloc(1, sizeof(*out));
+		pthread_t thread;
+		if(!out) {
+			close(fd);
+			continue;
+		}
+		out->fd = fd;
+		if(pthread_create(&thread, NULL, clientThread, out) != 0) {
+			close(fd);
+			free(out);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return 0;
+}
@@ -20,6 +20,20 @@ Date: December 3, 2018
 
 #include "gpiolib_addr.h"
 #include "gpiolib_reg.h"
+#include "sleep_archive.h"
+#include "sleep_arena.h"
+#include "sleep_bitmap.h"
+#include "sleep_chart.h"
+#include "sleep_collect.h"
+#include "sleep_config.h"
+#include "sleep_correlate.h"
+#include "sleep_journal.h"
+#include "sleep_live.h"
+#include "sleep_pins.h"
+#include "sleep_probes.h"
+#include "sleep_ring.h"
+#include "sleep_sketch.h"
+#include "sleep_stats.h"
 
 #include <stdint.h>
 #include <stdio.h>		//for the printf() function
@@ -32,7 +46,12 @@ Date: December 3, 2018
 #include <sys/time.h>           //for gettimeofday()
 
 #include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <signal.h>
 #include <math.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 
 //Below is a macro that had been defined to output appropriate logging messages
 //file        - will be the file pointer to the log file
@@ -49,10 +68,15 @@ Date: December 3, 2018
 //for printing data to files
 //-file is the file that is beig printed to, num is the value to be printed
 //-used for recording ultrasonic and sound sensor data
+//-with a journal the samples are already safe there, so the files are not flushed
+//for every value (flushData is 0)
+static int flushData = 1;
 #define PRINT_DATA(file, num) \
 	do{ \
 			fprintf(file, "%d ", num); \
-			fflush(file); \
+			if(flushData) { \
+				fflush(file); \
+			} \
 	}while(0)
 
 //for printing analysed data to the report file
@@ -63,11 +87,20 @@ Date: December 3, 2018
                         fflush(file); \
 	}while(0)
 
+//for printing timestamped events (rate changes etc) to the event file
+//-ms is the time in milliseconds since recording started, type is a short tag
+//-a and b are values whose meaning depends on the type
+#define PRINT_EVENT(file, ms, type, a, b) \
+	do{ \
+			fprintf(file, "%ld %s %ld %ld\n", (long)(ms), type, (long)(a), (long)(b)); \
+			fflush(file); \
+	}while(0)
+
 
 
 //This function will change the appropriate pins value in the select register
-//so that the pin can function as an output
-void setToOutput(GPIO_Handle gpio, int pinNumber)
+//so that the pins can function as outputs, bit n of pinMask is pin n
+void setToOutput(GPIO_Handle gpio, uint32_t pinMask)
 {
 	//Check that the gpio is functional
 	if(gpio == NULL)
@@ -76,29 +109,20 @@ void setToOutput(GPIO_Handle gpio, int pinNumber)
 		return;
 	}
 
-	//Check that we are trying to set a valid pin number
-	if(pinNumber < 2 || pinNumber > 27)
+	//Check that we are trying to set valid pin numbers (2-27)
+	if(pinMask & ~0x0FFFFFFCu)
 	{
 		printf("Not a valid pinNumber \n");
 		return;
 	}
 
-	//This will create a variable that has the appropriate select
-	//register number. For more information about the registers
-	//look up BCM 2835.
-	int registerNum = pinNumber / 10;
-
-	//This will create a variable that is the appropriate amount that 
-	//the 1 will need to be shifted by to set the pin to be an output
-	int bitShift = (pinNumber % 10) * 3;
-
-	//variables for the register number and the bit shift
-	uint32_t sel_reg = gpiolib_read_reg(gpio, GPFSEL(registerNum));
-	sel_reg |= 1  << bitShift;
-	gpiolib_write_reg(gpio, GPFSEL(1), sel_reg);
+	//every select register involved is written once, see gpiolib_set_function
+	gpiolib_set_function(gpio, pinMask, GPIO_FUNC_OUTPUT);
 }
 
-//This is a function used to read from the config file.
+//The config file is read by config_load in sleep_config.c, which has the table of
+//keys with their defaults and allowed ranges.  Keys marked live there take effect
+//on a reload (SIGHUP, or saving the file) without stopping the recording.
 
 /*
 
@@ -122,305 +146,99 @@ REPORT_FILE = /home/pi/sleep_report.txt
 #how long program records data for in minutes#
 RUN_LENGTH = 1
 
- */
+#event file name (rate changes)#
+EVENT_FILE = /home/pi/sleep_events.txt
 
-enum ReadState {START, VAR_NAME, WHITESPACE, VALUE, FILE_NAME, COMMENT, DONE};
-//function to read config file
-void readConfig(FILE* configFile, int* timeout, char* logFileName, char* ultraDataName, char* soundDataName,  char* reportFileName, int* timeLimit)
-{
-  	char logDef[50] = "/home/pi/defaultLog.log";
-	
-	char ultraDef[50] = "/home/pi/defaultUltra.txt";
-	
-	char soundDef[50] = "/home/pi/defaultSound.txt";
-	
-	char reportDef[50] = "/home/pi/defaultRep.txt";
-  
-  	for (int i = 0; i < 50; i++) {
-		logFileName[i] = 0;
-		ultraDataName[i] = 0;
-		soundDataName[i] = 0;
-		reportFileName[i] = 0;
-	}
-  
-	//if the config file does not exist, it sets default values
-  	if(!configFile) {
-          	for (int i = 0; i < 50; i++) {
-                        logFileName[i] = logDef[i];
-                }
-                for (int i = 0; i < 50; i++) {
-                        ultraDataName[i] = ultraDef[i];
-                } 
-          	for (int i = 0; i < 50; i++) {
-                        reportFileName[i] = reportDef[i];
-                } 
-          	for (int i = 0; i < 50; i++) {
-                        soundDataName[i] = soundDef[i];
-                }
-          
-                *timeout = 15;
-                
-                *timeLimit = 1;
-          
-          	return;
-        }
-	
-  	//Loop counter
-	int i = 0;
-	
-	//A char array to act as a buffer for the file
-	char buffer[255];
-	fgets(buffer, 255, configFile);
+#fastest ultrasonic sampling interval in ms, used while there is motion#
+ULTRA_FAST_MS = 100
 
-	//The value of the timeout variable is set to zero at the start
-	*timeout = 0;
-  
-  	//The value of record length is set to 0
-  	*timeLimit = 0;
+#slowest ultrasonic sampling interval in ms, used when distances are stable#
+ULTRA_SLOW_MS = 5000
 
-	//This is a variable used to track which input we are currently looking
-	//for (timeout, logFileName or numBlinks)
-	int input = 0;
-  
-  	//storing the names of variables to make sure they are what is needed
-  	char varName[100];
-  	int varNamePos = 0;
-  
-  	int filePos = 0;
-  
-  	//if there is an equal sign for WHITESPACE state (because equal signs should have whitespace on both sides)
-  	int gotEquals = 0;
-  	//
-  	enum ReadState s = START;
-  
-  	int counter = 0;
-  	
-  	fgets(buffer, 255, configFile);
-	
+#pings per ultrasonic sample, their trimmed mean is recorded#
+ULTRA_BURST = 5
 
-  
-  	while(s != DONE) {
-          	if(buffer[counter] == '\n') {
-                  	fgets(buffer, 255, configFile);
+#time between the pings of a sample in ms, so the last echo has died away#
+ULTRA_BURST_GAP_MS = 25
 
-                  	counter = 0;
-                }
-          
-          	if(buffer[counter] == 0) {
-                  	s = DONE;	
-                }
-          
-          	switch(s) {
-                  	case(START):
-
-                    		//if first char is a comment
-                    		if(buffer[counter] == '#') {
-                                  	s = COMMENT;
-                                }
-                    		//if whitespace
-                    		if(buffer[counter] == ' ' || buffer[counter] == '\n') {
-                                  	s = WHITESPACE;
-                                }
-                    		//if it is a letter character, it must be the start of a variable name
-                    		if(buffer[counter] >= 'A' && buffer[counter] <= 'z') {
-                                  	s = VAR_NAME;
-                                  
-                                  	varName[varNamePos] = buffer[counter];
-                                  	++varNamePos;
-                                }
-                    		break;
-                    
-                    	//if the current item is the name of a variable
-                    	case(VAR_NAME):
-
-                          	if(buffer[counter] >= 'A' && buffer[counter] <= 'z') {
-                                  	varName[varNamePos] = buffer[counter];
-                                  	++varNamePos;
-                                }
-                          	else {
-                                  	varNamePos = 0;
-                                  	if(buffer[counter] == ' ' || buffer[counter] == '\n') {
-                                                s = WHITESPACE;
-                                        }
-                                        else if(buffer[counter] == '#') {
-                                                s = COMMENT;
-                                        }
-                                        else if(buffer[counter] == '=') {
-                                                s = WHITESPACE;
-                                        }
-                                }
-                          	break;
-                    	
-                    	//if item is whitespace
-                    	case(WHITESPACE):
-
-                    		if(buffer[counter] == '#'){
-                                  	s = COMMENT;
-                                }
-                    		else if(buffer[counter] == '=') {
-                                  	gotEquals = 1;
-                                }
-                                else if(buffer[counter] == ' ') {
-                                        s = WHITESPACE;
-                                }
-                    		else if(gotEquals && buffer[counter] >= '0' && buffer[counter] <= '9'){
-
-                                  	s = VALUE;
-                                  	--counter;
-                                }
-                    		else if(gotEquals && ((buffer[counter] >= 'A' && buffer[counter] <= 'z') || buffer[counter] == '/' || buffer[counter] == ':')) {
-                                  	s = FILE_NAME;
-                                  	--counter;
-                                }
-                                else if(!gotEquals && ((buffer[counter] >= 'A' && buffer[counter] <= 'z') || buffer[counter] == '/' || buffer[counter] == ':')) {
-                                  	s = VAR_NAME;
-                                  	--counter;
-                                }
-                    		
-                    		break;
-                    
-                    	//if it is a number value to be recorded
-                    	case(VALUE):        
-
-                    		if(buffer[counter] >= '0' && buffer[counter] <= '9') {
-                                  	if(!strncmp(varName, "WATCHDOG_TIMEOUT", 5)) {
-                                          	*timeout = *timeout*10 + (buffer[counter]-'0');
-                                        }
-                                  	if(!strncmp(varName, "RUN_LENGTH", 5)) {
-                                          	*timeLimit = *timeLimit*10 + (buffer[counter]-'0');
-                                        }
-                                }
-                    		else {
-                                  	gotEquals = 0;
-                                  	varNamePos = 0;
-                                  	for(int i = 0; i < 100; i++) {
-                                          	varName[i] = 0;
-                                        }
-                                  	if(buffer[counter] == '#'){
-                                  		s = COMMENT;
-                                	}
-                                  	else if(buffer[counter] == ' ' || buffer[counter] == '\n') {
-                                          	s = WHITESPACE;
-                                        }
-                                        else if(buffer[counter] >= 'A' && buffer[counter] <= 'z') {
-                                                s = VAR_NAME;
-                                                varName[0] = buffer[counter];
-                                                varNamePos = 1;
-                                        }
-                                }
-                    		break;
-                    
-                    	//if it is the name of a file to be recorded
-                    	case(FILE_NAME):
-                    		if((buffer[counter] >= 'A' && buffer[counter] <= 'z') || buffer[counter] == '/' || buffer[counter] == '.' || buffer[counter] == ':') {
-
-                                  	if(!strncmp(varName, "LOG_FILE", 7)) {
-                                          	logFileName[filePos] = buffer[counter];
-                                        }
-                                  	if(!strncmp(varName, "ULTRA_STAT_FILE", 7)) {
-                                         	ultraDataName[filePos] = buffer[counter];
-                                        }
-                                  	if(!strncmp(varName, "SOUND_STAT_FILE", 7)) {
-                                          	soundDataName[filePos] = buffer[counter];
-                                        }
-                                        if(!strncmp(varName, "REPORT_FILE", 7)) {
-                				reportFileName[filePos] = buffer[counter];
-                                        }
-                                  	++filePos;
-                                }
-                    		else {
-					/*if (log) {
-                                                logFileName[filePos] = 0;
-                                                log = 0;
-                                        }
-                                        else if (ultra) {
-                                                ultraDataName[filePos] = 0;
-                                                ultra = 0;
-                                        }
-                                        else if (sound) {
-                                                soundDataName[filePos] = 0;
-                                                sound = 0;
-                                        }
-                                        else if (report) {
-                                                reportFileName[filePos] = 0;
-                                                report = 0;
-                                        }*/
-
-					fgets(buffer, 255, configFile);
-
-					counter = 0;			
-                                  	gotEquals = 0;
-                                  	varNamePos = 0;
-                                  	filePos = 0;
-                                  	
-                                  	for(int i = 0; i < 100; i++) {
-                                          	varName[i] = 0;
-                                        }
-                                  	if(buffer[counter] == '#'){
-                                  		s = COMMENT;
-                                	}
-                                  	else if(buffer[counter] == ' ' || buffer[counter] == '\n') {
-                                          	s = WHITESPACE;
-                                        }
-                                        else if(buffer[counter] >= 'A' && buffer[counter] <= 'z') {
-                                                s = VAR_NAME;
-                                                varName[0] = buffer[counter];
-                                                varNamePos = 1;
-                                        }
-                                }
-                    		
-                    		break;
-			
-                    	//ignores everything in a comment until the end of the comment
-                    	case(COMMENT):
-
-                    		if(buffer[counter] == '#' || buffer[counter] == '\n'){
-                                  	s = WHITESPACE;
-                                }
-                    		break;
-                    
-                    	//makes sure all variables were given a value
-                    	//if not, they are set to defaults
-                    	case(DONE):
-							
-                            	if(logFileName[0] == 0) {
-                                        for (int i = 0; i < 50; i++) {
-                                                logFileName[i] = logDef[i];
-                                        }
-                           	}
-                    		if(ultraDataName[0] == 0) {
-                                        for (int i = 0; i < 50; i++) {
-                                                ultraDataName[i] = ultraDef[i];
-                                        }  	
-                            	}				
-                            	if(reportFileName[0] == 0) {
-                                        for (int i = 0; i < 50; i++) {
-                                                reportFileName[i] = reportDef[i];
-                                        } 	
-                            	}	
-                                if(soundDataName[0] == 0) {
-                                        for (int i = 0; i < 50; i++) {
-                                                soundDataName[i] = soundDef[i];
-                                        }
-                            	}
-						
-                    		//timeout of 15 seconds
-                                if(*timeout == 0) {
-                                        *timeout = 10;
-                                }
-                            //time limit for program to run of 1 minute
-                                if(*timeLimit == 0) {
-                                        *timeLimit = 1;
-                                }
-                    
-                                break;
-                    
-                  	default:
-                		break;
-                }
-                ++counter;
-        }
-}
+#distance in cm that counts as someone being in bed#
+PRESENCE_CM = 60
+
+#extra distance in cm needed before someone counts as out of bed#
+PRESENCE_HYST_CM = 15
+
+#number of readings in a row needed to change presence state#
+PRESENCE_TICKS = 2
+
+#time in ms between presence readings while nobody is in bed#
+PRESENCE_TICK_MS = 250
+
+#gpio backend, gpiomem for the real pins, cdev for the gpio character device or sim for simulated sensors#
+GPIO_BACKEND = gpiomem
+
+#gpio character device used by the cdev backend#
+GPIO_CHIP = /dev/gpiochip0
+
+#unix socket of sleep_collectd to stream samples to, leave out to not stream#
+COLLECTOR_SOCKET = /tmp/sleep_collectd.sock
+
+#localhost tcp port of sleep_collectd, used if there is no socket#
+COLLECTOR_PORT = 0
+
+#name of this recorder for the collector#
+DEVICE_ID = bed
+
+#pins, only needed if the sensors are not wired as in sleep_pins.h#
+PIN_ULTRA1_TRIG = 17
+PIN_ULTRA1_ECHO = 14
+PIN_ULTRA2_TRIG = 18
+PIN_ULTRA2_ECHO = 15
+PIN_SOUND1 = 23
+PIN_SOUND2 = 24
+
+#write-ahead journal of every sample, leave out to not keep one#
+JOURNAL_FILE = /home/pi/sleep_journal.jnl
+
+#samples are synced to the journal at least this often, in ms#
+JOURNAL_SYNC_MS = 1000
+
+#or once this many samples are waiting (at most 256)#
+JOURNAL_SYNC_RECORDS = 128
+
+#checkpoint used to resume a recording cut off by a reset, needs JOURNAL_FILE#
+CHECKPOINT_FILE = /home/pi/sleep_checkpoint.bin
+
+#time in ms between checkpoints#
+CHECKPOINT_MS = 10000
+
+#memory budget in KB, everything is allocated from it at startup (0 to use malloc)#
+ARENA_KB = 16384
+
+#1 to keep running and record every night, RUN_LENGTH is then the longest night#
+DAEMON = 0
+
+#minutes out of bed that end a night in daemon mode#
+SESSION_GAP_MIN = 30
+
+#time in ms between sound polls above which a sound could be missed#
+POLL_GAP_MS = 10
+
+#movement this many seconds after a sound is reported as a disturbance#
+DISTURB_LAG_S = 10
+
+#bitmaps of the seconds with sound and movement for every night, for sleep_bits#
+BITMAP_FILE = /home/pi/sleep_bits.bin
+
+#points in each chart of <REPORT_FILE>.html, 0 for no charts#
+CHART_POINTS = 400
+
+#shared memory segment with the live readings for sleep_top, empty for none#
+LIVE_SHM = /sleep_live
+
+#every night's metrics are added to this file and compared with the nights before#
+BASELINE_FILE = /home/pi/sleep_baseline.bin
+
+ */
 
 //This function will get the current time using the gettimeofday function
 void getTime(char* buffer)
@@ -440,7 +258,9 @@ void getTime(char* buffer)
 	//This will set buffer to be equal to a string that in
 	//equivalent to the current date, in a month, day, year and
 	//the current time in 24 hour notation.
-  	strftime(buffer,30,"%m-%d-%Y  %T.",localtime(&curtime));
+  	//localtime_r because the report thread logs too
+  	struct tm tmBuf;
+  	strftime(buffer,30,"%m-%d-%Y  %T.",localtime_r(&curtime, &tmBuf));
 
 } 
 
@@ -454,9 +274,13 @@ long getMicroTime(){
 }
 
 //This function should initialize the GPIO pins
-GPIO_Handle initializeGPIO(FILE* logFile, char programName[]) {
+//backend is "sim" for simulated sensors, anything else uses /dev/gpiomem
+GPIO_Handle initializeGPIO(FILE* logFile, char programName[], const char* backend) {
     GPIO_Handle gpio;
-    gpio = gpiolib_init_gpio();
+    if(!strcmp(backend, "sim"))
+        gpio = gpiolib_init_sim(getpid());
+    else
+        gpio = gpiolib_init_gpio();
     if (gpio == NULL) {
 	char time[30];
 	getTime(time);
@@ -466,164 +290,523 @@ GPIO_Handle initializeGPIO(FILE* logFile, char programName[]) {
     return gpio;
 }
 
-//function for turning on pins given the pin number
-void turnOn(GPIO_Handle gpio, int pinNum)
-{
-  	if(pinNum < 2 || pinNum > 27)
-	{
-		printf("Not a valid pinNumber \n");
-		return;
+//PINS
+//The pin numbers (ULTRA1_TRIG, SOUND1_PIN, ...) and a specialized sampling function
+//for every sensor are generated from the pin map in sleep_pins.h.  If the config file
+//moves the sensors to other pins, genericPins is set and the generic functions
+//that take their pins from pinLayout are used instead.
+static struct PinLayout pinLayout;
+static int genericPins = 0;
+
+//returns if there is an error
+#define ULTRA_ERROR -1
+
+//EDGE EVENTS
+//With GPIO_BACKEND = cdev the pins are read through the gpio character device.
+//Echo widths come from the kernel's timestamps on the ECHO edges instead of
+//polling GPLEV, and sound edges are latched so a short pulse between polls is
+//still seen.  events is NULL with the other backends.
+//longest echo is 1000cm (58ms), anything longer is a timeout
+#define ECHO_TIMEOUT_MS 60
+#define EDGE_BATCH 32
+
+struct EdgeState {
+	GPIO_Events events;
+	uint32_t levels;	//current level of each input, bit per pin
+	uint32_t soundLatch;	//sound pins that went high since they were last read
+	uint32_t soundMask;	//the sound pins
+	uint32_t echoDone;	//echo pins with a complete pulse since their trigger
+	uint64_t riseNs[32];	//time of each pin's last rising edge
+	uint64_t widthNs[32];	//width of each pin's last pulse
+};
+static struct EdgeState edgeState;
+
+void processEdges(const struct gpiolib_edge* edges, int n) {
+	for(int i = 0; i < n; i++) {
+		uint32_t bit = 1u << edges[i].pin;
+		if(edges[i].rising) {
+			edgeState.levels |= bit;
+			edgeState.riseNs[edges[i].pin] = edges[i].timestampNs;
+			edgeState.soundLatch |= bit & edgeState.soundMask;
+			if(bit & edgeState.soundMask) {
+				SLEEP_PROBE2(sound_edge, edges[i].pin, (long)(edges[i].timestampNs / 1000000000));
+			}
+		}
+		else {
+			edgeState.levels &= ~bit;
+			edgeState.widthNs[edges[i].pin] = edges[i].timestampNs - edgeState.riseNs[edges[i].pin];
+			edgeState.echoDone |= bit;
+		}
 	}
-  	
-	gpiolib_write_reg(gpio, GPSET(0), 1 << pinNum);
 }
-//function for turning off pins given the pin number
-void turnOff(GPIO_Handle gpio, int pinNum)
-{
-  	if(pinNum < 2 || pinNum > 27)
-	{
-		printf("Not a valid pinNumber \n");
-		return;
+
+//waits up to timeoutMs for edges and handles every one that arrived
+//used in place of spinning on the sound pins, returns -1 on error
+SLEEP_STAGE int waitEdges(int timeoutMs) {
+	struct gpiolib_edge edges[EDGE_BATCH];
+	int n = gpiolib_events_read(edgeState.events, edges, EDGE_BATCH, timeoutMs);
+	if(n > 0) {
+		processEdges(edges, n);
 	}
-  	
-	gpiolib_write_reg(gpio, GPCLR(0), 1 << pinNum);
+	return n < 0 ? -1 : 0;
 }
 
-//pins 14 and 15 are ECHO inputs for the ultrasonic sensors
-#define ULTRA1_ECHO 14
-#define ULTRA2_ECHO 15
-//pins 17 and 18 are outputs for TRIG
-#define ULTRA1_TRIG 17
-#define ULTRA2_TRIG 18
+//pulses every trigger in trigMask with one write each way and waits for the
+//echoes in echoMask, returns the echo pins that finished in time
+uint32_t triggerEdges(uint32_t trigMask, uint32_t echoMask) {
+	edgeState.echoDone &= ~echoMask;
 
-//returns if there is an error
-#define ULTRA_ERROR -1
-long getDistanceData(GPIO_Handle gpio, int ultraNum) {
+	gpiolib_events_write(edgeState.events, trigMask, 0);
+	pinPulseWait();
+	gpiolib_events_write(edgeState.events, 0, trigMask);
+
+	long deadline = getMicroTime() + ECHO_TIMEOUT_MS * 1000L;
+	while((edgeState.echoDone & echoMask) != echoMask) {
+		long left = deadline - getMicroTime();
+		if(left <= 0 || waitEdges(left / 1000 + 1) < 0) {
+			break;
+		}
+	}
+	return edgeState.echoDone & echoMask;
+}
+
+long edgeDistance(int echoPin) {
+	//calculating distance using speed of sound estimate (343m/s)
+	long distance = (long)(edgeState.widthNs[echoPin] / 1000) / 58;
+	if(distance >= 1000) {
+		return ULTRA_ERROR;
+	}
+	return distance;
+}
+
+long getDistanceEdges(int trigPin, int echoPin) {
+	if(!triggerEdges(1u << trigPin, 1u << echoPin)) {
+		return ULTRA_ERROR;
+	}
+	return edgeDistance(echoPin);
+}
+
+//turns an echo width into a distance, -1 widths are timeouts
+long echoToDistance(long width) {
+	if(width < 0) {
+		return ULTRA_ERROR;
+	}
+
+	//calculating distance using speed of sound estimate (343m/s)
+	long distance = width/58;
 	
-	if(gpio == NULL) {
+	//if the distance is over this, it is invalid
+	if(distance >= 1000) {
 		return ULTRA_ERROR;
 	}
 
-	long initial_time;
-	long final_time;
+	return distance;
+}
 
-	if(ultraNum == 1) {
-		turnOn(gpio,ULTRA1_TRIG);
-		usleep(1000);
-		turnOff(gpio,ULTRA1_TRIG);
+long getDistanceData(GPIO_Handle gpio, int ultraNum) {
 
-		uint32_t level_reg = gpiolib_read_reg(gpio, GPLEV(0));
-		//pin 14 is ECHO input
-		int pin_state = level_reg & (1 << ULTRA1_ECHO);
+	//invalid ultrasonic number
+	if(ultraNum < 1 || ultraNum > pinLayout.numUltra) {
+		return ULTRA_ERROR;
+	}
 
-		//waits for echo to start
-		while(!pin_state){
-			level_reg = gpiolib_read_reg(gpio, GPLEV(0));
-			pin_state = level_reg & (1 << ULTRA1_ECHO);
-		}
-		initial_time = getMicroTime();
-		//wait for echo to end
-		while(pin_state){
-			level_reg = gpiolib_read_reg(gpio, GPLEV(0));
-			pin_state = level_reg & (1 << ULTRA1_ECHO);
-		}
-		final_time = getMicroTime();
+	if(edgeState.events != NULL) {
+		return getDistanceEdges(pinLayout.trig[ultraNum-1], pinLayout.echo[ultraNum-1]);
+	}
+	
+	if(gpio == NULL) {
+		return ULTRA_ERROR;
+	}
 
-		//calculating distance using speed of sound estimate (343m/s)
-		long distance = (final_time-initial_time)/58;
-		
-		//if the distance is over this, it is invalid
-		if(distance >= 1000) {
-			return ULTRA_ERROR;
+	if(genericPins) {
+		return echoToDistance(rangeGeneric(gpio, &pinLayout, ultraNum-1));
+	}
+	return echoToDistance(rangeFunctions[ultraNum-1](gpio));
+}
+
+//ranges both sensors together: both triggers go out in a single write and
+//both echoes are timed at once, so a pair costs one echo time instead of two
+SLEEP_STAGE void getDistancePair(GPIO_Handle gpio, long* dist1, long* dist2) {
+	long widths[MAX_PIN_SENSORS];
+
+	if(edgeState.events != NULL) {
+		uint32_t trigMask = (1u << pinLayout.trig[0]) | (1u << pinLayout.trig[1]);
+		uint32_t echoMask = (1u << pinLayout.echo[0]) | (1u << pinLayout.echo[1]);
+		SLEEP_PROBE1(range_start, trigMask);
+		uint32_t done = triggerEdges(trigMask, echoMask);
+		widths[0] = (done >> pinLayout.echo[0]) & 1 ? (long)(edgeState.widthNs[pinLayout.echo[0]] / 1000) : -1;
+		widths[1] = (done >> pinLayout.echo[1]) & 1 ? (long)(edgeState.widthNs[pinLayout.echo[1]] / 1000) : -1;
+		SLEEP_PROBE2(range_end, widths[0], widths[1]);
+		*dist1 = widths[0] < 0 ? ULTRA_ERROR : edgeDistance(pinLayout.echo[0]);
+		*dist2 = widths[1] < 0 ? ULTRA_ERROR : edgeDistance(pinLayout.echo[1]);
+		if(widths[0] < 0) {
+			SLEEP_PROBE1(echo_timeout, 1);
 		}
+		if(widths[1] < 0) {
+			SLEEP_PROBE1(echo_timeout, 2);
+		}
+		return;
+	}
 
-		return distance;
+	if(gpio == NULL) {
+		*dist1 = ULTRA_ERROR;
+		*dist2 = ULTRA_ERROR;
+		return;
 	}
 
-	else if(ultraNum == 2) {
-		turnOn(gpio,ULTRA2_TRIG);
-		usleep(1000);
-		turnOff(gpio,ULTRA2_TRIG);
+	SLEEP_PROBE1(range_start, genericPins ? 0 : ULTRA_TRIG_MASK);
+	if(genericPins) {
+		rangeGenericAll(gpio, &pinLayout, widths);
+	}
+	else {
+		rangeAll(gpio, widths);
+	}
+	SLEEP_PROBE2(range_end, widths[0], widths[1]);
+	if(widths[0] < 0) {
+		SLEEP_PROBE1(echo_timeout, 1);
+	}
+	if(widths[1] < 0) {
+		SLEEP_PROBE1(echo_timeout, 2);
+	}
+	*dist1 = echoToDistance(widths[0]);
+	*dist2 = echoToDistance(widths[1]);
+}
 
-		uint32_t level_reg = gpiolib_read_reg(gpio, GPLEV(0));
-		//pin 15 is ECHO input
-		int pin_state = level_reg & (1 << ULTRA2_ECHO);
+//BURST RANGING
+//With ULTRA_BURST above 1 a sample is several pings of both sensors instead of
+//one.  Pings are ULTRA_BURST_GAP_MS apart so the echoes of one have died away
+//before the next, and the recording loop carries on polling the sound sensors
+//between them, so a burst takes no more sound coverage than a single ping.  The
+//sample is the mean of the pings left after about a quarter at each end are
+//trimmed off, so one stray echo can't show up as movement, and the spread is
+//the range of the pings that were kept.  Fewer than half the pings echoing is
+//an error, as a single failed ping is.
+#define MAX_BURST 16
+
+struct BurstStats {
+	int size;
+	long samples;
+	long pings;
+	long failed;		//pings without an echo
+	long spreadSum;		//of both sensors, cm
+	long spreadMax;
+};
+
+struct Burst {
+	int size;		//pings per sample
+	long gapUs;
+	int done;		//pings of the sample in progress, 0 if there is none
+	long startUs;		//when the sample in progress started
+	long nextUs;		//when the next ping may go out
+	long dist[2][MAX_BURST];
+	struct BurstStats stats;
+};
+
+void initBurst(struct Burst* burst, int size, int gapMs) {
+	memset(burst, 0, sizeof(*burst));
+	burst->size = size;
+	burst->gapUs = gapMs * 1000L;
+	burst->stats.size = size;
+}
 
-		//waits for echo to start
-		while(!pin_state){
-			level_reg = gpiolib_read_reg(gpio, GPLEV(0));
-			pin_state = level_reg & (1 << ULTRA2_ECHO);
+//the trimmed mean of n readings, which are sorted in place.  spread is set to
+//the range of the readings that were kept
+long trimmedMean(long* dist, int n, long* spread) {
+	int valid = 0;
+	for(int i = 0; i < n; i++) {
+		if(dist[i] != ULTRA_ERROR) {
+			dist[valid++] = dist[i];
 		}
-		initial_time = getMicroTime();
-		//wait for echo to end
-		while(pin_state){
-			level_reg = gpiolib_read_reg(gpio, GPLEV(0));
-			pin_state = level_reg & (1 << ULTRA2_ECHO);
+	}
+	*spread = 0;
+	if(valid == 0 || valid * 2 < n) {
+		return ULTRA_ERROR;
+	}
+	for(int i = 1; i < valid; i++) {
+		long v = dist[i];
+		int j = i;
+		for(; j > 0 && dist[j-1] > v; j--) {
+			dist[j] = dist[j-1];
 		}
-		final_time = getMicroTime();
+		dist[j] = v;
+	}
+	int trim = valid >= 3 ? (valid + 2) / 4 : 0;
+	long sum = 0;
+	for(int i = trim; i < valid - trim; i++) {
+		sum += dist[i];
+	}
+	*spread = dist[valid - trim - 1] - dist[trim];
+	return (sum + (valid - 2*trim) / 2) / (valid - 2*trim);
+}
 
-		//calculating distance using speed of sound estimate (343m/s)
-		long distance = (final_time-initial_time)/58;
+//sends the next ping of a sample, now is relative to the start of the recording.
+//returns 1 once the sample is complete, with dist1 and dist2 set
+int stepBurst(struct Burst* burst, GPIO_Handle gpio, long now, long* dist1, long* dist2) {
+	if(burst->done == 0) {
+		burst->startUs = now;
+	}
+	long pingStart = getMicroTime();
+	getDistancePair(gpio, &burst->dist[0][burst->done], &burst->dist[1][burst->done]);
+	burst->stats.failed += (burst->dist[0][burst->done] == ULTRA_ERROR) + (burst->dist[1][burst->done] == ULTRA_ERROR);
+	burst->done++;
+	//the gap runs from the end of the echo, a late echo from this ping could
+	//otherwise be read as the next one
+	burst->nextUs = now + (getMicroTime() - pingStart) + burst->gapUs;
+	if(burst->done < burst->size) {
+		return 0;
+	}
 
-		//if the distance is over this, it is invalid
-		if(distance >= 1000) {
-			return ULTRA_ERROR;
-		}
+	long spread1;
+	long spread2;
+	*dist1 = trimmedMean(burst->dist[0], burst->done, &spread1);
+	*dist2 = trimmedMean(burst->dist[1], burst->done, &spread2);
+	burst->stats.samples++;
+	burst->stats.pings += burst->done;
+	burst->stats.spreadSum += spread1 + spread2;
+	if(spread1 > burst->stats.spreadMax) {
+		burst->stats.spreadMax = spread1;
+	}
+	if(spread2 > burst->stats.spreadMax) {
+		burst->stats.spreadMax = spread2;
+	}
+	burst->done = 0;
+	return 1;
+}
+
+//BED PRESENCE
+//Someone is in bed once a sensor reads closer than enterCm, and out of bed once
+//every valid reading is further than exitCm (enterCm plus hysteresis).  The
+//state only changes after `needed` readings in a row agree, so one bad ping does
+//not start or stop a recording.  Errors from both sensors are ignored.
+enum PresenceState {PRESENCE_EMPTY, PRESENCE_IN_BED};
+
+struct PresenceDetector {
+	enum PresenceState state;
+	int enterCm;
+	int exitCm;
+	int needed;
+	int count;	//readings in a row that disagree with state
+};
+
+void initPresence(struct PresenceDetector* det, int enterCm, int hystCm, int needed) {
+	det->state = PRESENCE_EMPTY;
+	det->enterCm = enterCm;
+	det->exitCm = enterCm + hystCm;
+	det->needed = needed;
+	det->count = 0;
+}
 
-		return distance;
+//feeds one pair of readings to the detector
+//returns 1 if the state changed on this reading
+int updatePresence(struct PresenceDetector* det, long dist1, long dist2) {
+	if(dist1 == ULTRA_ERROR && dist2 == ULTRA_ERROR) {
+		return 0;
+	}
+
+	int near = (dist1 != ULTRA_ERROR && dist1 < det->enterCm) || (dist2 != ULTRA_ERROR && dist2 < det->enterCm);
+	int far = (dist1 == ULTRA_ERROR || dist1 > det->exitCm) && (dist2 == ULTRA_ERROR || dist2 > det->exitCm);
+
+	if((det->state == PRESENCE_EMPTY && near) || (det->state == PRESENCE_IN_BED && far)) {
+		++det->count;
 	}
-	
-	//invalid ultrasonic number
 	else {
-		return ULTRA_ERROR;
-        }
+		det->count = 0;
+	}
+
+	if(det->count >= det->needed) {
+		det->state = (det->state == PRESENCE_EMPTY) ? PRESENCE_IN_BED : PRESENCE_EMPTY;
+		det->count = 0;
+		return 1;
+	}
+	return 0;
+}
+
+//ADAPTIVE ULTRASONIC SAMPLING
+//While there is movement the sensors are ranged every fastUs.  Once the 
+//distances are stable the interval doubles after every sample until it 
+//reaches slowUs, so still periods are not oversampled.
+struct UltraSchedule {
+	long intervalUs;	//current time between samples
+	long fastUs;
+	long slowUs;
+	long nextUs;		//time of the next sample, relative to the start
+	long fastTimeUs;	//total time spent sampling at the fast rate
+};
+
+void initUltraSchedule(struct UltraSchedule* sched, int fastMs, int slowMs) {
+	sched->fastUs = fastMs * 1000L;
+	sched->slowUs = slowMs * 1000L;
+	sched->intervalUs = sched->slowUs;
+	sched->nextUs = 0;
+	sched->fastTimeUs = 0;
+}
+
+//returns the change between two readings, 0 if either one is an error
+long ultraDiff(long cur, long prev) {
+	if(cur == ULTRA_ERROR || prev == ULTRA_ERROR) {
+		return 0;
+	}
+	return labs(cur - prev);
+}
+
+//picks the interval until the next sample from the last two readings of each sensor
+//returns 1 if the interval changed so the caller can record the transition
+int updateUltraSchedule(struct UltraSchedule* sched, long dist1, long dist2, long prev1, long prev2) {
+	long oldInterval = sched->intervalUs;
+
+	if(oldInterval == sched->fastUs) {
+		sched->fastTimeUs += oldInterval;
+	}
+
+	if(ultraDiff(dist1, prev1) > MIN_DIFF || ultraDiff(dist2, prev2) > MIN_DIFF) {
+		//movement, go straight to the fast rate
+		sched->intervalUs = sched->fastUs;
+	}
+	else if(sched->intervalUs < sched->slowUs) {
+		//stable, decay towards the slow rate
+		sched->intervalUs *= 2;
+		if(sched->intervalUs > sched->slowUs) {
+			sched->intervalUs = sched->slowUs;
+		}
+	}
+
+	return sched->intervalUs != oldInterval;
 }
 
-//SOUND SENSOR
-//pins 23 and 24 are inputs for the sound sensors
-#define SOUND1_PIN 23
-#define SOUND2_PIN 24
 //error for any problems
 #define SOUND_ERROR -2
 long getSoundData(GPIO_Handle gpio, int soundNum) {
 
+	if(soundNum < 1 || soundNum > pinLayout.numSound) {
+		return SOUND_ERROR;
+	}
+	int pin = pinLayout.sound[soundNum-1];
+
+	//with edge events a sound counts if the pin is high or went high since the last read
+	if(edgeState.events != NULL) {
+		if(waitEdges(0) < 0) {
+			return SOUND_ERROR;
+		}
+		int heard = ((edgeState.levels | edgeState.soundLatch) >> pin) & 1;
+		edgeState.soundLatch &= ~(1u << pin);
+		return heard;
+	}
+
 	if(gpio == NULL) {
 		return SOUND_ERROR;
 	}
 
-  	//sound sensor 1
-	if(soundNum == 1) {
-		uint32_t level_reg = gpiolib_read_reg(gpio, GPLEV(0));
-		//returns pin state of the sensor (0 if no sound, 1 if sound)
-		if (level_reg & (1 << SOUND1_PIN))
-		    return 1;
-		else
-		    return 0;
+	//returns pin state of the sensor (0 if no sound, 1 if sound)
+	return (gpiolib_read_reg(gpio, GPLEV(0)) >> pin) & 1;
+}
+
+//reads both sound sensors from a single read of the level register
+SLEEP_STAGE void getSoundPair(GPIO_Handle gpio, int* sound1, int* sound2) {
+	if(gpio != NULL && edgeState.events == NULL && !genericPins) {
+		uint32_t levels = pinLevels(gpio);
+		*sound1 = sampleSOUND1(levels);
+		*sound2 = sampleSOUND2(levels);
+		return;
+	}
+	*sound1 = getSoundData(gpio, 1);
+	*sound2 = getSoundData(gpio, 2);
+}
+
+//STREAMING TO THE COLLECTOR AND JOURNAL
+//sends one record to sleep_collectd if one is configured, records are batched by the
+//client and flushed when the watchdog is pinged.  If the collector goes away the
+//client is closed and recording carries on with just the local files.
+//Every record also goes to the journal if there is one, see sleep_journal.h.
+static struct Journal journal = { .fd = -1 };
+
+//ACTIVITY BITMAPS
+//Every second with sound or movement is also marked in the night's bitmap, see
+//sleep_bitmap.h.  Movement is a change over MIN_DIFF from the sensor's last reading.
+static struct BitmapWriter bitmap = { .fd = -1 };
+static long bitmapPrevDist[2] = {ULTRA_ERROR, ULTRA_ERROR};
+
+void markBitmap(long timeMs, int kind, int sensor, long value) {
+	if(kind == REC_SOUND && sensor >= 1 && sensor <= 2) {
+		bitmap_set(&bitmap, BITS_SOUND1 + sensor - 1, timeMs);
 	}
-	//sound sensor 2
-	else if(soundNum == 2) {
-		uint32_t level_reg = gpiolib_read_reg(gpio, GPLEV(0));
-		//returns pin state of the sensor
-		if (level_reg & (1 << SOUND2_PIN))
-		    return 1;
-		else
-		    return 0;
+	else if(kind == REC_ULTRA && sensor >= 1 && sensor <= 2) {
+		if(ultraDiff(value, bitmapPrevDist[sensor-1]) > MIN_DIFF) {
+			bitmap_set(&bitmap, BITS_MOTION1 + sensor - 1, timeMs);
+		}
+		bitmapPrevDist[sensor-1] = value;
 	}
+}
 
-	else
-		return SOUND_ERROR;
+//the live readings in shared memory (LIVE_SHM), every record is published as it
+//is made and the counters every LIVE_PERIOD_MS, see sleep_live.h
+#define LIVE_PERIOD_MS 250
+static struct LiveWriter live;
+
+void noteLive(long timeMs, int kind, int sensor, long value) {
+	struct LiveSnapshot* cur = &live.cur;
+	if(kind == REC_ULTRA && sensor >= 1 && sensor <= 2) {
+		cur->dist[sensor-1] = value;
+		cur->ultraSamples += sensor == 1;
+	}
+	else if(kind == REC_SOUND && sensor >= 1 && sensor <= 2) {
+		cur->soundMs[sensor-1] = timeMs;
+		cur->soundSeconds++;
+	}
+	else if(kind == REC_PRESENCE) {
+		cur->presence = value;
+	}
+	else if(kind == REC_RATE) {
+		cur->intervalMs = value;
+	}
+	else if(kind == REC_START) {
+		cur->startMs = timeMs;
+	}
+	else if(kind == REC_GAP) {
+		cur->gaps++;
+	}
+	cur->timeMs = getMicroTime() / 1000;
+	live_publish(&live);
+}
+
+//with RING_FILE this process only samples, every record goes through the ring to
+//the analyzer process (see sleep_ring.h and runAnalyzer)
+static struct Ring ring;
+
+SLEEP_STAGE void sendRecord(struct CollectClient* collector, long timeMs, int kind, int sensor, long value) {
+	SLEEP_PROBE3(sample_enqueue, kind, sensor, value);
+	if(bitmap.fd >= 0) {
+		markBitmap(timeMs, kind, sensor, value);
+	}
+	if(live.seg != NULL) {
+		noteLive(timeMs, kind, sensor, value);
+	}
+	if(collector->fd < 0 && journal.fd < 0 && ring.hdr == NULL) {
+		return;
+	}
+	live.cur.records++;
+	struct SleepRecord rec;
+	rec.timeMs = timeMs;
+	rec.kind = kind;
+	rec.sensor = sensor;
+	rec.value = value;
+	if(collector->fd >= 0) {
+		collect_push(collector, &rec);
+	}
+	if(journal.fd >= 0) {
+		journal_append(&journal, &rec, getMicroTime()/1000);
+	}
+	if(ring.hdr != NULL) {
+		ring_push(&ring, &rec);
+	}
 }
 
 //RECORDING DATA
 //if there are errors from the sensors, they are recorded in the log file
-//this function is for recording ultrasonic distances
-void printUltraToFile(GPIO_Handle gpio, FILE* ultraData, FILE* logFile, char programName[], long* ultraData1[], long* ultraData2[], int k) {
+//this function is for recording ultrasonic distances, with RING_FILE the stat
+//files are left to the analyzer and ultraData and soundData are NULL
+SLEEP_STAGE void printUltraToFile(FILE* ultraData, FILE* logFile, char programName[], long ultraData1[], long ultraData2[], long ultraTimes[], int k, long sampleMs, long dist1, long dist2) {
 	
   
-  	if (!ultraData) {
-          printf("Unable to open ultraData file\n");
-          return;
-        }
   	if (!logFile) {
           printf("Unable to open log file\n");
           return;
@@ -631,39 +814,28 @@ void printUltraToFile(GPIO_Handle gpio, FILE* ultraData, FILE* logFile, char pro
 	char time[30];
 	getTime(time);
   
-	//measuring and calculating distances
-	long dist1 = getDistanceData(gpio, 1);
-	long dist2 = getDistanceData(gpio, 2);
-  	*ultraData1[k] = dist1;
-  	*ultraData2[k] = dist2;
+  	ultraData1[k] = dist1;
+  	ultraData2[k] = dist2;
+  	ultraTimes[k] = sampleMs;
 
 	//recording ultrasonic distances, records error if there is an error
+	if(ultraData != NULL) {
+		PRINT_DATA(ultraData, dist1);
+		PRINT_DATA(ultraData, dist2);
+	}
 	if(dist1 == ULTRA_ERROR) {
-		PRINT_DATA(ultraData, ULTRA_ERROR);
 		PRINT_MSG(logFile, time, programName, "Warning: Invalid ultrasonic data from sensor 1\n\n");
 	}
-  	//records valid readings
-	else {
-		PRINT_DATA(ultraData, dist1);
-	}
 	if(dist2 == ULTRA_ERROR) {
-		PRINT_DATA(ultraData, ULTRA_ERROR);
 		PRINT_MSG(logFile, time, programName, "Warning: Invalid ultrasonic data from sensor 2\n\n");
 	}
-	else {
-		PRINT_DATA(ultraData, dist2);
-	}
 
 	return;
 
 }
 //this function is for recording sound
-void printSoundToFile(GPIO_Handle gpio, FILE* soundData, FILE* logFile, char programName[], int* prev1, int* prev2, long startTime) {
+SLEEP_STAGE void printSoundToFile(GPIO_Handle gpio, FILE* soundData, FILE* logFile, char programName[], int* prev1, int* prev2, long startTime, struct CollectClient* collector) {
   
-  	if (!soundData) {
-          printf("Unable to open soundData file\n");
-          return;
-        }
   	if (!logFile) {
           printf("Unable to open log file\n");
           return;
@@ -672,100 +844,185 @@ void printSoundToFile(GPIO_Handle gpio, FILE* soundData, FILE* logFile, char pro
 	getTime(time);
   
   	//checking sound values
-  	int sound1 = getSoundData(gpio, 1);
-	int sound2 = getSoundData(gpio, 2);
+  	int sound1;
+	int sound2;
+	getSoundPair(gpio, &sound1, &sound2);
   
   	//recording sound values, records the error if there is an error
 	if(sound1 == SOUND_ERROR) {
-		PRINT_DATA(soundData, SOUND_ERROR);
+		if(soundData != NULL) {
+			PRINT_DATA(soundData, SOUND_ERROR);
+		}
 		PRINT_MSG(logFile, time, programName, "Warning: Invalid sound data from sensor 1\n\n");
 	}
 	else {
 		if(sound1 == 1 && *prev1 != getMicroTime()/1000000) { 	
 			*prev1 = getMicroTime()/1000000;	
-			PRINT_DATA(soundData, *prev1-(startTime/1000000));
+			SLEEP_PROBE2(sound_edge, 1, *prev1);
+			if(soundData != NULL) {
+				PRINT_DATA(soundData, *prev1-(startTime/1000000));
+			}
+			sendRecord(collector, *prev1 * 1000L, REC_SOUND, 1, 1);
 		}
 	}	
 	if(sound2 == SOUND_ERROR) {
-		PRINT_DATA(soundData, SOUND_ERROR);
+		if(soundData != NULL) {
+			PRINT_DATA(soundData, SOUND_ERROR);
+		}
 		PRINT_MSG(logFile, time, programName, "Warning: Invalid sound data from sensor 2\n\n");
 	}
 	else {
 		//PRINT_DATA(soundData, sound2);
 		if(sound2 == 1 && *prev2 != getMicroTime()/1000000) {
 			*prev2 = getMicroTime()/1000000;
-			PRINT_DATA(soundData, *prev2-(startTime/1000000));
+			SLEEP_PROBE2(sound_edge, 2, *prev2);
+			if(soundData != NULL) {
+				PRINT_DATA(soundData, *prev2-(startTime/1000000));
+			}
+			sendRecord(collector, *prev2 * 1000L, REC_SOUND, 2, 1);
 		}
 	}
   	return;
 }
 
+//SOUND POLL COVERAGE
+//The sound pins are only read once per pass of the recording loop, so anything
+//that holds the loop up (ranging, flushes, syncs) is time a short sound can be
+//missed in.  Every poll interval is measured, intervals longer than the bound
+//are counted as holes, and the report gives the share of in-bed time that was
+//covered and a histogram of the intervals.  With edge events the sound pins are
+//latched between reads, so long intervals are measured but aren't holes.
+#define POLL_HIST_BUCKETS 12
+
+struct PollStats {
+	long lastUs;		//time of the last poll, -1 before the first one
+	long boundUs;		//longer intervals than this are holes
+	int latched;		//1 if sounds between polls are latched (edge events)
+	long polls;
+	long totalUs;		//time between polls, the time the sensors were watched for
+	long holeUs;		//part of totalUs that was in holes
+	long holes;
+	long maxGapUs;
+	long hist[POLL_HIST_BUCKETS];	//bucket 0 is under 1ms, bucket n is 2^(n-1) to 2^n ms
+};
+
+void initPollStats(struct PollStats* stats, int boundMs, int latched) {
+	memset(stats, 0, sizeof(*stats));
+	stats->lastUs = -1;
+	stats->boundUs = boundMs * 1000L;
+	stats->latched = latched;
+}
+
+//the next poll is not timed against the last one, used when the user left the bed
+//since nothing is polled until they are back
+void pausePollStats(struct PollStats* stats) {
+	stats->lastUs = -1;
+}
+
+//called at every sound poll, now is relative to the start of the recording
+//returns the length of the interval that ended if it was a hole, 0 if not
+long recordPoll(struct PollStats* stats, long now) {
+	long gap = stats->lastUs < 0 ? -1 : now - stats->lastUs;
+	stats->lastUs = now;
+	stats->polls++;
+	if(gap < 0) {
+		return 0;
+	}
+
+	int bucket = 0;
+	for(long ms = gap / 1000; ms > 0 && bucket < POLL_HIST_BUCKETS - 1; ms >>= 1) {
+		bucket++;
+	}
+	stats->hist[bucket]++;
+	stats->totalUs += gap;
+	if(gap > stats->maxGapUs) {
+		stats->maxGapUs = gap;
+	}
+	if(gap > stats->boundUs && !stats->latched) {
+		stats->holes++;
+		stats->holeUs += gap;
+		return gap;
+	}
+	return 0;
+}
+
+//percentage of the watched time that wasn't in a hole
+double pollCoverage(const struct PollStats* stats) {
+	if(stats->totalUs == 0) {
+		return 100.0;
+	}
+	return 100.0 * (stats->totalUs - stats->holeUs) / stats->totalUs;
+}
+
+//state for counting sounds per minute while the sound stat file is parsed
+struct SoundCount {
+	int* byMinute;
+	int timeLimit;
+	long skipped;	//errors and times outside the recording
+};
+
+//called for every value in the sound stat file, values are seconds since the start
+void countSound(long value, void* arg) {
+	struct SoundCount* count = arg;
+	if(value < 0 || value / 60 >= count->timeLimit) {
+		//SOUND_ERROR, or a time that doesn't fit in the recording
+		++count->skipped;
+		return;
+	}
+	++count->byMinute[value / 60];
+}
+
 //function to find top time periods that had multiple sounds
-//stores data by minute in byMinute array, and stores minute with most activity in topMinutes
-void analyzeSound(FILE* soundFile, int* byMinute, int* topMinutes, int timeLimit) {
-	if (!soundFile) {
+//stores data by minute in byMinute array, and stores minutes with most activity in topMinutes
+//(highest first), returns how many values in the file were skipped, or -1 if it can't be read
+SLEEP_STAGE long analyzeSound(const char* soundFileName, int* byMinute, int* topMinutes, int timeLimit) {
+	struct StatFile soundFile;
+	if (stats_map(&soundFile, soundFileName) < 0) {
         	printf("Unable to open soundData file\n");
-          	return;
+          	return -1;
         }
         
         //number of highest minutes of sound data
   	const int NUM_TOP = timeLimit/6 + 1;
-  	//char to store the value of what it reads
-  	char c = fgetc(soundFile);
-  	int curTimeSec = 0;
   
   	for(int i = 0; i < timeLimit; i++) {
           	byMinute[i] = 0;
         }
-  
-  	while(c != 0 && !feof(soundFile)) {
-          	
-          	while(c != ' ' && c != 0) {
-                  	//if it has a sound error (-2)
-                  	if(c == '-') {
-                                //waits until it finds a space
-                          	while(c != ' ' && c != 0) {
-                                        c = fgetc(soundFile);
-                                }
-                        }
-
-			if(c != 0) {
-                          	//if not a null character, calculates a time value in seconds
-                  		curTimeSec = curTimeSec*10 + (c-'0');
-                  		c = fgetc(soundFile);
-			}
-                }
-		if(c != 0) {
-                  	//increments array of number of sounds per minute
-		  	byMinute[curTimeSec/60] = byMinute[curTimeSec/60] + 1;
-                  	//resets time value
-		  	curTimeSec = 0;
-		  	//reads the next character until it is not a space
-		  	while(c == ' ') {
-		          	c = fgetc(soundFile);
-		        }
-          	}
-        }
+
+  	struct SoundCount count = {byMinute, timeLimit, 0};
+  	struct StatCount parsed = stats_parse(soundFile.data, soundFile.len, countSound, &count);
+  	stats_unmap(&soundFile);
   	
-  	//topMinutes is minute that has highest value in byMinute
-  	for(int i = 0; i < NUM_TOP || i < timeLimit; i++) {
-          	topMinutes[i] = i;
+  	//keeps topMinutes sorted from most to least sound, earlier minutes win ties
+  	int numTop = 0;
+  	for(int i = 0; i < timeLimit; i++) {
+          	int j = numTop;
+          	if(numTop < NUM_TOP) {
+          		++numTop;
+          	}
+          	else if(byMinute[i] <= byMinute[topMinutes[NUM_TOP-1]]) {
+          		continue;
+          	}
+          	else {
+          		j = NUM_TOP-1;
+          	}
+          	while(j > 0 && byMinute[i] > byMinute[topMinutes[j-1]]) {
+          		topMinutes[j] = topMinutes[j-1];
+          		--j;
+          	}
+          	topMinutes[j] = i;
         }
-  	for(int i = NUM_TOP; i < timeLimit || i < timeLimit; i++) {
-          	//sets the minutes that had the most sound activity to the topMinutes array
-          	for(int j = 0; j < NUM_TOP; j++) {
-                  	if(byMinute[i] > byMinute[topMinutes[j]]) {
-                          	topMinutes[j] = i;
-                          	j = NUM_TOP;
-                        }	
-                }
-          	
+        //recordings shorter than NUM_TOP minutes leave the rest at minute 0
+        for(int i = numTop; i < NUM_TOP; i++) {
+        	topMinutes[i] = 0;
         }
+
+        return parsed.bad + count.skipped;
 }
 
-// Prints to report if change is more than 8cm
-#define MIN_DIFF 8
-void analyzeUltra(FILE* reportFile, long* ultraData1[], long* ultraData2[], const int k, const int loopTime) {
+// Prints to report if change is more than MIN_DIFF
+//sample times come from ultraTimes since the sampling rate changes with movement
+SLEEP_STAGE void analyzeUltra(FILE* reportFile, long ultraData1[], long ultraData2[], long ultraTimes[], const int k) {
 	
   	if(!reportFile) {
           printf("Unable to open report file\n");
@@ -781,36 +1038,109 @@ void analyzeUltra(FILE* reportFile, long* ultraData1[], long* ultraData2[], cons
 
   	// Goes through the array and checks for changes in movement
   	// Prints time in minute, seconds from movement
-  	while (j <= k) {
+  	while (j < k) {
 		
-          	passedSeconds = j * loopTime;
+          	passedSeconds = ultraTimes[j] / 1000;
           	passedMinutes = passedSeconds/60;
           
-        	if (*ultraData1[j] != -1 || *ultraData2[j] != -1) {
-			if (*ultraData1[j] != -1 && *ultraData1[j-1] != -1)
-                          	diff1 = fabs(*ultraData1[j] - *ultraData1[j-1]);
-                  	else
-                          	diff1 = 0;
-                  	if (*ultraData2[j] != -1 && *ultraData2[j-1] != -1)
-                          	diff2 = fabs(*ultraData2[j] - *ultraData2[j-1]);
-                  	else
-                          	diff2 = 0;
-                }
-          	else {
-			diff1 = 0;
-                  	diff2 = 0;
-                }
+        	diff1 = ultraDiff(ultraData1[j], ultraData1[j-1]);
+        	diff2 = ultraDiff(ultraData2[j], ultraData2[j-1]);
           	// If distances is greater than certain difference, print it to analysis
           	if (diff1 > MIN_DIFF || diff2 > MIN_DIFF) {
 			if (diff1 > diff2)
-                          	PRINT_ANALYSIS(reportFile, "Movement at", passedMinutes, passedSeconds, diff1);
+                          	PRINT_ANALYSIS(reportFile, "Movement at", passedMinutes, passedSeconds%60, diff1);
                         else
-                          	PRINT_ANALYSIS(reportFile, "Movement at", passedMinutes, passedSeconds, diff2);
+                          	PRINT_ANALYSIS(reportFile, "Movement at", passedMinutes, passedSeconds%60, diff2);
                 }
           	j++;
         }
 }
 
+//DISTURBANCES
+//Sound followed by movement within DISTURB_LAG_S, which is likely the sound
+//waking the sleeper.  The sound file and the ultrasonic samples are both in time
+//order, so they are merge joined in one pass as the sound file is parsed.
+
+//walks the ultrasonic samples, stopping at each one that is movement
+struct MoveCursor {
+	const long* ultraData1;
+	const long* ultraData2;
+	const long* ultraTimes;
+	int k;
+	int j;
+};
+
+//returns the time in ms of the next movement without passing it, -1 if there is none
+long peekMovement(struct MoveCursor* moves) {
+	for(; moves->j < moves->k; moves->j++) {
+		int j = moves->j;
+		if(j > 0 && (ultraDiff(moves->ultraData1[j], moves->ultraData1[j-1]) > MIN_DIFF || ultraDiff(moves->ultraData2[j], moves->ultraData2[j-1]) > MIN_DIFF)) {
+			return moves->ultraTimes[j];
+		}
+	}
+	return -1;
+}
+
+//feeds the correlator every movement before timeMs (all of them for -1)
+void feedMovements(struct Correlator* corr, struct MoveCursor* moves, long timeMs) {
+	long move;
+	while((move = peekMovement(moves)) >= 0 && (timeMs < 0 || move < timeMs)) {
+		correlate_move(corr, move);
+		moves->j++;
+	}
+}
+
+struct DisturbJoin {
+	struct Correlator corr;
+	struct MoveCursor moves;
+	int timeLimit;
+};
+
+//called for every value in the sound stat file, the movements up to it go first
+void joinSound(long value, void* arg) {
+	struct DisturbJoin* join = arg;
+	if(value < 0 || value / 60 >= join->timeLimit) {
+		return;
+	}
+	feedMovements(&join->corr, &join->moves, value * 1000);
+	correlate_sound(&join->corr, value * 1000);
+}
+
+void printDisturbance(const struct Episode* ep, void* arg) {
+	FILE* reportFile = arg;
+	int seconds = ep->firstSoundMs / 1000;
+	PRINT_ANALYSIS(reportFile, "Disturbance at (lag in ms)", seconds/60, seconds%60, (int)(ep->moveMs - ep->lastSoundMs));
+}
+
+//prints every disturbance, their count and how long the movement took to follow
+SLEEP_STAGE void analyzeDisturbances(FILE* reportFile, const char* soundFileName, long ultraData1[], long ultraData2[], long ultraTimes[], const int k, int timeLimit, int lagS) {
+	struct StatFile soundFile;
+	if (stats_map(&soundFile, soundFileName) < 0) {
+        	printf("Unable to open soundData file\n");
+          	return;
+        }
+
+	struct DisturbJoin join = {.moves = {ultraData1, ultraData2, ultraTimes, k, 0}, .timeLimit = timeLimit};
+	correlate_init(&join.corr, lagS * 1000L, printDisturbance, reportFile);
+	stats_parse(soundFile.data, soundFile.len, joinSound, &join);
+	stats_unmap(&soundFile);
+	feedMovements(&join.corr, &join.moves, -1);
+
+	struct Correlator* corr = &join.corr;
+	fprintf(reportFile, "Disturbances: %ld of %ld runs of sound were followed by movement within %ds (%ld sounds, %ld movements)\n",
+		corr->episodes, corr->runs, lagS, corr->sounds, corr->moves);
+	if(corr->episodes > 0) {
+		fprintf(reportFile, "Average lag: %ldms\n", (long)(corr->lagSumMs / corr->episodes));
+		for(int i = 0; i < CORRELATE_BUCKETS; i++) {
+			if(corr->lagHist[i] > 0) {
+				fprintf(reportFile, "Lag %ld-%ldms: %ld\n", (long)correlate_bucket_ms(corr, i), (long)correlate_bucket_ms(corr, i+1) - 1, corr->lagHist[i]);
+			}
+		}
+	}
+	fprintf(reportFile, "\n");
+	fflush(reportFile);
+}
+
 
 /**********************************
 
@@ -824,6 +1154,1015 @@ Main below
 
 
 
+//MEMORY
+//With ARENA_KB set, everything the recorder needs is taken from one arena mapped
+//at startup (see sleep_arena.h), including the stdio buffers, so memory use is
+//fixed however long it runs.  Without it the same calls go to malloc.  Either
+//way all allocation happens before recording starts.
+static struct Arena arena;
+
+void* recAlloc(size_t size) {
+	if(arena.base != NULL) {
+		return arena_alloc(&arena, size);
+	}
+	return malloc(size);
+}
+
+void recFree(void* p) {
+	if(arena.base == NULL) {
+		free(p);
+	}
+}
+
+//gives a file a fully buffered stdio buffer from the arena, so stdio doesn't
+//malloc one on the first write
+void arenaBuffer(FILE* file) {
+	if(arena.base == NULL || file == NULL) {
+		return;
+	}
+	char* buf = arena_alloc(&arena, BUFSIZ);
+	if(buf != NULL) {
+		setvbuf(file, buf, _IOFBF, BUFSIZ);
+	}
+}
+
+//CHECKPOINTS
+//If the watchdog resets the Pi during the night, the next run picks the recording
+//back up instead of waiting for the user to get into bed again.  The samples
+//themselves are in the journal, so a checkpoint only holds the state that isn't:
+//when the recording started and where the schedule and presence detector were.
+//It is written to a temporary file and renamed over the old one, so a reset
+//while writing leaves the previous checkpoint.
+#define CHECKPOINT_MAGIC 0x534c434bu	//"SLCK"
+
+struct Checkpoint {
+	uint32_t magic;
+	uint32_t crc;		//journal_crc32 of the checkpoint with crc set to 0
+	int64_t startUs;	//startTime of the recording, also identifies it in the journal
+	int64_t savedUs;	//when the checkpoint was written
+	int32_t timeLimit;
+	int32_t presenceState;
+	int64_t intervalUs;
+	int64_t fastTimeUs;
+	uint64_t journalRecords;	//records in the journal when it was written
+};
+
+static uint32_t checkpointCrc(struct Checkpoint cp) {
+	cp.crc = 0;
+	return journal_crc32(0, &cp, sizeof(cp));
+}
+
+//returns 0 on success, -1 if it couldn't be written
+int saveCheckpoint(const char* path, struct Checkpoint* cp) {
+	char tmpPath[strlen(path) + 5];
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+	cp->magic = CHECKPOINT_MAGIC;
+	cp->savedUs = getMicroTime();
+	cp->crc = checkpointCrc(*cp);
+
+	int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		return -1;
+	}
+	if(write(fd, cp, sizeof(*cp)) != sizeof(*cp) || fsync(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return rename(tmpPath, path);
+}
+
+//returns 0 if there is a valid checkpoint at path
+int loadCheckpoint(const char* path, struct Checkpoint* cp) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return -1;
+	}
+	long n = read(fd, cp, sizeof(*cp));
+	close(fd);
+	if(n != sizeof(*cp) || cp->magic != CHECKPOINT_MAGIC || cp->crc != checkpointCrc(*cp)) {
+		return -1;
+	}
+	return 0;
+}
+
+//moves the journal to <path>.1 and starts a new one, see journal_rotate
+void rotateJournal(const char* path, FILE* logFile, const char* programName) {
+	if(journal_rotate(&journal, path) < 0) {
+		char time[30];
+		getTime(time);
+		PRINT_MSG(logFile, time, programName, journal.fd >= 0 ? "Warning: Couldn't rotate the journal, it carries on in the same file\n\n" : "Warning: Couldn't start a new journal, samples are flushed to the data files again\n\n");
+		flushData = journal.fd < 0;
+	}
+}
+
+//rebuilds a recording from the journal when it is resumed: the sample arrays
+//and the stat files get back everything recorded since the recording's START
+struct Replay {
+	int64_t startMs;
+	int active;		//inside the resumed recording
+	int k;
+	int maxSamples;
+	long* ultraData1;
+	long* ultraData2;
+	long* ultraTimes;
+	int prev1;
+	int prev2;
+	FILE* ultraData;
+	FILE* soundData;
+};
+
+void replayRecord(const struct SleepRecord* rec, void* arg) {
+	struct Replay* r = arg;
+
+	if(rec->kind == REC_START) {
+		//a START with the same time can only be the resumed recording
+		r->active = rec->timeMs == r->startMs;
+		r->k = 0;
+		r->prev1 = -1;
+		r->prev2 = -1;
+		return;
+	}
+	if(!r->active) {
+		return;
+	}
+
+	if(rec->kind == REC_ULTRA && r->k < r->maxSamples) {
+		//both sensors are sent for every sample, sensor 2 completes it
+		if(rec->sensor == 1) {
+			r->ultraData1[r->k] = rec->value;
+			r->ultraTimes[r->k] = rec->timeMs - r->startMs;
+		}
+		else if(rec->sensor == 2) {
+			r->ultraData2[r->k] = rec->value;
+			if(r->ultraData != NULL) {
+				PRINT_DATA(r->ultraData, (int)r->ultraData1[r->k]);
+				PRINT_DATA(r->ultraData, (int)r->ultraData2[r->k]);
+			}
+			r->k++;
+		}
+	}
+	else if(rec->kind == REC_SOUND) {
+		int sec = rec->timeMs / 1000;
+		if(r->soundData != NULL) {
+			PRINT_DATA(r->soundData, (int)(sec - r->startMs / 1000));
+		}
+		if(rec->sensor == 1) {
+			r->prev1 = sec;
+		}
+		else {
+			r->prev2 = sec;
+		}
+	}
+}
+
+//SESSIONS
+//A session is one night: from getting into bed until RUN_LENGTH has passed or, in
+//daemon mode, until the user has been out of bed for SESSION_GAP_MIN.  Each one has
+//its own sample buffers and stat and report files.  In daemon mode there are two
+//sessions that take turns, so one night's report is written by the report thread
+//while the next night is being recorded into the other.
+struct Session {
+	long startTime;
+	int k;
+	long fastTimeUs;
+	long* ultraData1;
+	long* ultraData2;
+	long* ultraTimes;
+	int* byMinute;
+	int* topMinutes;
+	int numTop;
+	int timeLimit;
+	FILE* ultraData;
+	FILE* soundData;
+	FILE* reportFile;
+	char* fileBufs[3];	//stdio buffers from the arena, kept across rotations
+	char* soundDataName;	//names are nameLen long, room for the configured name and a stamp
+	size_t nameLen;
+	struct PollStats poll;
+	struct BurstStats burst;
+	int disturbLagS;
+	const char* baselineFile;	//empty if nights aren't compared
+	int chartPoints;	//0 if no charts are drawn
+	long* chartIdx;		//the points LTTB keeps, chartPoints of them
+	long* soundX;		//sound per minute as a series for its chart
+	long* soundY;
+	char* chartBuf;
+	char* chartName;
+	FILE* logFile;
+	const char* programName;
+};
+
+//allocates a session's buffers, returns -1 if they don't fit
+int initSession(struct Session* session, int maxSamples, int timeLimit, int chartPoints, size_t nameLen, FILE* logFile, const char* programName) {
+	memset(session, 0, sizeof(*session));
+	session->nameLen = nameLen;
+	session->soundDataName = recAlloc(nameLen);
+	session->chartName = recAlloc(nameLen);
+	session->timeLimit = timeLimit;
+	session->numTop = timeLimit/6 + 1;
+	session->logFile = logFile;
+	session->programName = programName;
+	session->byMinute = recAlloc(timeLimit * sizeof(int));
+	session->topMinutes = recAlloc(session->numTop * sizeof(int));
+	session->ultraData1 = recAlloc(maxSamples * sizeof(long));
+	session->ultraData2 = recAlloc(maxSamples * sizeof(long));
+	session->ultraTimes = recAlloc(maxSamples * sizeof(long));
+	if(arena.base != NULL) {
+		for(int i = 0; i < 3; i++) {
+			session->fileBufs[i] = arena_alloc(&arena, BUFSIZ);
+		}
+	}
+	if(chartPoints > 0) {
+		session->chartPoints = chartPoints;
+		session->chartIdx = recAlloc(chartPoints * sizeof(long));
+		session->soundX = recAlloc(timeLimit * sizeof(long));
+		session->soundY = recAlloc(timeLimit * sizeof(long));
+		if(arena.base != NULL) {
+			session->chartBuf = arena_alloc(&arena, BUFSIZ);
+		}
+		if(!session->chartIdx || !session->soundX || !session->soundY) {
+			return -1;
+		}
+	}
+	if(!session->soundDataName || !session->chartName || !session->byMinute || !session->topMinutes || !session->ultraData1 || !session->ultraData2 || !session->ultraTimes) {
+		return -1;
+	}
+	return 0;
+}
+
+//the session's file names are the configured ones with a stamp added
+size_t sessionNameLen(const struct Config* cfg) {
+	size_t nameLen = strlen(cfg->soundDataName) > strlen(cfg->reportFileName) ? strlen(cfg->soundDataName) : strlen(cfg->reportFileName);
+	if(strlen(cfg->ultraDataName) > nameLen) {
+		nameLen = strlen(cfg->ultraDataName);
+	}
+	return nameLen + 32;
+}
+
+void freeSession(struct Session* session) {
+	recFree(session->ultraData1);
+	recFree(session->ultraData2);
+	recFree(session->ultraTimes);
+	recFree(session->byMinute);
+	recFree(session->topMinutes);
+	recFree(session->soundDataName);
+	recFree(session->chartName);
+	recFree(session->chartIdx);
+	recFree(session->soundX);
+	recFree(session->soundY);
+}
+
+void closeSessionFiles(struct Session* session) {
+	FILE** files[3] = {&session->ultraData, &session->soundData, &session->reportFile};
+	for(int i = 0; i < 3; i++) {
+		if(*files[i] != NULL) {
+			fclose(*files[i]);
+			*files[i] = NULL;
+		}
+	}
+}
+
+//daemon mode: opens the session's own files, named after the time it started as
+//<configured name>.YYYYMMDD-HHMM.  Only done between nights, never while sampling.
+int rotateSession(struct Session* session, const char* ultraDataName, const char* soundDataName, const char* reportFileName) {
+	char stamp[20];
+	char name[session->nameLen];
+	struct tm tmBuf;
+	time_t start = session->startTime / 1000000;
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M", localtime_r(&start, &tmBuf));
+
+	closeSessionFiles(session);
+	snprintf(name, sizeof(name), "%s.%s", ultraDataName, stamp);
+	session->ultraData = fopen(name, "w");
+	snprintf(session->soundDataName, session->nameLen, "%s.%s", soundDataName, stamp);
+	session->soundData = fopen(session->soundDataName, "w");
+	snprintf(name, sizeof(name), "%s.%s", reportFileName, stamp);
+	session->reportFile = fopen(name, "w");
+	snprintf(session->chartName, session->nameLen, "%s.html", name);
+	if(!session->ultraData || !session->soundData || !session->reportFile) {
+		return -1;
+	}
+
+	FILE* files[3] = {session->ultraData, session->soundData, session->reportFile};
+	for(int i = 0; i < 3; i++) {
+		if(session->fileBufs[i] != NULL) {
+			setvbuf(files[i], session->fileBufs[i], _IOFBF, BUFSIZ);
+		}
+	}
+	return 0;
+}
+
+//draws the night's charts into chartName: distance from each ultrasonic sensor and
+//sound per minute, each cut down to chartPoints points with LTTB
+void writeCharts(struct Session* session) {
+	FILE* chartFile = fopen(session->chartName, "w");
+	if(!chartFile) {
+		char time[30];
+		getTime(time);
+		PRINT_MSG(session->logFile, time, session->programName, "Warning: Couldn't open the chart file\n\n");
+		return;
+	}
+	if(session->chartBuf != NULL) {
+		setvbuf(chartFile, session->chartBuf, _IOFBF, BUFSIZ);
+	}
+
+	char title[80];
+	struct tm tmBuf;
+	time_t start = session->startTime / 1000000;
+	strftime(title, sizeof(title), "Night of %Y-%m-%d %H:%M", localtime_r(&start, &tmBuf));
+	long spanMs = session->k > 0 ? session->ultraTimes[session->k-1] : session->timeLimit * 60000L;
+	chart_begin(chartFile, title);
+
+	long* sensors[2] = {session->ultraData1, session->ultraData2};
+	for(int s = 0; s < 2; s++) {
+		long count = lttb(session->ultraTimes, sensors[s], session->k, session->chartPoints, session->chartIdx);
+		long yMax = 0;
+		for(long i = 0; i < count; i++) {
+			if(sensors[s][session->chartIdx[i]] > yMax) {
+				yMax = sensors[s][session->chartIdx[i]];
+			}
+		}
+		snprintf(title, sizeof(title), "Ultrasonic sensor %d distance", s + 1);
+		chart_series(chartFile, title, "cm", session->ultraTimes, sensors[s], session->chartIdx, count, spanMs, yMax);
+	}
+
+	//only the minutes the night lasted
+	long minutes = spanMs / 60000 + 1;
+	if(minutes > session->timeLimit) {
+		minutes = session->timeLimit;
+	}
+	long yMax = 0;
+	for(long m = 0; m < minutes; m++) {
+		session->soundX[m] = m * 60000;
+		session->soundY[m] = session->byMinute[m];
+		if(session->soundY[m] > yMax) {
+			yMax = session->soundY[m];
+		}
+	}
+	long count = lttb(session->soundX, session->soundY, minutes, session->chartPoints, session->chartIdx);
+	chart_series(chartFile, "Sound per minute", "s/min", session->soundX, session->soundY, session->chartIdx, count, spanMs, yMax);
+
+	chart_end(chartFile);
+	fclose(chartFile);
+}
+
+//analyzes a finished session and writes its report
+//BASELINE
+//Every night's metrics and its distances by clock hour are added to
+//BASELINE_FILE as quantile sketches (sleep_sketch.h).  Once there are
+//BASE_MIN_NIGHTS nights before it, a night's metrics are compared with the
+//band the middle 90% of those nights fell in and anything outside is flagged.
+#define BASE_MIN_NIGHTS 7
+#define BASE_LOW 0.05
+#define BASE_HIGH 0.95
+//shorter recordings (naps, test runs) are compared but not added
+#define BASE_MIN_MINUTES 60
+//the sleeper has settled at the last movement before this many quiet minutes
+#define SETTLE_MIN 15
+
+void nightSketch(const struct Session* session, struct NightSketch* night) {
+	memset(night, 0, sizeof(*night));
+	night->magic = BASELINE_MAGIC;
+	night->version = BASELINE_VERSION;
+	night->startMs = session->startTime / 1000;
+	long endMs = session->k > 0 ? session->ultraTimes[session->k - 1] : 0;
+	night->minutes = endMs / 60000;
+
+	//movements and when the first long quiet stretch started
+	long moves = 0;
+	long lastMove = 0;
+	long settled = -1;
+	for(int j = 1; j < session->k; j++) {
+		if(ultraDiff(session->ultraData1[j], session->ultraData1[j-1]) > MIN_DIFF || ultraDiff(session->ultraData2[j], session->ultraData2[j-1]) > MIN_DIFF) {
+			if(settled < 0 && session->ultraTimes[j] - lastMove >= SETTLE_MIN * 60000L) {
+				settled = lastMove;
+			}
+			lastMove = session->ultraTimes[j];
+			moves++;
+		}
+	}
+	if(settled < 0) {
+		settled = endMs - lastMove >= SETTLE_MIN * 60000L ? lastMove : endMs;
+	}
+	night->metric[BASE_MOVES_PER_HOUR] = moves / (endMs > 60000 ? endMs / 3600000.0 : 1 / 60.0);
+	night->metric[BASE_SETTLE_MINUTES] = settled / 60000.0;
+	int soundMinutes = 0;
+	for(int m = 0; m < session->timeLimit; m++) {
+		soundMinutes += session->byMinute[m] > 0;
+	}
+	night->metric[BASE_SOUND_MINUTES] = soundMinutes;
+
+	time_t start = session->startTime / 1000000;
+	struct tm tm;
+	localtime_r(&start, &tm);
+	long startSecond = tm.tm_hour * 3600L + tm.tm_min * 60 + tm.tm_sec;
+	for(int j = 0; j < session->k; j++) {
+		int hour = (startSecond + session->ultraTimes[j] / 1000) / 3600 % 24;
+		if(session->ultraData1[j] != ULTRA_ERROR) {
+			sketch_add(&night->hours[hour], session->ultraData1[j]);
+		}
+		if(session->ultraData2[j] != ULTRA_ERROR) {
+			sketch_add(&night->hours[hour], session->ultraData2[j]);
+		}
+	}
+}
+
+//" higher than usual" if value is above the band of sketch, and so on
+const char* baselineFlag(const struct Sketch* sketch, double value) {
+	if(value > sketch_quantile(sketch, BASE_HIGH)) {
+		return " - higher than usual";
+	}
+	if(value < sketch_quantile(sketch, BASE_LOW)) {
+		return " - lower than usual";
+	}
+	return "";
+}
+
+//compares the night with the ones before it, then adds it to the baseline
+SLEEP_STAGE void compareBaseline(FILE* reportFile, struct Session* session) {
+	struct NightSketch night;
+	struct Baseline base;
+	char time[30];
+
+	nightSketch(session, &night);
+	struct timespec t0;
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	long nights = baseline_merge(session->baselineFile, 0, night.startMs, &base);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double mergeMs = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+	if(nights < BASE_MIN_NIGHTS) {
+		fprintf(reportFile, "%ld earlier nights, nights are compared once there are %d\n\n", nights < 0 ? 0 : nights, BASE_MIN_NIGHTS);
+	}
+	else {
+		fprintf(reportFile, "Compared with %ld earlier nights (merged in %.2fms), usual is the middle 90%%:\n", nights, mergeMs);
+		for(int m = 0; m < BASE_METRICS; m++) {
+			const struct Sketch* sketch = &base.metric[m];
+			fprintf(reportFile, "%s: %.1f, usually %.1f-%.1f%s\n", baseline_metric_names[m], night.metric[m],
+				sketch_quantile(sketch, BASE_LOW), sketch_quantile(sketch, BASE_HIGH), baselineFlag(sketch, night.metric[m]));
+		}
+		//an hour's typical distance against the spread of that hour's distances
+		for(int h = 0; h < 24; h++) {
+			if(night.hours[h].count < 10 || base.hours[h].count == 0) {
+				continue;
+			}
+			double median = sketch_quantile(&night.hours[h], 0.5);
+			const char* flag = baselineFlag(&base.hours[h], median);
+			if(flag[0] != 0) {
+				fprintf(reportFile, "Distance at %02d:00: median %.0fcm, usually %.0f-%.0fcm%s\n", h, median,
+					sketch_quantile(&base.hours[h], BASE_LOW), sketch_quantile(&base.hours[h], BASE_HIGH), flag);
+			}
+		}
+		fprintf(reportFile, "\n");
+	}
+
+	if(night.minutes >= BASE_MIN_MINUTES && baseline_append(session->baselineFile, &night) < 0) {
+		getTime(time);
+		PRINT_MSG(session->logFile, time, session->programName, "Warning: Couldn't add the night to the baseline file\n\n");
+	}
+}
+
+//the sampler's own numbers for a night: how its bursts went and how well the
+//sound sensors were polled
+void printBurstStats(FILE* file, const struct BurstStats* burst) {
+	if(burst->samples > 0 && burst->size > 1) {
+		fprintf(file, "Ultrasonic bursts of %d pings: %ld of %ld pings had no echo, mean spread %.1fcm, widest %ldcm\n\n",
+			burst->size, burst->failed, 2 * burst->pings, burst->spreadSum / (2.0 * burst->samples), burst->spreadMax);
+	}
+}
+
+void printCoverage(FILE* file, const struct PollStats* poll) {
+	fprintf(file, "Sound sensor coverage: %.2f%% of %ld polls, %ld gaps over %ldms (%ldms in total), longest gap %ldms\n",
+		pollCoverage(poll), poll->polls, poll->holes, poll->boundUs/1000, poll->holeUs/1000, poll->maxGapUs/1000);
+	for(int i = 0; i < POLL_HIST_BUCKETS; i++) {
+		if(poll->hist[i] == 0) {
+			continue;
+		}
+		if(i == 0) {
+			fprintf(file, "Poll gaps under 1ms: %ld\n", poll->hist[i]);
+		}
+		else if(i == POLL_HIST_BUCKETS - 1) {
+			fprintf(file, "Poll gaps %ldms and over: %ld\n", 1L << (i-1), poll->hist[i]);
+		}
+		else {
+			fprintf(file, "Poll gaps %ld-%ldms: %ld\n", 1L << (i-1), 1L << i, poll->hist[i]);
+		}
+	}
+	fprintf(file, "\n");
+}
+
+void writeReport(struct Session* session) {
+	char time[30];
+	FILE* logFile = session->logFile;
+	FILE* reportFile = session->reportFile;
+	const char* programName = session->programName;
+
+	getTime(time);
+	//prints to report file to make a new header for the current day
+	PRINT_MSG(reportFile, time, programName, "THIS DAY'S REPORT:\n________________________________________________\n\n");
+	//the sound file is read back from disk
+  	fflush(session->soundData);
+  
+  	getTime(time);
+  
+    	PRINT_MSG(reportFile, time, programName, "Report on sound data:\n\n");
+  	//analyzing sound data
+  	SLEEP_PROBE1(analysis_start, 1);
+  	long skipped = analyzeSound(session->soundDataName, session->byMinute, session->topMinutes, session->timeLimit);
+  	SLEEP_PROBE2(analysis_end, 1, skipped);
+  	if(skipped > 0) {
+  		getTime(time);
+  		PRINT_MSG(logFile, time, programName, "Warning: Sound data had errors or times outside the recording, they were skipped\n\n");
+  	}
+  
+  	for(int i = 0; i < session->numTop; i++) {
+  		int top = session->topMinutes[i];
+          	PRINT_ANALYSIS(reportFile, "Greatest sound activity at", top%60, (int)(top/60), session->byMinute[top]);
+        }
+  
+  	PRINT_MSG(reportFile, time, programName, "Report on ultrasonic data:\n\n");
+
+  	//analyzing ultrasonic data
+  	SLEEP_PROBE1(analysis_start, 2);
+  	analyzeUltra(reportFile, session->ultraData1, session->ultraData2, session->ultraTimes, session->k);
+  	SLEEP_PROBE2(analysis_end, 2, session->k);
+  	PRINT_ANALYSIS(reportFile, "Ultrasonic samples (fast rate min:sec)", (int)(session->fastTimeUs/60000000), (int)(session->fastTimeUs/1000000%60), session->k);
+  	printBurstStats(reportFile, &session->burst);
+
+  	PRINT_MSG(reportFile, time, programName, "Report on disturbances:\n\n");
+  	SLEEP_PROBE1(analysis_start, 3);
+  	analyzeDisturbances(reportFile, session->soundDataName, session->ultraData1, session->ultraData2, session->ultraTimes, session->k, session->timeLimit, session->disturbLagS);
+  	SLEEP_PROBE2(analysis_end, 3, session->k);
+
+  	if(session->baselineFile[0] != 0) {
+  		PRINT_MSG(reportFile, time, programName, "Report against earlier nights:\n\n");
+  		SLEEP_PROBE1(analysis_start, 4);
+  		compareBaseline(reportFile, session);
+  		SLEEP_PROBE2(analysis_end, 4, session->k);
+  	}
+
+  	//how well the sound sensors were watched, the analyzer process doesn't know
+  	//and leaves it to the sampler's log
+  	if(session->poll.polls > 0) {
+  		printCoverage(reportFile, &session->poll);
+  	}
+  	fflush(reportFile);
+  
+  	if(session->chartPoints > 0) {
+  		long chartStart = getMicroTime();
+  		SLEEP_PROBE1(analysis_start, 5);
+  		writeCharts(session);
+  		SLEEP_PROBE2(analysis_end, 5, session->k);
+  		char msg[150];
+  		snprintf(msg, sizeof(msg), "Charts of %d samples drawn in %.1f ms\n\n", session->k, (getMicroTime() - chartStart) / 1000.0);
+  		getTime(time);
+  		PRINT_MSG(logFile, time, programName, msg);
+  	}
+
+  	//logging that a report was made
+  	getTime(time);
+	PRINT_MSG(logFile, time, programName, "Report made on data\n\n");
+}
+
+//the report thread waits for finished sessions and writes their reports
+static pthread_mutex_t reportLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reportCond = PTHREAD_COND_INITIALIZER;
+static struct Session* reportQueued;
+static int reportBusy = 0;
+static int reportStop = 0;
+
+void* reportThread(void* arg) {
+	(void)arg;
+	pthread_mutex_lock(&reportLock);
+	while(1) {
+		while(reportQueued == NULL && !reportStop) {
+			pthread_cond_wait(&reportCond, &reportLock);
+		}
+		if(reportQueued == NULL) {
+			break;
+		}
+		struct Session* session = reportQueued;
+		reportQueued = NULL;
+		pthread_mutex_unlock(&reportLock);
+
+		writeReport(session);
+
+		pthread_mutex_lock(&reportLock);
+		reportBusy = 0;
+		pthread_cond_broadcast(&reportCond);
+	}
+	pthread_mutex_unlock(&reportLock);
+	return NULL;
+}
+
+//hands a session to the report thread, once it is done with the last one
+void queueReport(struct Session* session) {
+	pthread_mutex_lock(&reportLock);
+	while(reportBusy) {
+		pthread_cond_wait(&reportCond, &reportLock);
+	}
+	reportQueued = session;
+	reportBusy = 1;
+	pthread_cond_broadcast(&reportCond);
+	pthread_mutex_unlock(&reportLock);
+}
+
+//waits until the report thread has nothing left to do
+void waitReports(void) {
+	pthread_mutex_lock(&reportLock);
+	while(reportBusy) {
+		pthread_cond_wait(&reportCond, &reportLock);
+	}
+	pthread_mutex_unlock(&reportLock);
+}
+
+//SIGTERM or SIGINT ends the night being recorded and stops the daemon
+static volatile sig_atomic_t stopDaemon = 0;
+
+void onStopSignal(int sig) {
+	(void)sig;
+	stopDaemon = 1;
+}
+
+//the config is read again on SIGHUP or when the file is saved, see checkReload
+static volatile sig_atomic_t reloadRequested = 0;
+static volatile long reloadSignalUs = 0;
+
+void onReloadSignal(int sig) {
+	(void)sig;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	reloadSignalUs = ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+	reloadRequested = 1;
+}
+
+//editors save by writing the file or by renaming a new one over it, so the
+//directory is watched rather than the file, which a rename would replace
+struct ConfigWatch {
+	const char* path;
+	const char* name;	//the file's name in its directory
+	int fd;
+	long checkedUs;		//when the watch was last read
+};
+
+void initConfigWatch(struct ConfigWatch* watch, const char* path) {
+	const char* slash = strrchr(path, '/');
+	char dir[slash != NULL ? slash - path + 2 : 2];
+	if(slash != NULL) {
+		memcpy(dir, path, slash - path + 1);
+		dir[slash - path + 1] = 0;
+	}
+	else {
+		strcpy(dir, ".");
+	}
+	watch->path = path;
+	watch->name = slash != NULL ? slash + 1 : path;
+	watch->checkedUs = 0;
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(watch->fd >= 0 && inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(watch->fd);
+		watch->fd = -1;
+	}
+}
+
+//returns 1 if the config should be read again, and when it was changed.  The
+//watch is read at most every CONFIG_CHECK_MS, so the sampling loop can call
+//this on every pass
+#define CONFIG_CHECK_MS 100
+int checkReload(struct ConfigWatch* watch, long* changedUs) {
+	int changed = 0;
+	if(reloadRequested) {
+		reloadRequested = 0;
+		*changedUs = reloadSignalUs;
+		changed = 1;
+	}
+	long nowUs = getMicroTime();
+	if(watch->fd < 0 || nowUs - watch->checkedUs < CONFIG_CHECK_MS * 1000L) {
+		return changed;
+	}
+	watch->checkedUs = nowUs;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	int saved = 0;
+	while((len = read(watch->fd, buf, sizeof(buf))) > 0) {
+		for(char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+			struct inotify_event* ev = (struct inotify_event*)p;
+			if(ev->len > 0 && !strcmp(ev->name, watch->name)) {
+				saved = 1;
+			}
+		}
+	}
+	if(saved) {
+		struct stat st;
+		if(!changed) {
+			*changedUs = stat(watch->path, &st) == 0 ? st.st_mtim.tv_sec * 1000000L + st.st_mtim.tv_nsec / 1000 : nowUs;
+		}
+		changed = 1;
+	}
+	return changed;
+}
+
+struct ReloadLog {
+	int liveChanged;
+	char live[300];
+	char restart[300];
+};
+
+void noteConfigChange(const char* key, int live, void* arg) {
+	struct ReloadLog* log = arg;
+	log->liveChanged += live;
+	char* list = live ? log->live : log->restart;
+	size_t used = strlen(list);
+	snprintf(list + used, sizeof(log->live) - used, "%s%s", used > 0 ? ", " : "", key);
+}
+
+//reads the config again and copies the keys that can change while recording
+//into cfg, logging what changed.  The sample buffers only have room for a night
+//at fastestMs, so ULTRA_FAST_MS can't go below it without a restart.  This
+//runs while recording, so the file is read into scratch storage on the stack
+//rather than with config_load, which allocates.
+//returns how many live keys changed
+int reloadConfig(struct Config* cfg, const char* path, long changedUs, int fastestMs, FILE* logFile, const char* programName) {
+	struct ConfigScratch scratch;
+	struct Config* next = &scratch.cfg;
+	char errors[1024];
+	char msg[1500];
+	char time[30];
+	struct ReloadLog log;
+	log.liveChanged = 0;
+	log.live[0] = 0;
+	log.restart[0] = 0;
+
+	int problems = config_reload(&scratch, path, errors, sizeof(errors));
+	getTime(time);
+	if(problems < 0) {
+		PRINT_MSG(logFile, time, programName, "Warning: The config file could not be read again, nothing was changed\n\n");
+		return 0;
+	}
+	if(problems > 0) {
+		snprintf(msg, sizeof(msg), "Warning: The reloaded config file has %d problems:\n%s\n", problems, errors);
+		PRINT_MSG(logFile, time, programName, msg);
+	}
+	if(next->ultraFastMs < fastestMs) {
+		snprintf(msg, sizeof(msg), "Warning: ULTRA_FAST_MS below %d only takes effect on a restart, using %d\n\n", fastestMs, fastestMs);
+		PRINT_MSG(logFile, time, programName, msg);
+		next->ultraFastMs = fastestMs;
+		next->ultraSlowMs = next->ultraSlowMs < fastestMs ? fastestMs : next->ultraSlowMs;
+	}
+	config_apply_live(cfg, next, noteConfigChange, &log);
+
+	snprintf(msg, sizeof(msg), "Config reloaded %ld ms after it changed, now using: %s\n\n", (getMicroTime() - changedUs) / 1000, log.live[0] != 0 ? log.live : "(nothing changed)");
+	PRINT_MSG(logFile, time, programName, msg);
+	if(log.restart[0] != 0) {
+		snprintf(msg, sizeof(msg), "Warning: These keys changed but only take effect on a restart: %s\n\n", log.restart);
+		PRINT_MSG(logFile, time, programName, msg);
+	}
+	return log.liveChanged;
+}
+
+//the reloaded values that something already running holds a copy of
+void applyLiveConfig(const struct Config* cfg, struct UltraSchedule* sched, struct Burst* burst, struct PresenceDetector* presence, struct Session* session) {
+	//the interval is only moved when a rate changed, otherwise one part way
+	//through decaying to the slow rate would jump straight to it
+	if(sched != NULL && (sched->fastUs != cfg->ultraFastMs * 1000L || sched->slowUs != cfg->ultraSlowMs * 1000L)) {
+		int fast = sched->intervalUs == sched->fastUs;
+		sched->fastUs = cfg->ultraFastMs * 1000L;
+		sched->slowUs = cfg->ultraSlowMs * 1000L;
+		sched->intervalUs = fast ? sched->fastUs : sched->slowUs;
+	}
+	if(burst != NULL) {
+		burst->size = cfg->ultraBurst;
+		burst->gapUs = cfg->ultraBurstGapMs * 1000L;
+		burst->stats.size = cfg->ultraBurst;
+	}
+	int state = presence->state;
+	int count = presence->count;
+	initPresence(presence, cfg->presenceCm, cfg->presenceHystCm, cfg->presenceTicks);
+	presence->state = state;
+	presence->count = count;
+	journal.syncMs = cfg->journalSyncMs;
+	journal.syncRecords = cfg->journalSyncRecords;
+	session->poll.boundUs = cfg->pollGapMs * 1000L;
+	session->disturbLagS = cfg->disturbLagS;
+}
+
+//ANALYZER
+//With RING_FILE set the recorder only samples, and `sleep_record <config> --analyzer`
+//runs as a second process that reads the records back out of the ring, writes the
+//stat files from them and makes each night's report when the night's END comes
+//through.  The sampler keeps the GPIO, the watchdog, the journal and the collector,
+//so a crash or stall in here can't hold sampling up or reboot the Pi.  A night's
+//records are only released once its report is written, so an analyzer that is
+//restarted goes back to the START of the night it was in and builds it again.
+#define ANALYZER_IDLE_MS 100	//sleep between looks at an empty ring
+
+struct Analyzer {
+	const struct Config* cfg;
+	struct Session* session;
+	struct Replay replay;	//turns the records into the session's samples and stat files
+	int active;		//inside a night
+	long rateMs;		//the sampling interval, for the time spent at the fast rate
+	long fastMs;		//the sampler's fast interval, which a reload can change
+	FILE* logFile;
+	const char* programName;
+};
+
+//opens the night's stat and report files, the way the sampler would have
+int openNightFiles(struct Analyzer* an) {
+	const struct Config* cfg = an->cfg;
+	struct Session* session = an->session;
+	if(cfg->daemonMode) {
+		return rotateSession(session, cfg->ultraDataName, cfg->soundDataName, cfg->reportFileName);
+	}
+	closeSessionFiles(session);
+	session->ultraData = fopen(cfg->ultraDataName, "w");
+	session->soundData = fopen(cfg->soundDataName, "w");
+	session->reportFile = fopen(cfg->reportFileName, "w");
+	snprintf(session->soundDataName, session->nameLen, "%s", cfg->soundDataName);
+	snprintf(session->chartName, session->nameLen, "%s.html", cfg->reportFileName);
+	if(!session->ultraData || !session->soundData || !session->reportFile) {
+		return -1;
+	}
+	FILE* files[3] = {session->ultraData, session->soundData, session->reportFile};
+	for(int i = 0; i < 3; i++) {
+		if(session->fileBufs[i] != NULL) {
+			setvbuf(files[i], session->fileBufs[i], _IOFBF, BUFSIZ);
+		}
+	}
+	return 0;
+}
+
+void startNight(struct Analyzer* an, const struct SleepRecord* rec) {
+	struct Session* session = an->session;
+	char time[30];
+	session->startTime = rec->timeMs * 1000;
+	session->fastTimeUs = 0;
+	memset(&session->poll, 0, sizeof(session->poll));
+	memset(&session->burst, 0, sizeof(session->burst));
+	if(openNightFiles(an) < 0) {
+		getTime(time);
+		PRINT_MSG(an->logFile, time, an->programName, "Error: Couldn't open the files for the night, skipping it\n\n");
+		closeSessionFiles(session);
+		return;
+	}
+	an->replay.startMs = rec->timeMs;
+	an->replay.ultraData = session->ultraData;
+	an->replay.soundData = session->soundData;
+	an->rateMs = an->cfg->ultraSlowMs;
+	an->fastMs = an->cfg->ultraFastMs;
+	an->active = 1;
+	getTime(time);
+	PRINT_MSG(an->logFile, time, an->programName, "A night has started\n\n");
+}
+
+void finishNight(struct Analyzer* an) {
+	struct Session* session = an->session;
+	session->k = an->replay.k;
+	writeReport(session);
+	closeSessionFiles(session);
+	an->active = 0;
+	an->replay.active = 0;
+}
+
+//one record from the ring, in the order the sampler sent them
+void analyzeRecord(struct Analyzer* an, const struct SleepRecord* rec) {
+	if(rec->kind == REC_START) {
+		startNight(an, rec);
+	}
+	if(!an->active) {
+		return;
+	}
+	//the sampler counts fast rate time per sample, at the interval the sample came in at
+	if(rec->kind == REC_ULTRA && rec->sensor == 2 && an->replay.k > 0 && an->rateMs == an->fastMs) {
+		an->session->fastTimeUs += an->rateMs * 1000L;
+	}
+	else if(rec->kind == REC_RATE) {
+		an->rateMs = rec->value;
+	}
+	else if(rec->kind == REC_FAST) {
+		an->fastMs = rec->value;
+	}
+	//back in bed, the sampler starts again from the slow rate
+	else if(rec->kind == REC_PRESENCE && rec->value == PRESENCE_IN_BED) {
+		an->rateMs = an->cfg->ultraSlowMs;
+	}
+	replayRecord(rec, &an->replay);
+}
+
+int runAnalyzer(const struct Config* cfg, const char* programName) {
+	char logName[strlen(cfg->logFileName) + 10];
+	snprintf(logName, sizeof(logName), "%s.analyzer", cfg->logFileName);
+	FILE* logFile = fopen(logName, "a");
+	if(logFile == NULL) {
+		perror("The analyzer log could not be opened");
+		return -1;
+	}
+	char time[30];
+	getTime(time);
+	signal(SIGTERM, onStopSignal);
+	signal(SIGINT, onStopSignal);
+
+	//only the sampler makes the ring, the analyzer waits for it
+	int opened = cfg->ringFile[0] == 0 ? -1 : ring_open(&ring, cfg->ringFile, cfg->ringRecords, 0);
+	if(opened > 0) {
+		PRINT_MSG(logFile, time, programName, "Waiting for the sampler to set up the ring\n\n");
+	}
+	while(opened > 0 && !stopDaemon) {
+		usleep(ANALYZER_IDLE_MS * 1000);
+		opened = ring_open(&ring, cfg->ringFile, cfg->ringRecords, 0);
+	}
+	getTime(time);
+	if(opened != 0) {
+		PRINT_MSG(logFile, time, programName, opened < 0 ? "Error: Couldn't open the ring, RING_FILE has to be set for the analyzer\n\n" : "Stopped before the ring was set up\n\n");
+		fclose(logFile);
+		return -1;
+	}
+
+	int maxSamples = (int)((cfg->timeLimit * 60L * 1000) / cfg->ultraFastMs) + 1;
+	struct Session session;
+	if(initSession(&session, maxSamples, cfg->timeLimit, cfg->chartPoints, sessionNameLen(cfg), logFile, programName) < 0) {
+		PRINT_MSG(logFile, time, programName, "Error: Couldn't allocate sample buffers\n\n");
+		return -1;
+	}
+	session.disturbLagS = cfg->disturbLagS;
+	session.baselineFile = cfg->baselineFile;
+
+	struct Analyzer an;
+	memset(&an, 0, sizeof(an));
+	an.cfg = cfg;
+	an.session = &session;
+	an.replay.maxSamples = maxSamples;
+	an.replay.ultraData1 = session.ultraData1;
+	an.replay.ultraData2 = session.ultraData2;
+	an.replay.ultraTimes = session.ultraTimes;
+	an.logFile = logFile;
+	an.programName = programName;
+
+	//everything from tail on is either new or the night a last analyzer didn't finish
+	uint32_t pos = ring_tail(&ring);
+	char msg[150];
+	snprintf(msg, sizeof(msg), "Analyzing the ring, %u records are waiting\n\n", ring_head(&ring) - pos);
+	PRINT_MSG(logFile, time, programName, msg);
+
+	int nights = 0;
+	while(!stopDaemon && (cfg->daemonMode || nights == 0)) {
+		uint32_t head = ring_head(&ring);
+		if(pos == head) {
+			//a night that fills the ring can't get its END in, so it ends with what it has
+			if(an.active && head - ring_tail(&ring) > ring.mask) {
+				snprintf(msg, sizeof(msg), "Warning: The night filled the ring, its report stops after %d samples\n\n", an.replay.k);
+				getTime(time);
+				PRINT_MSG(logFile, time, programName, msg);
+				finishNight(&an);
+				ring_release(&ring, pos);
+				nights++;
+				continue;
+			}
+			usleep(ANALYZER_IDLE_MS * 1000);
+			continue;
+		}
+		for(; pos != head && (cfg->daemonMode || nights == 0); pos++) {
+			const struct SleepRecord* rec = ring_at(&ring, pos);
+			//a resumed sampler sends its night's START again, the night carries on
+			if(an.active && rec->kind == REC_START && rec->timeMs == an.replay.startMs) {
+				continue;
+			}
+			//a START without an END before it is a sampler that was restarted
+			if(an.active && rec->kind == REC_START) {
+				finishNight(&an);
+				ring_release(&ring, pos);
+				nights++;
+				if(!cfg->daemonMode) {
+					break;
+				}
+			}
+			analyzeRecord(&an, rec);
+			if(an.active && rec->kind == REC_END) {
+				finishNight(&an);
+				ring_release(&ring, pos + 1);
+				nights++;
+			}
+		}
+		//records from outside a night aren't needed again
+		if(!an.active) {
+			ring_release(&ring, pos);
+		}
+	}
+
+	//a night left part way is picked up again by the next analyzer
+	getTime(time);
+	snprintf(msg, sizeof(msg), "Analyzer stopped after %d nights%s\n\n", nights, an.active ? ", the night in progress is left in the ring" : "");
+	PRINT_MSG(logFile, time, programName, msg);
+	closeSessionFiles(&session);
+	freeSession(&session);
+	ring_close(&ring);
+	fclose(logFile);
+	return 0;
+}
+
 int main(const int argc, const char* const argv[]) {
 	//Create a string that contains the program name
 	const char* argName = argv[0];
@@ -850,77 +2189,290 @@ int main(const int argc, const char* const argv[]) {
 		i++;
 	} 	
 
-	//Create a file pointer named configFile
-	FILE* configFile;
-	//Set configFile to point to the Lab4Sample.cfg file. It is
-	//set to read the file.
-	configFile = fopen("/home/pi/sleep_config.cfg", "r");
+	//the config file is sleep_config.cfg, or the file given on the command line
+	const char* configPath = argc > 1 ? argv[1] : "/home/pi/sleep_config.cfg";
+	struct Config cfg;
+	char configErrors[2048];
+	int configProblems = config_load(&cfg, configPath, configErrors, sizeof(configErrors));
 
 	//Output a warning message if the file cannot be openned
-	if(!configFile)
+	if(configProblems < 0)
 	{
 		perror("The config file could not be opened");
 		return -1;
 	}
+	pinLayout = cfg.pinLayout;
+  	int simulated = !strcmp(cfg.gpioBackend, "sim");
 
+	//the memory budget is claimed before anything else is set up
+	if(cfg.arenaKb > 0 && arena_init(&arena, cfg.arenaKb * 1024L) < 0) {
+		printf("Couldn't reserve the %d KB arena\n", cfg.arenaKb);
+		return -1;
+	}
 
-
-	/*
-
-		what is read from config file
-
-		file includes: name of log file, name of stats file, how long user wants to record (?), etc.
-		
-
-		if file does not have these, use defaults of some sort
-			(file with default name)
-
-	*/
-  
-  	//values that are to be read from the config file
-	int timeout;
-	char logFileName[50];
-  	char ultraDataName[50];
-  	char soundDataName[50];
-	char reportFileName[50];
-	int timeLimit;
-	
-	readConfig(configFile, &timeout, logFileName, ultraDataName, soundDataName, reportFileName, &timeLimit);
+	//the analyzer half of a RING_FILE setup, see runAnalyzer
+	if(argc > 2 && !strcmp(argv[2], "--analyzer")) {
+		int result = runAnalyzer(&cfg, programName);
+		config_free(&cfg);
+		return result;
+	}
+	//the sampling half, the stat files and reports are left to the analyzer
+	int ringFailed = cfg.ringFile[0] != 0 && ring_open(&ring, cfg.ringFile, cfg.ringRecords, 1) < 0;
+
+	//a checkpoint from a recording that hasn't run its full length yet means the
+	//last run was reset part way through, so it is resumed
+	struct Checkpoint checkpoint;
+	int resuming = 0;
+	int staleCheckpoint = 0;
+	if(cfg.checkpointFile[0] != 0 && cfg.journalFile[0] != 0 && loadCheckpoint(cfg.checkpointFile, &checkpoint) == 0) {
+		if(checkpoint.timeLimit == cfg.timeLimit && getMicroTime() < checkpoint.startUs + cfg.timeLimit * 60000000L) {
+			resuming = 1;
+		}
+		else {
+			staleCheckpoint = 1;
+		}
+	}
 
 	//Create a new file pointer to point to the log file
 	FILE* logFile;
 	//Set it to point to the file from the config file and make it append to the file when it writes to it.
-	logFile = fopen(logFileName, "w");
+	//a resumed recording carries on the log of the run that was cut off
+	logFile = fopen(cfg.logFileName, resuming ? "a" : "w");
 	
+	//in daemon mode every night gets its own stat and report files, they are
+	//opened when the night starts (see rotateSession)
   	//Create a new file pointer to point to the ultrasonic data record file
-	FILE* ultraData;
-	ultraData = fopen(ultraDataName, "w");
+	FILE* ultraData = NULL;
   	//Create a new file pointer to point to the sound data record file
-	FILE* soundData;
-	soundData = fopen(soundDataName, "w");
-  
+	FILE* soundData = NULL;
  	 //Create a new file pointer to point to the report file
-	FILE* reportFile;
-	reportFile = fopen(reportFileName, "w");
-  
-  	//close after reading what you need
-	fclose(configFile);
+	FILE* reportFile = NULL;
+	if(!cfg.daemonMode && ring.hdr == NULL) {
+		ultraData = fopen(cfg.ultraDataName, "w");
+		soundData = fopen(cfg.soundDataName, "w");
+		reportFile = fopen(cfg.reportFileName, "w");
+	}
+
+	//Create a new file pointer to point to the event file (sampling rate changes)
+	FILE* eventFile;
+	eventFile = fopen(cfg.eventFileName, resuming ? "a" : "w");
+
+	arenaBuffer(logFile);
+	arenaBuffer(eventFile);
   
   	char time[30];
 
 	getTime(time);
   	//logs that files have been opened
   	PRINT_MSG(logFile, time, programName, "Files have been opened\n\n");
+	//a bad line in the config falls back to the default, but is logged
+	if(configProblems > 0) {
+		char msg[sizeof(configErrors) + 100];
+		snprintf(msg, sizeof(msg), "Warning: The config file has %d problems:\n%s\n", configProblems, configErrors);
+		PRINT_MSG(logFile, time, programName, msg);
+	}
+	if(ringFailed) {
+		PRINT_MSG(logFile, time, programName, "Warning: Couldn't open the ring file, the analysis is done in this process\n\n");
+	}
+
+	//pins from the config file are checked once here, not on every pulse
+	if(!pinLayoutValid(&pinLayout)) {
+		PRINT_MSG(logFile, time, programName, "Error: The config file has pins outside 2-27\n\n");
+		return -1;
+	}
+	genericPins = !pinLayoutIsDefault(&pinLayout);
+	if(genericPins) {
+		PRINT_MSG(logFile, time, programName, "Pins differ from the pin map, using the generic sampling functions\n\n");
+	}
 
 	getTime(time);
   	//logs that GPIO pins are ready
-	GPIO_Handle gpio = initializeGPIO(logFile, programName);
+  	//the cdev backend has no register handle, the pins are requested from the chip
+	GPIO_Handle gpio = NULL;
+	if(!strcmp(cfg.gpioBackend, "cdev")) {
+		int inPins[2 * MAX_PIN_SENSORS];
+		int numIn = 0;
+		for(int i = 0; i < pinLayout.numUltra; i++) {
+			inPins[numIn++] = pinLayout.echo[i];
+		}
+		for(int i = 0; i < pinLayout.numSound; i++) {
+			inPins[numIn++] = pinLayout.sound[i];
+			edgeState.soundMask |= 1u << pinLayout.sound[i];
+		}
+		edgeState.events = gpiolib_init_events(cfg.gpioChip, pinLayout.trig, pinLayout.numUltra, inPins, numIn);
+		if(edgeState.events == NULL || gpiolib_events_levels(edgeState.events, &edgeState.levels) < 0) {
+			PRINT_MSG(logFile, time, programName, "Error: Could not request the pins from the gpio chip\n\n");
+			return -1;
+		}
+	}
+	else {
+		gpio = initializeGPIO(logFile, programName, cfg.gpioBackend);
+	}
 	PRINT_MSG(logFile, time, programName, "The GPIO pins have been initialized\n\n");
+	//simulated sensors: someone 40cm from each ultrasonic, sound now and then
+	if(simulated) {
+		for(int i = 0; i < pinLayout.numUltra; i++) {
+			gpiolib_sim_ultra(gpio, pinLayout.trig[i], pinLayout.echo[i], 40 + 5*i);
+		}
+		for(int i = 0; i < pinLayout.numSound; i++) {
+			gpiolib_sim_sound(gpio, pinLayout.sound[i], 6 / (i+1));
+		}
+	}
+
+  	//ultrasonic sampling is adaptive, so there is room for every sample at the fast rate
+  	//unless the arena is too small for that, then it holds as many as fit.  Each
+  	//session also needs a count per minute and the top minutes for the sound analysis.
+  	int numSessions = cfg.daemonMode ? 2 : 1;
+  	int maxSamples = (int)((cfg.timeLimit * 60L * 1000) / cfg.ultraFastMs) + 1;
+  	int sizedFastMs = cfg.ultraFastMs;
+  	size_t sampleSize = 3 * sizeof(long);
+  	size_t nameLen = sessionNameLen(&cfg);
+  	size_t sessionFixed = (cfg.timeLimit + cfg.timeLimit/6 + 1) * sizeof(int) + 3 * BUFSIZ + 2 * nameLen + 10 * ARENA_ALIGN;
+  	if(cfg.chartPoints > 0) {
+  		sessionFixed += (cfg.chartPoints + 2L * cfg.timeLimit) * sizeof(long) + BUFSIZ + 4 * ARENA_ALIGN;
+  	}
+  	if(arena.base != NULL && numSessions * ((size_t)maxSamples * sampleSize + sessionFixed) > arena_left(&arena)) {
+  		size_t left = arena_left(&arena) / numSessions;
+  		maxSamples = left > sessionFixed ? (left - sessionFixed) / sampleSize : 0;
+  		char msg[150];
+  		snprintf(msg, sizeof(msg), "Warning: The arena only has room for %d ultrasonic samples a night\n\n", maxSamples);
+  		getTime(time);
+  		PRINT_MSG(logFile, time, programName, msg);
+  	}
+  	struct Session sessions[2];
+  	for(int i = 0; i < numSessions; i++) {
+	        if(maxSamples == 0 || initSession(&sessions[i], maxSamples, cfg.timeLimit, cfg.chartPoints, nameLen, logFile, programName) < 0) {
+	          	getTime(time);
+			PRINT_MSG(logFile, time, programName, "Error: Couldn't allocate sample buffers\n\n");
+			return -1;
+	        }
+	        sessions[i].disturbLagS = cfg.disturbLagS;
+	        sessions[i].baselineFile = cfg.baselineFile;
+	}
+	//a night stays in the ring until its report is written, so the ring has to hold
+	//a night of samples at the fast rate and a sound every second
+	long nightRecords = 2 * ((cfg.timeLimit * 60L * 1000) / sizedFastMs + 1) + 2L * cfg.timeLimit * 60;
+	if(ring.hdr != NULL && ring.mask + 1 < nightRecords) {
+		char msg[250];
+		snprintf(msg, sizeof(msg), "Error: The ring holds %u records, a busy night can be %ld.  Set RING_RECORDS to at least that and remove the old RING_FILE\n\n", ring.mask + 1, nightRecords);
+		getTime(time);
+		PRINT_MSG(logFile, time, programName, msg);
+		ring_close(&ring);
+		return -1;
+	}
+	if(!cfg.daemonMode) {
+		sessions[0].ultraData = ultraData;
+		sessions[0].soundData = soundData;
+		sessions[0].reportFile = reportFile;
+		snprintf(sessions[0].soundDataName, nameLen, "%s", cfg.soundDataName);
+		snprintf(sessions[0].chartName, nameLen, "%s.html", cfg.reportFileName);
+		FILE* files[3] = {ultraData, soundData, reportFile};
+		for(int i = 0; i < 3; i++) {
+			if(files[i] != NULL && sessions[0].fileBufs[i] != NULL) {
+				setvbuf(files[i], sessions[0].fileBufs[i], _IOFBF, BUFSIZ);
+			}
+		}
+	}
+	//a resumed night in daemon mode goes back into the files it was using
+	else if(resuming && ring.hdr == NULL) {
+		sessions[0].startTime = checkpoint.startUs;
+		if(rotateSession(&sessions[0], cfg.ultraDataName, cfg.soundDataName, cfg.reportFileName) < 0) {
+			getTime(time);
+			PRINT_MSG(logFile, time, programName, "Error: Couldn't open the files for the night\n\n");
+			return -1;
+		}
+	}
+
+	//opens the journal if one is configured, anything left from a run that was
+	//cut off (by the watchdog or a power cut) is checked and kept.  When resuming,
+	//the recording's samples are read back out of it as it is checked.
+	struct Replay replay;
+	memset(&replay, 0, sizeof(replay));
+	if(resuming) {
+		replay.startMs = checkpoint.startUs / 1000;
+		replay.maxSamples = maxSamples;
+		replay.ultraData1 = sessions[0].ultraData1;
+		replay.ultraData2 = sessions[0].ultraData2;
+		replay.ultraTimes = sessions[0].ultraTimes;
+		replay.prev1 = -1;
+		replay.prev2 = -1;
+		replay.ultraData = sessions[0].ultraData;
+		replay.soundData = sessions[0].soundData;
+	}
+	if(cfg.journalFile[0] != 0) {
+		struct JournalRecovery recovery;
+		getTime(time);
+		if(journal_open(&journal, cfg.journalFile, cfg.journalSyncMs, cfg.journalSyncRecords, resuming ? replayRecord : NULL, &replay, &recovery) < 0) {
+			PRINT_MSG(logFile, time, programName, "Warning: Couldn't open the journal, samples are only flushed to the data files\n\n");
+			resuming = 0;
+		}
+		else {
+			char msg[200];
+			if(recovery.records > 0) {
+				time_t last = recovery.lastTimeMs / 1000;
+				char lastTime[30];
+				strftime(lastTime, sizeof(lastTime), "%m-%d-%Y %H:%M:%S", localtime(&last));
+				snprintf(msg, sizeof(msg), "Journal has %llu samples from earlier recordings, the last at %s\n\n", (unsigned long long)recovery.records, lastTime);
+				PRINT_MSG(logFile, time, programName, msg);
+			}
+			if(recovery.droppedBytes > 0) {
+				snprintf(msg, sizeof(msg), "Warning: The last recording was cut off, %ld bytes of unsynced journal were dropped\n\n", recovery.droppedBytes);
+				PRINT_MSG(logFile, time, programName, msg);
+			}
+			flushData = 0;
+			//a night that won't be resumed is moved aside, so the journal only
+			//ever holds the night a resume has to read back
+			if(!resuming && recovery.records > 0) {
+				rotateJournal(cfg.journalFile, logFile, programName);
+			}
+		}
+	}
+
+	//live readings for sleep_top and anything else that wants them
+	if(cfg.liveShm[0] != 0) {
+		getTime(time);
+		if(live_create(&live, cfg.liveShm) < 0) {
+			PRINT_MSG(logFile, time, programName, "Warning: Couldn't create the live shared memory segment\n\n");
+		}
+		else {
+			live.cur.dist[0] = ULTRA_ERROR;
+			live.cur.dist[1] = ULTRA_ERROR;
+			live.cur.intervalMs = cfg.ultraSlowMs;
+			live.cur.timeMs = getMicroTime() / 1000;
+			live_publish(&live);
+		}
+	}
+
+	//the activity bitmaps live in one file that every night is added to
+	if(cfg.bitmapFile[0] != 0 && bitmap_open(&bitmap, cfg.bitmapFile) < 0) {
+		getTime(time);
+		PRINT_MSG(logFile, time, programName, "Warning: Couldn't open the bitmap file, no activity bitmaps will be kept\n\n");
+	}
+
+	//connects to the collector if one is configured
+	struct CollectClient collector;
+	collector.fd = -1;
+	collector.dropped = 0;
+	if(cfg.collectorSocket[0] != 0 || cfg.collectorPort != 0) {
+		int ok = cfg.collectorSocket[0] != 0 ? collect_open_unix(&collector, cfg.collectorSocket, cfg.deviceId) : collect_open_tcp(&collector, cfg.collectorPort, cfg.deviceId);
+		getTime(time);
+		if(ok < 0) {
+			PRINT_MSG(logFile, time, programName, "Warning: Couldn't connect to the collector, recording locally only\n\n");
+		}
+		else {
+			PRINT_MSG(logFile, time, programName, "Connected to the collector\n\n");
+		}
+	}
 
 	getTime(time);
-  	//initializes ultrasonic pins
-	setToOutput(gpio,ULTRA1_TRIG);
-	setToOutput(gpio,ULTRA2_TRIG);
+  	//initializes ultrasonic pins, the cdev backend requested them as outputs already
+	if(gpio != NULL) {
+		uint32_t trigMask = 0;
+		for(int i = 0; i < pinLayout.numUltra; i++) {
+			trigMask |= 1u << pinLayout.trig[i];
+		}
+		setToOutput(gpio, trigMask);
+	}
   	//logs that pins for the ultrasonic sensors have been set
 	PRINT_MSG(logFile, time, programName, "The ultrasonic pins have been initialized\n\n");
 
@@ -937,7 +2489,8 @@ int main(const int argc, const char* const argv[]) {
 	//We use the open function here to open the /dev/watchdog file. If it does
 	//not open, then we output an error message. We do not use fopen() because we
 	//do not want to create a file if it doesn't exist
-	if ((watchdog = open("/dev/watchdog", O_RDWR | O_NOCTTY)) < 0) {
+	//simulated runs can do without it, so they work on any machine
+	if ((watchdog = open("/dev/watchdog", O_RDWR | O_NOCTTY)) < 0 && !simulated) {
           	getTime(time);
 		PRINT_MSG(logFile, time, programName, "Error: Couldn't open watchdog device! \n");
 		return -1;
@@ -951,30 +2504,177 @@ int main(const int argc, const char* const argv[]) {
 	//so please make a note of that when creating your own programs.
 	//If we try to set it to any value greater than 15, then it will reject that
 	//value and continue to use the previously set time limit
-	ioctl(watchdog, WDIOC_SETTIMEOUT, &timeout);
+	ioctl(watchdog, WDIOC_SETTIMEOUT, &cfg.timeout);
 	
 	//Log that the Watchdog time limit has been set
 	getTime(time);
 	PRINT_MSG(logFile, time, programName, "The Watchdog time limit has been set\n\n");
 
-	//The value of timeout will be changed to whatever the current time limit of the
+	//The value of cfg.timeout will be changed to whatever the current time limit of the
 	//watchdog timer is
-	ioctl(watchdog, WDIOC_GETTIMEOUT, &timeout);
+	ioctl(watchdog, WDIOC_GETTIMEOUT, &cfg.timeout);
 	//This print statement will confirm to us if the time limit has been properly
 	//changed. The \n will create a newline character similar to what endl does.
-	printf("The watchdog timeout is %d seconds.\n\n", timeout);
+	printf("The watchdog timeout is %d seconds.\n\n", cfg.timeout);
   
-	PRINT_MSG(logFile, time, programName, "Waiting for user to enter bed.\n\n");
-	//this loop waits for the user to get into bed before it allows the program to begin running
-	while(getDistanceData(gpio,1) > 60 && getDistanceData(gpio,2) > 60 && getDistanceData(gpio,1) != ULTRA_ERROR && getDistanceData(gpio,2) != ULTRA_ERROR) {
-		usleep(2000000);
-		ioctl(watchdog, WDIOC_KEEPALIVE, 0);
+	//how much time must pass between watchdog pings in seconds
+  	int loopTime = cfg.timeout-1;
+  	if(loopTime < 1) {
+  		loopTime = 1;
+  	}
+
+	if(staleCheckpoint) {
+		getTime(time);
+		PRINT_MSG(logFile, time, programName, "The last recording was not finished but is too old to resume\n\n");
+		unlink(cfg.checkpointFile);
 	}
-	getTime(time);
-	PRINT_MSG(logFile, time, programName, "User has entered the bed.\nData collection has started.\n\n");
 
+	//the daemon's reports are written by their own thread, and it stops at the
+	//end of a night on SIGTERM or SIGINT
+	pthread_t reporter;
+	int reporting = cfg.daemonMode && ring.hdr == NULL;
+	if(cfg.daemonMode) {
+		signal(SIGTERM, onStopSignal);
+		signal(SIGINT, onStopSignal);
+	}
+	if(reporting) {
+		if(pthread_create(&reporter, NULL, reportThread, NULL) != 0) {
+			getTime(time);
+			PRINT_MSG(logFile, time, programName, "Error: Couldn't start the report thread\n\n");
+			return -1;
+		}
+		getTime(time);
+		PRINT_MSG(logFile, time, programName, "Running as a daemon, a report is made for every night\n\n");
+	}
 
-  	long startTime = getMicroTime();
+	//SIGHUP or saving the config file changes the keys that can change while recording
+	struct ConfigWatch configWatch;
+	initConfigWatch(&configWatch, configPath);
+	signal(SIGHUP, onReloadSignal);
+	long configChangedUs;
+
+	//nothing is allocated from here on, the heap is checked at the end.  A reload
+	//frees everything it reads the config into
+	size_t heapAtStart = mallinfo2().uordblks;
+
+	//checkpoints are only useful with the journal holding the samples
+	int checkpointing = cfg.checkpointFile[0] != 0 && journal.fd >= 0;
+
+	struct PresenceDetector presence;
+	long lastPing = getMicroTime();
+	long dist1;
+	long dist2;
+	int current = 0;
+
+	//one pass per night, only one pass unless running as a daemon
+	do {
+	struct Session* session = &sessions[current];
+	initPresence(&presence, cfg.presenceCm, cfg.presenceHystCm, cfg.presenceTicks);
+	if(!resuming) {
+		getTime(time);
+		PRINT_MSG(logFile, time, programName, "Waiting for user to enter bed.\n\n");
+	}
+	//this loop waits for the user to get into bed before it allows the program to begin running
+	//each tick ranges both sensors once, then sleeps until the next tick
+	while(!resuming && !stopDaemon) {
+		if(getMicroTime() - lastPing >= loopTime * 1000000L) {
+			ioctl(watchdog, WDIOC_KEEPALIVE, 0);
+			lastPing = getMicroTime();
+		}
+		if(checkReload(&configWatch, &configChangedUs) && reloadConfig(&cfg, configPath, configChangedUs, sizedFastMs, logFile, programName)) {
+			applyLiveConfig(&cfg, NULL, NULL, &presence, session);
+		}
+		getDistancePair(gpio, &dist1, &dist2);
+		if(live.seg != NULL) {
+			live.cur.dist[0] = dist1;
+			live.cur.dist[1] = dist2;
+			live.cur.timeMs = getMicroTime() / 1000;
+			live_publish(&live);
+		}
+		if(updatePresence(&presence, dist1, dist2)) {
+			break;
+		}
+		//a close reading is confirmed straight away instead of waiting a full tick
+		if(presence.count == 0) {
+			usleep(cfg.presenceTickMs * 1000);
+		}
+	}
+	if(stopDaemon) {
+		break;
+	}
+  	long startTime;
+  	struct UltraSchedule sched;
+  	initUltraSchedule(&sched, cfg.ultraFastMs, cfg.ultraSlowMs);
+  	struct Burst burst;
+  	initBurst(&burst, cfg.ultraBurst, cfg.ultraBurstGapMs);
+  	int k = 0;
+  	//prev1 and 2 make sure it doesn't record more than 1 data point per second for sound
+  	int prev1 = -1;
+  	int prev2 = -1;
+
+  	if(resuming) {
+  		//the recording carries on where the checkpoint and journal left it
+  		startTime = checkpoint.startUs;
+  		k = replay.k;
+  		prev1 = replay.prev1;
+  		prev2 = replay.prev2;
+  		presence.state = checkpoint.presenceState;
+  		sched.intervalUs = checkpoint.intervalUs;
+  		sched.fastTimeUs = checkpoint.fastTimeUs;
+  		sched.nextUs = getMicroTime() - startTime;
+  		char msg[150];
+  		snprintf(msg, sizeof(msg), "Resumed the recording cut off %ld seconds ago, %d ultrasonic samples were recovered\n\n", (long)((getMicroTime() - checkpoint.savedUs) / 1000000), k);
+  		getTime(time);
+  		PRINT_MSG(logFile, time, programName, msg);
+  		PRINT_EVENT(eventFile, (getMicroTime() - startTime)/1000, "RESUME", k, 0);
+  		//the ring may not have the night's START any more (a new analyzer, or
+  		//a ring lost with the power), so it gets it again.  Only the ring,
+  		//the journal and the collector already have it
+  		if(ring.hdr != NULL) {
+  			struct SleepRecord start = {startTime/1000, 0, 0, REC_START};
+  			ring_push(&ring, &start);
+  		}
+  		//the config may have changed while the recorder was down
+  		sendRecord(&collector, getMicroTime()/1000, REC_FAST, 0, sched.fastUs/1000);
+  		sendRecord(&collector, getMicroTime()/1000, REC_RATE, 0, sched.intervalUs/1000);
+  	}
+  	else {
+		getTime(time);
+		PRINT_MSG(logFile, time, programName, "User has entered the bed.\nData collection has started.\n\n");
+
+  		startTime = getMicroTime();
+  		session->startTime = startTime;
+  		if(reporting && rotateSession(session, cfg.ultraDataName, cfg.soundDataName, cfg.reportFileName) < 0) {
+  			getTime(time);
+  			PRINT_MSG(logFile, time, programName, "Error: Couldn't open the files for the night\n\n");
+  			break;
+  		}
+  		//absolute start time in ms so the offsets in the event file can be placed
+  		PRINT_EVENT(eventFile, 0, "START", startTime/1000, 0);
+  		PRINT_EVENT(eventFile, 0, "PRESENCE", PRESENCE_IN_BED, 0);
+  		sendRecord(&collector, startTime/1000, REC_START, 0, 0);
+  		sendRecord(&collector, startTime/1000, REC_FAST, 0, sched.fastUs/1000);
+  		sendRecord(&collector, startTime/1000, REC_PRESENCE, 0, PRESENCE_IN_BED);
+		PRINT_EVENT(eventFile, 0, "RATE", sched.intervalUs/1000, 0);
+		sendRecord(&collector, startTime/1000, REC_RATE, 0, sched.intervalUs/1000);
+	}
+	session->startTime = startTime;
+	live.cur.startMs = startTime / 1000;
+	live.cur.presence = presence.state;
+	long* ultraData1 = session->ultraData1;
+	long* ultraData2 = session->ultraData2;
+	long* ultraTimes = session->ultraTimes;
+	//the last sample, the schedule and presence still need it once the buffers are full
+	long last1 = k > 0 ? ultraData1[k-1] : ULTRA_ERROR;
+	long last2 = k > 0 ? ultraData2[k-1] : ULTRA_ERROR;
+	int buffersFull = 0;
+	ultraData = session->ultraData;
+	soundData = session->soundData;
+	long lastCheckpoint = -cfg.checkpointMs * 1000L;
+	//when the user left the bed, a long enough absence ends the night in daemon mode
+	long emptySince = getMicroTime() - startTime;
+	initPollStats(&session->poll, cfg.pollGapMs, edgeState.events != NULL);
+	long lastLive = 0;
   
   
   /****** 
@@ -989,46 +2689,160 @@ int main(const int argc, const char* const argv[]) {
    * 
    *******/
 
-  	//how much time must pass between ultrasonic recording data
-  	//1000000 = 1sec
-  	int loopTime = timeout-1;
-	long* ultraData1[timeLimit/60 * (loopTime/1000000)];
-        long* ultraData2[timeLimit/60 * (loopTime/1000000)];
-
-  	int k = 0;
-  	//prev1 and 2 make sure it doesn't record more than 1 data point per second for sound
-  	int prev1 = -1;
-  	int prev2 = -1;
-  	int passedMinutes = 0;
-  	int passedSeconds = 0;
-  	//to confirm watchdog is pinged
-	int isPinged = 0;
+  	//watchdog ping times are relative to startTime from here on
+	lastPing -= startTime;
           
-  	while((getMicroTime() - startTime)/1000000 < timeLimit * 60) {//(getMicroTime() - startTime)/1000000 < timeLimit*60) {
+  	while((getMicroTime() - startTime)/1000000 < cfg.timeLimit * 60 && !stopDaemon) {
+
+          	long now = getMicroTime() - startTime;
+
+          	//group commit, samples waiting longer than JOURNAL_SYNC_MS are synced
+          	journal_tick(&journal, (startTime + now)/1000);
 
-          	//records ultrasonic data and pings the watchdog every (timeOut-1) seconds
-          	if((getMicroTime() - startTime)/1000000 % loopTime == 0 && !isPinged) {
+          	//the counters that change too often to publish with every record
+          	if(live.seg != NULL && now - lastLive >= LIVE_PERIOD_MS * 1000L) {
+          		live.cur.polls = session->poll.polls;
+          		live.cur.holes = session->poll.holes;
+          		live.cur.timeMs = (startTime + now) / 1000;
+          		live_publish(&live);
+          		lastLive = now;
+          	}
+
+          	if(checkReload(&configWatch, &configChangedUs) && reloadConfig(&cfg, configPath, configChangedUs, sizedFastMs, logFile, programName)) {
+          		long oldInterval = sched.intervalUs;
+          		long oldFast = sched.fastUs;
+          		applyLiveConfig(&cfg, &sched, &burst, &presence, session);
+          		if(sched.fastUs != oldFast) {
+          			sendRecord(&collector, (startTime + now)/1000, REC_FAST, 0, sched.fastUs/1000);
+          		}
+          		if(sched.intervalUs != oldInterval) {
+          			PRINT_EVENT(eventFile, now/1000, "RATE", sched.intervalUs/1000, k);
+          			sendRecord(&collector, (startTime + now)/1000, REC_RATE, 0, sched.intervalUs/1000);
+          			sched.nextUs = now + sched.intervalUs < sched.nextUs ? now + sched.intervalUs : sched.nextUs;
+          		}
+          	}
+
+          	//pings the watchdog every (timeOut-1) seconds, separate from sampling
+          	if(now - lastPing >= loopTime * 1000000L) {
                   	//This ioctl call will write to the watchdog file and prevent 
                         //the system from rebooting. It does this every (timeOut-1) seconds, so 
                         //setting the watchdog timer lower than this will cause the timer
                         //to reset the Pi
                         ioctl(watchdog, WDIOC_KEEPALIVE, 0);
+                        SLEEP_PROBE1(watchdog_kick, now/1000);
                         getTime(time);
                         //Log that the Watchdog was kicked
                         PRINT_MSG(logFile, time, programName, "The Watchdog was pinged\n\n");
-                  	//records ultrasonic data
-                  	printUltraToFile(gpio, ultraData, logFile, programName, ultraData1, ultraData2, k);
-                  	k++;
+                        lastPing = now;
+                        //samples for the collector go out in one batch per ping
+                        SLEEP_PROBE1(collector_flush, collector.n);
+                        collect_flush(&collector);
+                        collect_poll_acks(&collector);
+                }
+
+          	//the journal is synced first so the checkpoint never gets ahead of it
+          	if(checkpointing && now - lastCheckpoint >= cfg.checkpointMs * 1000L) {
+          		journal_commit(&journal, (startTime + now)/1000);
+          		checkpoint.startUs = startTime;
+          		checkpoint.timeLimit = cfg.timeLimit;
+          		checkpoint.presenceState = presence.state;
+          		checkpoint.intervalUs = sched.intervalUs;
+          		checkpoint.fastTimeUs = sched.fastTimeUs;
+          		checkpoint.journalRecords = journal.records;
+          		if(journal.fd < 0 || saveCheckpoint(cfg.checkpointFile, &checkpoint) < 0) {
+          			getTime(time);
+          			PRINT_MSG(logFile, time, programName, "Warning: Couldn't write a checkpoint, this recording can't be resumed after a reset\n\n");
+          			checkpointing = 0;
+          		}
+          		lastCheckpoint = now;
+          	}
 
-			isPinged = 1;
+          	//while the user is out of bed nothing is recorded, the sensors are only
+          	//ranged at the presence tick rate to see when they come back
+          	if(presence.state == PRESENCE_EMPTY) {
+          		if(cfg.daemonMode && now - emptySince >= cfg.sessionGapMin * 60000000L) {
+          			getTime(time);
+          			PRINT_MSG(logFile, time, programName, "User has been out of bed long enough, the night is over\n\n");
+          			break;
+          		}
+          		pausePollStats(&session->poll);
+          		usleep(cfg.presenceTickMs * 1000);
+          		getDistancePair(gpio, &dist1, &dist2);
+          		if(updatePresence(&presence, dist1, dist2)) {
+          			now = getMicroTime() - startTime;
+          			PRINT_EVENT(eventFile, now/1000, "PRESENCE", PRESENCE_IN_BED, k);
+          			sendRecord(&collector, (startTime + now)/1000, REC_PRESENCE, 0, PRESENCE_IN_BED);
+          			getTime(time);
+          			PRINT_MSG(logFile, time, programName, "User has returned to bed, recording resumed\n\n");
+          			sched.intervalUs = sched.slowUs;
+          			sched.nextUs = now;
+          		}
+          		continue;
+          	}
+
+          	//records ultrasonic data when the schedule says it is due, a burst's
+          	//pings go out one per pass once the gap after the last one is over.
+          	//Once the buffers are full samples are still taken and sent, so the
+          	//rate and presence keep following the bed, but not kept for the report
+          	if((burst.done > 0 ? now >= burst.nextUs : now >= sched.nextUs) && stepBurst(&burst, gpio, now, &dist1, &dist2)) {
+                  	now = burst.startUs;
+                  	if(k < maxSamples) {
+                  		printUltraToFile(ultraData, logFile, programName, ultraData1, ultraData2, ultraTimes, k, now/1000, dist1, dist2);
+                  	}
+                  	else if(!buffersFull) {
+                  		buffersFull = 1;
+                  		char msg[150];
+                  		snprintf(msg, sizeof(msg), "Warning: The sample buffers are full after %d samples, the rest of the night's samples won't be in its report\n\n", maxSamples);
+                  		getTime(time);
+                  		PRINT_MSG(logFile, time, programName, msg);
+                  	}
+                  	sendRecord(&collector, (startTime + now)/1000, REC_ULTRA, 1, dist1);
+                  	sendRecord(&collector, (startTime + now)/1000, REC_ULTRA, 2, dist2);
+                  	//rate changes are recorded with the sample they start from
+                  	if(k > 0 && updateUltraSchedule(&sched, dist1, dist2, last1, last2)) {
+                  		PRINT_EVENT(eventFile, now/1000, "RATE", sched.intervalUs/1000, k);
+                  		sendRecord(&collector, (startTime + now)/1000, REC_RATE, 0, sched.intervalUs/1000);
+                  	}
+                  	sched.nextUs = now + sched.intervalUs;
+                  	//every sample also tells if the user has left the bed
+                  	if(updatePresence(&presence, dist1, dist2)) {
+                  		PRINT_EVENT(eventFile, now/1000, "PRESENCE", PRESENCE_EMPTY, k);
+                  		sendRecord(&collector, (startTime + now)/1000, REC_PRESENCE, 0, PRESENCE_EMPTY);
+                  		getTime(time);
+                  		PRINT_MSG(logFile, time, programName, "User has left the bed, recording paused\n\n");
+                  		emptySince = now;
+                  	}
+                  	last1 = dist1;
+                  	last2 = dist2;
+                  	if(k < maxSamples) {
+                  		k++;
+                  	}
                 }
-          	//to stop ultrasonic functions to be called multiple times in same microsecond
-		else if((getMicroTime() - startTime)/1000000 % loopTime != 0 && isPinged) {
-			isPinged = 0;
-		}
-          	//records sound data
-          	printSoundToFile(gpio, soundData, logFile, programName, &prev1, &prev2, startTime);
+          	//records sound data, a long wait since the last poll is marked as a hole
+          	long hole = recordPoll(&session->poll, getMicroTime() - startTime);
+          	if(hole > 0) {
+          		now = getMicroTime() - startTime;
+          		SLEEP_PROBE2(poll_gap, now/1000, hole);
+          		PRINT_EVENT(eventFile, (now - hole)/1000, "GAP", hole/1000, k);
+          		sendRecord(&collector, (startTime + now - hole)/1000, REC_GAP, 0, hole/1000);
+          	}
+          	printSoundToFile(gpio, soundData, logFile, programName, &prev1, &prev2, startTime, &collector);
+
+          	//with edge events there is nothing to spin on, sleep until an edge arrives
+          	//or the next sample or ping is due
+          	if(edgeState.events != NULL) {
+          		long wait = burst.done > 0 ? burst.nextUs : sched.nextUs;
+          		if(lastPing + loopTime * 1000000L < wait) {
+          			wait = lastPing + loopTime * 1000000L;
+          		}
+          		wait -= getMicroTime() - startTime;
+          		if(wait > 0) {
+          			waitEdges(wait / 1000);
+          		}
+          	}
         }
+	//watchdog ping times go back to absolute for the wait for the next night
+	lastPing += startTime;
   
  /*******
    * 
@@ -1040,74 +2854,86 @@ int main(const int argc, const char* const argv[]) {
    * 
   ********/
 
+	//the night's samples are sent and synced before its report is made
+	sendRecord(&collector, getMicroTime()/1000, REC_END, 0, 0);
+	collect_flush(&collector);
+	journal_commit(&journal, getMicroTime()/1000);
+	bitmap_sync(&bitmap);
+
+	//the recording finished, so there is nothing to resume
+	if(checkpointing) {
+		unlink(cfg.checkpointFile);
+	}
+	//and the journal starts over for the next night instead of growing forever,
+	//the one before stays in <JOURNAL_FILE>.1 for sleep_export
+	if(journal.fd >= 0) {
+		rotateJournal(cfg.journalFile, logFile, programName);
+	}
+
 	getTime(time);
 	//logs that all data is gathered
 	PRINT_MSG(logFile, time, programName, "Data collection complete\n\n");
-	//prints to report file to make a new header for the current day
-	PRINT_MSG(reportFile, time, programName, "THIS DAY'S REPORT:\n________________________________________________\n\n");
-	//opens sound file to read
-  	fclose(soundData);
-  	soundData = fopen(soundDataName,"r");
-  
-  	getTime(time);
-  
-    	PRINT_MSG(reportFile, time, programName, "Report on sound data:\n\n");
-  	//analyzing sound data
-  	int topMinutes[(int)(timeLimit/6) + 1];
-  	int byMinute[timeLimit];
-  	analyzeSound(soundData, byMinute, topMinutes, timeLimit);
-  
-  	for(int i = 0; i < timeLimit/6 + 1; i++) {
-          	PRINT_ANALYSIS(reportFile, "Greatest sound activity at", topMinutes[i]%60, (int)(topMinutes[i]/60), byMinute[topMinutes[i]]);
-        }
-  
-  	PRINT_MSG(reportFile, time, programName, "Report on ultrasonic data:\n\n");
+	if(live.seg != NULL) {
+		live.cur.startMs = 0;
+		live.cur.presence = PRESENCE_EMPTY;
+		live.cur.timeMs = getMicroTime() / 1000;
+		live_publish(&live);
+	}
 
-  	//analyzing ultrasonic data
-  	analyzeUltra(reportFile, ultraData1, ultraData2, k, loopTime);
-  	/*int j = 1;
-  	int diff1 = 0;
-  	int diff2 = 0;
-  	// Prints to report if change is more than 8cm
-  	const int difference = 8;
+	session->k = k;
+	session->fastTimeUs = sched.fastTimeUs;
+	session->burst = burst.stats;
+	if(ring.hdr != NULL) {
+		//the report is the analyzer's, the numbers only the sampler has go in the log
+		printBurstStats(logFile, &session->burst);
+		printCoverage(logFile, &session->poll);
+		fprintf(logFile, "Ring: %u records waiting for the analyzer, at most %u of %u, %u dropped\n\n",
+			ring_head(&ring) - ring_tail(&ring), ring.mostUsed, ring.mask + 1, ring.hdr->dropped);
+		fflush(logFile);
+		resuming = 0;
+	}
+	else if(cfg.daemonMode) {
+		//the report is made while the next night is waited for and recorded in the
+		//other session, which is free again once the report before this one is done
+		queueReport(session);
+		current = !current;
+		resuming = 0;
+	}
+	else {
+		writeReport(session);
+	}
+	} while(cfg.daemonMode && !stopDaemon);
+
+	if(reporting) {
+		waitReports();
+		pthread_mutex_lock(&reportLock);
+		reportStop = 1;
+		pthread_cond_broadcast(&reportCond);
+		pthread_mutex_unlock(&reportLock);
+		pthread_join(reporter, NULL);
+	}
 
-  	// Goes through the array and checks for changes in movement
-  	// Prints time in minute, seconds from movement
-  
-  	while (j <= k) {
-		
-          	passedSeconds = j * loopTime;
-          	passedMinutes = passedSeconds/60;
-          
-        	if (ultraData1[j] != -1 || ultraData2[j] != -1) {
-			if (ultraData1[j] != -1 && ultraData1[j-1] != -1)
-                          	diff1 = fabs(ultraData1[j] - ultraData1[j-1]);
-                  	else
-                          	diff1 = 0;
-                  	if (ultraData2[j] != -1 && ultraData2[j-1] != -1)
-                          	diff2 = fabs(ultraData2[j] - ultraData2[j-1]);
-                  	else
-                          	diff2 = 0;
-                }
-          	else {
-			diff1 = 0;
-                  	diff2 = 0;
-                }
-          	// If distances is greater than certain difference, print it to analysis
-          	if (diff1 > difference || diff2 > difference) {
-			if (diff1 > diff2)
-                          	PRINT_ANALYSIS(reportFile, "Movement at", passedMinutes, passedSeconds, diff1);
-                        else
-                          	PRINT_ANALYSIS(reportFile, "Movement at", passedMinutes, passedSeconds, diff2);
-                }
-          	j++;
-        }*/
-  
-  	//logging that a report was made
-	PRINT_MSG(logFile, time, programName, "Report made on data\n\n");
-  
+	//last samples to the collector, waiting a little for it to confirm them
+	collect_flush(&collector);
+	collect_wait_acks(&collector, 1000);
+	collect_close(&collector);
+	if(collector.dropped > 0) {
+		char msg[100];
+		snprintf(msg, sizeof(msg), "Warning: %llu samples were dropped while the collector wasn't reading\n\n", (unsigned long long)collector.dropped);
+		getTime(time);
+		PRINT_MSG(logFile, time, programName, msg);
+	}
 
-  
+	bitmap_close(&bitmap);
+	live_close(&live);
+	ring_close(&ring);
+	if(journal.fd >= 0) {
+		journal_close(&journal);
+		char msg[100];
+		snprintf(msg, sizeof(msg), "Journal: %llu samples synced in %llu blocks\n\n", (unsigned long long)journal.records, (unsigned long long)journal.commits);
+		getTime(time);
+		PRINT_MSG(logFile, time, programName, msg);
+	}
   
  
   	//Writing a V to the watchdog file will disable to watchdog and prevent it from
@@ -1123,13 +2949,41 @@ int main(const int argc, const char* const argv[]) {
 	//Log that the Watchdog was closed
 	PRINT_MSG(logFile, time, programName, "The Watchdog was closed\n\n");
 
+	for(int i = 0; i < numSessions; i++) {
+		closeSessionFiles(&sessions[i]);
+	}
+
+	//memory use for the run, the heap should not have grown after startup
+	char msg[200];
+	long heapGrowth = (long)mallinfo2().uordblks - (long)heapAtStart;
+	if(arena.base != NULL) {
+		snprintf(msg, sizeof(msg), "Memory: peak %zu KB of the %zu KB arena, heap grew %ld bytes after startup\n\n", arena.peak / 1024, arena.size / 1024, heapGrowth);
+	}
+	else {
+		snprintf(msg, sizeof(msg), "Memory: heap grew %ld bytes after startup\n\n", heapGrowth);
+	}
+	getTime(time);
+	PRINT_MSG(logFile, time, programName, msg);
+
+	for(int i = 0; i < numSessions; i++) {
+		freeSession(&sessions[i]);
+	}
+
 	//Free the gpio pins
-	gpiolib_free_gpio(gpio);
+	if(edgeState.events != NULL)
+		gpiolib_free_events(edgeState.events);
+	else if(simulated)
+		gpiolib_free_sim(gpio);
+	else
+		gpiolib_free_gpio(gpio);
 	getTime(time);
 	//Log that the GPIO pins were freed
 	PRINT_MSG(logFile, time, programName, "The GPIO pins have been freed\n\n");
 
-
+	if(configWatch.fd >= 0) {
+		close(configWatch.fd);
+	}
+	config_free(&cfg);
   
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,120 @@
+#include "sleep_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* the records start on their own cache line after the header */
+#define RING_RECS_OFFSET 192
+_Static_assert(sizeof(struct RingHeader) <= RING_RECS_OFFSET, "ring header overlaps the records");
+
+static uint32_t round_pow2(uint32_t n)
+{
+  uint32_t p = 1;
+  while (p < n && p < (1u << 30))
+    p <<= 1;
+  return p;
+}
+
+int ring_open(struct Ring* r, const char* path, uint32_t capacity, int create)
+{
+  memset(r, 0, sizeof(*r));
+  int fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+  if (fd < 0)
+    return !create && errno == ENOENT ? 1 : -1;
+
+  struct stat st;
+  struct RingHeader hdr;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  /* an existing ring keeps its capacity, so records waiting in it stay put */
+  if ((size_t)st.st_size >= RING_RECS_OFFSET && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+      && hdr.magic == RING_MAGIC && hdr.version == RING_VERSION && hdr.capacity != 0 && hdr.capacity <= (1u << 30)
+      && (hdr.capacity & (hdr.capacity - 1)) == 0
+      && (size_t)st.st_size >= RING_RECS_OFFSET + (size_t)hdr.capacity * sizeof(struct SleepRecord)) {
+    capacity = hdr.capacity;
+  }
+  else if (!create) {
+    close(fd);
+    return 1;
+  }
+  else {
+    capacity = round_pow2(capacity);
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, RING_RECS_OFFSET + (off_t)capacity * sizeof(struct SleepRecord)) < 0) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  size_t len = RING_RECS_OFFSET + (size_t)capacity * sizeof(struct SleepRecord);
+  void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return -1;
+
+  r->hdr = p;
+  r->recs = (struct SleepRecord*)((char*)p + RING_RECS_OFFSET);
+  r->mask = capacity - 1;
+  r->mapLen = len;
+  /* the header was read with pread, the capacity only counts once the
+   * sampler's release of magic has been seen through the mapping */
+  if (!create && (__atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE) != RING_MAGIC || r->hdr->capacity != capacity)) {
+    ring_close(r);
+    return 1;
+  }
+  if (r->hdr->magic != RING_MAGIC) {
+    r->hdr->version = RING_VERSION;
+    r->hdr->capacity = capacity;
+    __atomic_store_n(&r->hdr->magic, RING_MAGIC, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+void ring_close(struct Ring* r)
+{
+  if (r->hdr)
+    munmap(r->hdr, r->mapLen);
+  r->hdr = NULL;
+}
+
+int ring_push(struct Ring* r, const struct SleepRecord* rec)
+{
+  struct RingHeader* hdr = r->hdr;
+  uint32_t head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+  uint32_t used = head - __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+
+  if (used > r->mask) {
+    __atomic_store_n(&hdr->dropped, hdr->dropped + 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  if (used + 1 > r->mostUsed)
+    r->mostUsed = used + 1;
+  r->recs[head & r->mask] = *rec;
+  __atomic_store_n(&hdr->head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+uint32_t ring_head(const struct Ring* r)
+{
+  return __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+uint32_t ring_tail(const struct Ring* r)
+{
+  return __atomic_load_n(&r->hdr->tail, __ATOMIC_RELAXED);
+}
+
+const struct SleepRecord* ring_at(const struct Ring* r, uint32_t pos)
+{
+  return &r->recs[pos & r->mask];
+}
+
+void ring_release(struct Ring* r, uint32_t pos)
+{
+  __atomic_store_n(&r->hdr->tail, pos, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,77 @@
+#ifndef SLEEP_RING_H
+#define SLEEP_RING_H
+
+#include "sleep_archive.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Ring of records in a mapped file, from the sampler to the analyzer.
+ *
+ * With RING_FILE set the recorder only samples: every record goes into
+ * the ring, and a separate analyzer process (sleep_record --analyzer)
+ * reads them back, writes the stat files and makes the reports.  A crash
+ * or stall in the analysis can then no longer hold up sampling or stop
+ * the watchdog being kicked.
+ *
+ * There is one writer and one reader, each with its own cursor.  head is
+ * how many records the sampler has written, tail how many the analyzer
+ * is finished with; each only ever moves its own, with release stores,
+ * and reads the other's with acquire loads, so neither takes a lock or
+ * waits for the other.  The cursors are counts that wrap at 2^32, a
+ * record's slot is its count modulo the capacity, and they are 32 bits so
+ * the loads and stores are plain ones on the Pi.
+ *
+ * The analyzer only moves tail past a night once its report is written,
+ * so a restarted analyzer starts over from the night's REC_START and
+ * rebuilds it.  Records it has read are not lost when it dies, only those
+ * that didn't fit while it was gone, which the sampler counts in dropped
+ * rather than waiting.  A night that fills the ring while the analyzer
+ * holds it can't get its REC_END in, so the analyzer ends such a night
+ * with what it has and lets it go.  The ring lives in the page cache, so
+ * it outlives either process but not a power cut; JOURNAL_FILE is for
+ * that. */
+
+#define RING_MAGIC   0x534c5247u   /* "SLRG" */
+#define RING_VERSION 1
+
+struct RingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;                          /* records, a power of two */
+  uint32_t reserved;
+  uint32_t head __attribute__((aligned(64))); /* written by the sampler only */
+  uint32_t dropped;                           /* records that didn't fit */
+  uint32_t tail __attribute__((aligned(64))); /* written by the analyzer only */
+};
+
+struct Ring {
+  struct RingHeader* hdr;   /* NULL if there is no ring */
+  struct SleepRecord* recs;
+  uint32_t mask;
+  size_t   mapLen;
+  uint32_t mostUsed;        /* writer only, the fullest it has seen the ring */
+};
+
+/* maps the ring at path.  Only the sampler passes create: it makes the
+ * ring with capacity records (rounded up to a power of two, at most 2^30)
+ * if there isn't a good one, while an existing ring keeps its size and
+ * cursors.  The analyzer never touches the file until the sampler has set
+ * it up, so two starting together can't wipe each other's ring.
+ * returns 0 on success, 1 if create is 0 and the ring isn't there or set
+ * up yet, -1 on error */
+int  ring_open (struct Ring* r, const char* path, uint32_t capacity, int create);
+void ring_close(struct Ring* r);
+
+/* sampler: adds a record, returns -1 (and counts it) if the ring is full */
+int  ring_push (struct Ring* r, const struct SleepRecord* rec);
+
+/* analyzer: the cursors, and the record at a position in [tail, head) */
+uint32_t ring_head(const struct Ring* r);
+uint32_t ring_tail(const struct Ring* r);
+const struct SleepRecord* ring_at(const struct Ring* r, uint32_t pos);
+
+/* analyzer: everything before pos may be overwritten */
+void ring_release(struct Ring* r, uint32_t pos);
+
+#endif /* SLEEP_RING_H */
@@ -0,0 +1,128 @@
+#include "sleep_sketch.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char* const baseline_metric_names[BASE_METRICS] = {
+  "Movements per hour",
+  "Minutes with sound",
+  "Minutes to settle",
+};
+
+/* g = (1 + a) / (1 - a) and its log, for SKETCH_ALPHA 0.04 */
+#define GAMMA     (1.04 / 0.96)
+#define LOG_GAMMA 0.080042707673536
+_Static_assert(SKETCH_ALPHA == 0.04, "GAMMA and LOG_GAMMA are for an alpha of 0.04");
+
+void sketch_init(struct Sketch* s)
+{
+  memset(s, 0, sizeof(*s));
+}
+
+void sketch_add(struct Sketch* s, double value)
+{
+  int i = 0;
+  if (value >= SKETCH_MIN) {
+    i = 1 + (int)(log(value / SKETCH_MIN) / LOG_GAMMA);
+    if (i >= SKETCH_BUCKETS)
+      i = SKETCH_BUCKETS - 1;
+  }
+  s->buckets[i]++;
+  s->count++;
+}
+
+void sketch_merge(struct Sketch* into, const struct Sketch* from)
+{
+  into->count += from->count;
+  for (int i = 0; i < SKETCH_BUCKETS; i++)
+    into->buckets[i] += from->buckets[i];
+}
+
+double sketch_quantile(const struct Sketch* s, double q)
+{
+  if (s->count == 0)
+    return -1;
+  if (q < 0)
+    q = 0;
+  if (q > 1)
+    q = 1;
+
+  /* the value of rank q * (count - 1), counting from 0 */
+  uint64_t rank = (uint64_t)(q * (s->count - 1) + 0.5);
+  uint64_t seen = 0;
+  int i = 0;
+  for (; i < SKETCH_BUCKETS - 1; i++) {
+    seen += s->buckets[i];
+    if (seen > rank)
+      break;
+  }
+  if (i == 0)
+    return 0;
+  /* bucket i holds [min g^(i-1), min g^i), its middle in relative terms */
+  return SKETCH_MIN * exp(i * LOG_GAMMA) * 2 / (GAMMA + 1);
+}
+
+int baseline_append(const char* path, const struct NightSketch* night)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+    return -1;
+  ssize_t n = write(fd, night, sizeof(*night));
+  close(fd);
+  return n == sizeof(*night) ? 0 : -1;
+}
+
+long baseline_each(const char* path, int64_t fromMs, int64_t toMs, baseline_night_fn fn, void* arg)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  long records = st.st_size / sizeof(struct NightSketch);
+  if (records == 0) {
+    close(fd);
+    return 0;
+  }
+  void* p = mmap(NULL, records * sizeof(struct NightSketch), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return -1;
+
+  const struct NightSketch* nights = p;
+  long count = 0;
+  for (long i = 0; i < records; i++) {
+    if (nights[i].magic != BASELINE_MAGIC || nights[i].version != BASELINE_VERSION)
+      continue;
+    if (nights[i].startMs < fromMs || nights[i].startMs >= toMs)
+      continue;
+    fn(&nights[i], arg);
+    count++;
+  }
+  munmap(p, records * sizeof(struct NightSketch));
+  return count;
+}
+
+static void merge_night(const struct NightSketch* night, void* arg)
+{
+  struct Baseline* base = arg;
+  for (int m = 0; m < BASE_METRICS; m++)
+    sketch_add(&base->metric[m], night->metric[m]);
+  for (int h = 0; h < 24; h++)
+    if (night->hours[h].count > 0)
+      sketch_merge(&base->hours[h], &night->hours[h]);
+}
+
+long baseline_merge(const char* path, int64_t fromMs, int64_t toMs, struct Baseline* base)
+{
+  memset(base, 0, sizeof(*base));
+  base->nights = baseline_each(path, fromMs, toMs, merge_night, base);
+  return base->nights;
+}
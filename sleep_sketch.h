@@ -0,0 +1,75 @@
+#ifndef SLEEP_SKETCH_H
+#define SLEEP_SKETCH_H
+
+#include <stdint.h>
+
+/* Quantile sketches for comparing a night with the nights before it.
+ *
+ * A sketch is a histogram with logarithmic buckets: a value v goes in
+ * bucket 1 + floor(log(v / SKETCH_MIN) / log(g)), g = (1 + a) / (1 - a),
+ * and a quantile is read back as the middle of its bucket, which is
+ * within a (SKETCH_ALPHA, 4%) of the true value.  Values below
+ * SKETCH_MIN share bucket 0 and read back as 0.  Two sketches merge by
+ * adding their counts, so a merge is exact, takes the same time however
+ * many values went in and needs no more memory than one sketch.
+ *
+ * Every night the recorder adds a NightSketch to BASELINE_FILE: the
+ * night's metrics and a sketch of the distances read in each hour of the
+ * clock.  The records are fixed size and only appended, so the history
+ * is merged by mapping the file and adding up the records in place. */
+
+#define SKETCH_BUCKETS 256
+#define SKETCH_ALPHA   0.04
+#define SKETCH_MIN     0.01
+
+struct Sketch {
+  uint32_t count;
+  uint32_t buckets[SKETCH_BUCKETS];
+};
+
+void   sketch_init    (struct Sketch* s);
+void   sketch_add     (struct Sketch* s, double value);
+void   sketch_merge   (struct Sketch* into, const struct Sketch* from);
+
+/* the value below which a fraction q (0 to 1) of the values are, -1 if
+ * the sketch is empty */
+double sketch_quantile(const struct Sketch* s, double q);
+
+#define BASELINE_MAGIC   0x534c4e53u   /* "SLNS" */
+#define BASELINE_VERSION 1
+
+enum { BASE_MOVES_PER_HOUR, BASE_SOUND_MINUTES, BASE_SETTLE_MINUTES, BASE_METRICS };
+
+/* printable names of the BASE_ metrics */
+extern const char* const baseline_metric_names[BASE_METRICS];
+
+struct NightSketch {
+  uint32_t magic;
+  uint32_t version;
+  int64_t  startMs;                 /* when the night's recording started */
+  int32_t  minutes;                 /* how long it recorded */
+  int32_t  reserved;
+  double   metric[BASE_METRICS];
+  struct Sketch hours[24];          /* distances in cm, by clock hour */
+};
+
+/* nights merged into one set of sketches */
+struct Baseline {
+  long     nights;
+  struct Sketch metric[BASE_METRICS];
+  struct Sketch hours[24];
+};
+
+/* adds a night to the end of the file, creating it if needed */
+int  baseline_append(const char* path, const struct NightSketch* night);
+
+typedef void (*baseline_night_fn)(const struct NightSketch* night, void* arg);
+
+/* calls fn for each night in the file that started in [fromMs, toMs).
+ * returns how many, -1 if the file can't be read */
+long baseline_each  (const char* path, int64_t fromMs, int64_t toMs, baseline_night_fn fn, void* arg);
+
+/* merges the nights in [fromMs, toMs) into base, which is cleared first */
+long baseline_merge (const char* path, int64_t fromMs, int64_t toMs, struct Baseline* base);
+
+#endif /* SLEEP_SKETCH_H */
@@ -0,0 +1,140 @@
+#include "sleep_stats.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int stats_map(struct StatFile* file, const char* path)
+{
+  struct stat st;
+  int fd;
+
+  file->data = NULL;
+  file->len = 0;
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return -1;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size > 0) {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    file->data = p;
+    file->len = st.st_size;
+  }
+  close(fd);
+  return 0;
+}
+
+void stats_unmap(struct StatFile* file)
+{
+  if (file->data)
+    munmap((void*)file->data, file->len);
+  file->data = NULL;
+  file->len = 0;
+}
+
+static int is_sep(char c)
+{
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == 0;
+}
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* number of leading ASCII digits in the 8 bytes of w (first byte lowest)
+ * each byte's low 7 bits get 0x50 added (>= 0x80 means >= '0') and 0x46
+ * added (>= 0x80 means > '9'); neither sum can carry into the next byte */
+static int digit_run(uint64_t w)
+{
+  uint64_t low7 = w & ~HIGHS;
+  uint64_t ge0 = low7 + 0x50 * ONES;
+  uint64_t gt9 = low7 + 0x46 * ONES;
+  uint64_t nondigit = (~ge0 | gt9 | w) & HIGHS;
+  return nondigit ? __builtin_ctzll(nondigit) >> 3 : 8;
+}
+
+/* value of the first n (1-8) digits of w */
+static uint64_t digit_value(uint64_t w, int n)
+{
+  uint64_t v = w & 0x0F0F0F0F0F0F0F0FULL;
+  /* the digits move to the top bytes, zeros in front of them are leading zeros */
+  if (n < 8)
+    v <<= 8 * (8 - n);
+  v = (v * 10) + (v >> 8);
+  v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+       (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+  return v;
+}
+#endif
+
+static const uint64_t pow10[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+struct StatCount stats_parse(const char* data, size_t len, stats_value_fn fn, void* arg)
+{
+  struct StatCount count = {0, 0};
+  size_t i = 0;
+
+  while (i < len) {
+    /* separators are nearly always a single space */
+    while (i < len && is_sep(data[i]))
+      i++;
+    if (i == len)
+      break;
+
+    int negative = 0;
+    if (data[i] == '-') {
+      negative = 1;
+      i++;
+    }
+
+    uint64_t value = 0;
+    int digits = 0;
+    int overflow = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (i + 8 <= len) {
+      uint64_t w;
+      memcpy(&w, data + i, 8);
+      int n = digit_run(w);
+      if (n == 0)
+        break;
+      if (digits + n > 18)
+        overflow = 1;
+      value = value * pow10[n] + digit_value(w, n);
+      digits += n;
+      i += n;
+      if (n < 8)
+        break;
+    }
+#endif
+    /* the last few bytes of the file */
+    while (i < len && data[i] >= '0' && data[i] <= '9') {
+      if (digits >= 18)
+        overflow = 1;
+      value = value * 10 + (data[i] - '0');
+      digits++;
+      i++;
+    }
+
+    /* anything but a separator after the digits makes the token bad */
+    if (digits == 0 || overflow || (i < len && !is_sep(data[i]))) {
+      count.bad++;
+      while (i < len && !is_sep(data[i]))
+        i++;
+      continue;
+    }
+
+    count.values++;
+    fn(negative ? -(long)value : (long)value, arg);
+  }
+  return count;
+}
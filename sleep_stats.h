@@ -0,0 +1,30 @@
+#ifndef SLEEP_STATS_H
+#define SLEEP_STATS_H
+
+#include <stddef.h>
+
+/* Reader for the space separated stat files (SOUND_STAT_FILE and
+ * ULTRA_STAT_FILE).  The file is memory mapped and the integers are parsed
+ * eight bytes at a time, so long legacy archives don't go through stdio. */
+
+struct StatFile {
+  const char* data;
+  size_t      len;
+};
+
+struct StatCount {
+  long values;    /* integers handed to the callback */
+  long bad;       /* tokens that were not integers, skipped */
+};
+
+typedef void (*stats_value_fn)(long value, void* arg);
+
+/* return 0 on success, -1 if the file can't be opened or mapped
+ * an empty file maps to data == NULL, len == 0 */
+int  stats_map  (struct StatFile* file, const char* path);
+void stats_unmap(struct StatFile* file);
+
+/* calls fn for every integer in data, in order */
+struct StatCount stats_parse(const char* data, size_t len, stats_value_fn fn, void* arg);
+
+#endif /* SLEEP_STATS_H */
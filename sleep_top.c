@@ -0,0 +1,133 @@
+//Shows the recorder's live readings from its shared memory segment (LIVE_SHM,
+//see sleep_live.h): the latest distances and sounds, presence, and the rates
+//the counters are going up at.  Reading takes no locks and no system calls,
+//so any number of these can run without slowing the recorder down.
+//
+//	./sleep_top [segment name] [seconds between updates]
+//	./sleep_top /sleep_live 1
+
+#include "sleep_live.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//a recorder that hasn't published for this long is taken to have stopped
+#define STALE_MS 3000
+
+static int64_t nowMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static double nowSeconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//a counter's rate per second between two snapshots
+static double rate(uint64_t now, uint64_t before, double seconds) {
+	return now >= before && seconds > 0 ? (now - before) / seconds : 0;
+}
+
+static void printDistance(const char* label, int32_t cm) {
+	if(cm < 0) {
+		printf("  %s    no echo", label);
+	}
+	else {
+		printf("  %s %6d cm", label, cm);
+	}
+}
+
+static void printSound(const char* label, int64_t soundMs, int64_t now) {
+	if(soundMs == 0) {
+		printf("  %s      never", label);
+	}
+	else {
+		printf("  %s %6llds ago", label, (long long)((now - soundMs) / 1000));
+	}
+}
+
+int main(int argc, char* argv[]) {
+	const char* name = argc > 1 ? argv[1] : "/sleep_live";
+	double interval = argc > 2 ? atof(argv[2]) : 1;
+	if(interval <= 0) {
+		printf("usage: %s [segment name] [seconds between updates]\n", argv[0]);
+		return 1;
+	}
+	const struct LiveSegment* seg = live_attach(name);
+	if(seg == NULL) {
+		printf("No live segment %s, is the recorder running with LIVE_SHM set?\n", name);
+		return 1;
+	}
+	int screen = isatty(STDOUT_FILENO);
+
+	struct LiveSnapshot before;
+	struct LiveSnapshot snap;
+	if(live_read(seg, &before) < 0) {
+		printf("The recorder is stuck part way through publishing\n");
+		return 1;
+	}
+	double beforeAt = nowSeconds();
+
+	for(;;) {
+		usleep((useconds_t)(interval * 1e6));
+
+		//reads are timed over a batch, one is too quick for the clock
+		int tries = 0;
+		int failed = 0;
+		double readStart = nowSeconds();
+		for(int i = 0; i < 1000; i++) {
+			int n = live_read(seg, &snap);
+			if(n < 0) {
+				failed++;
+			}
+			else {
+				tries += n - 1;
+			}
+		}
+		double readNs = (nowSeconds() - readStart) * 1e6;
+		double at = nowSeconds();
+		double seconds = at - beforeAt;
+		int64_t now = nowMs();
+
+		if(screen) {
+			printf("\033[H\033[J");
+		}
+		const char* state = snap.startMs == 0 ? "waiting for bed" : snap.presence ? "in bed" : "out of bed";
+		printf("%s: %s", name, now - snap.timeMs > STALE_MS ? "not updating, the recorder has stopped" : state);
+		if(snap.startMs != 0) {
+			long s = (long)((now - snap.startMs) / 1000);
+			printf(", recording for %ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+		}
+		printf("\n");
+		printDistance("ultrasonic 1", snap.dist[0]);
+		printDistance("ultrasonic 2", snap.dist[1]);
+		printf("  every %d ms\n", snap.intervalMs);
+		printSound("sound 1", snap.soundMs[0], now);
+		printSound("sound 2", snap.soundMs[1], now);
+		printf("\n");
+		printf("  ultrasonic %7.2f /s   sound %6.1f s/min   polls %9.0f /s   records %7.2f /s\n",
+		       rate(snap.ultraSamples, before.ultraSamples, seconds),
+		       60 * rate(snap.soundSeconds, before.soundSeconds, seconds),
+		       rate(snap.polls, before.polls, seconds),
+		       rate(snap.records, before.records, seconds));
+		printf("  totals: %llu samples, %llu s of sound, %llu late polls this night, %llu gaps\n",
+		       (unsigned long long)snap.ultraSamples, (unsigned long long)snap.soundSeconds,
+		       (unsigned long long)snap.holes, (unsigned long long)snap.gaps);
+		printf("  a read takes %.0f ns, %d retries in 1000 reads, %d gave up\n", readNs, tries, failed);
+		if(!screen) {
+			printf("\n");
+		}
+		fflush(stdout);
+
+		before = snap;
+		beforeAt = at;
+	}
+	live_detach(seg);
+	return 0;
+}